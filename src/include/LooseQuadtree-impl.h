@@ -3,33 +3,63 @@
 
 #include "LooseQuadtree.h"
 
+#include <algorithm>
 #include <array>
+#include <atomic>
 #include <cassert>
+#include <chrono>
+#include <condition_variable>
 #include <cstddef>
+#include <cstdint>
+#include <cstdlib>
 #include <deque>
-#include <forward_list>
+#include <functional>
+#include <iterator>
 #include <limits>
-#include <map>
 #include <memory>
-#include <unordered_map>
+#include <mutex>
+#include <new>
+#include <thread>
 #include <type_traits>
+#include <utility>
 #include <vector>
 
+#ifdef _MSC_VER
+#include <malloc.h>
+#endif
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#endif
+
 namespace loose_quadtree {
 namespace detail {
 
 
 
 #define LQT_USE_OWN_ALLOCATOR
+#if defined(__x86_64__) && defined(__GNUC__)
+#define LQT_USE_SIMD
+#define LQT_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+
+void* AllocateAligned(std::size_t size, std::size_t alignment);
+void DeallocateAligned(void* p);
 
 
 class BlocksAllocator {
 public:
 	const static std::size_t kBlockAlign = alignof(long double);
 	const static std::size_t kBlockSize = 16384;
-	const static std::size_t kMaxAllowedAlloc = sizeof(void*) * 8;
+	const static std::size_t kMaxAllowedAlloc = sizeof(void*) * 64;
+	const static std::size_t kSizeClassStep = sizeof(void*);
+	const static std::size_t kSizeClasses = kMaxAllowedAlloc / kSizeClassStep;
 
-	BlocksAllocator();
+	explicit BlocksAllocator(BlockResource* block_resource = nullptr);
+	///< aligned heap allocation is used for blocks if block_resource is null
 	~BlocksAllocator();
 	BlocksAllocator(const BlocksAllocator&) = delete;
 	BlocksAllocator& operator=(const BlocksAllocator&) = delete;
@@ -42,29 +72,38 @@ public:
 	template <typename T>
 	void Delete(T* p);
 
-private:
-	using Block = std::aligned_storage<kBlockSize, kBlockAlign>::type;
+	///< sizes are rounded up to the next multiple of kSizeClassStep
+	constexpr static std::size_t GetSizeClass(std::size_t object_size) {
+		return object_size <= kSizeClassStep ? 0 : (object_size - 1) / kSizeClassStep;
+	}
+	constexpr static std::size_t GetSlotSize(std::size_t size_class) {
+		return (size_class + 1) * kSizeClassStep;
+	}
 
-	//template <std::size_t kSizeT>
-	//union Slot {
-	//	Slot* next_empty_slot;
-	//	std::array<char, kSizeT> data;
-	//};
+private:
+	// Blocks are aligned to kBlockSize, so the header of the owning block
+	// can be found by masking the address of any slot in it
+	struct BlockHeader {
+		BlockHeader* previous_block;
+		BlockHeader* next_block;
+		std::size_t empty_slots;
+	};
 
-	using BlocksAndEmptySlots = std::map<Block*, std::size_t>;
+	const static std::size_t kBlockHeaderSize =
+		(sizeof(BlockHeader) + kBlockAlign - 1) / kBlockAlign * kBlockAlign;
 
 	struct BlocksHead {
-		BlocksAndEmptySlots address_to_empty_slot_number;
+		BlockHeader* first_block;
 		void* first_empty_slot;
 		std::size_t slots_in_a_block_;
-
-		BlocksHead(std::size_t object_size) {
-			first_empty_slot = nullptr;
-			slots_in_a_block_ = kBlockSize / object_size;
-		}
 	};
 
-	std::map<std::size_t, BlocksHead> size_to_blocks_;
+	static BlockHeader* GetBlockHeader(void* slot);
+	void* AllocateBlock();
+	void DeallocateBlock(void* block);
+
+	BlockResource* block_resource_;
+	std::array<BlocksHead, kSizeClasses> size_classes_;
 };
 
 
@@ -105,42 +144,80 @@ struct BlocksAllocatorAdaptor {
 };
 
 
-BlocksAllocator::BlocksAllocator() {}
+inline void* AllocateAligned(std::size_t size, std::size_t alignment) {
+	void* p = nullptr;
+#ifdef _MSC_VER
+	p = _aligned_malloc(size, alignment);
+#else
+	if (posix_memalign(&p, alignment, size) != 0) {
+		p = nullptr;
+	}
+#endif
+	if (p == nullptr) {
+		throw std::bad_alloc();
+	}
+	return p;
+}
+
+
+inline void DeallocateAligned(void* p) {
+#ifdef _MSC_VER
+	_aligned_free(p);
+#else
+	free(p);
+#endif
+}
+
+
+inline BlocksAllocator::BlocksAllocator(BlockResource* block_resource) :
+	block_resource_(block_resource) {
+	for (std::size_t size_class = 0; size_class < kSizeClasses; size_class++) {
+		BlocksHead& blocks_head = size_classes_[size_class];
+		blocks_head.first_block = nullptr;
+		blocks_head.first_empty_slot = nullptr;
+		blocks_head.slots_in_a_block_ =
+			(kBlockSize - kBlockHeaderSize) / GetSlotSize(size_class);
+	}
+}
 
 
-BlocksAllocator::~BlocksAllocator() {
-	for (auto& size_block_pair : size_to_blocks_) {
-		BlocksHead& blocks_head = size_block_pair.second;
-		for (auto& address_empty_pair : blocks_head.address_to_empty_slot_number) {
-			assert(address_empty_pair.second == blocks_head.slots_in_a_block_);
-			Block* block = address_empty_pair.first;
-			delete block;
+inline BlocksAllocator::~BlocksAllocator() {
+	for (auto& blocks_head : size_classes_) {
+		BlockHeader* block = blocks_head.first_block;
+		while (block != nullptr) {
+			assert(block->empty_slots == blocks_head.slots_in_a_block_);
+			BlockHeader* next_block = block->next_block;
+			DeallocateBlock(block);
+			block = next_block;
 		}
 	}
 }
 
 
-void* BlocksAllocator::Allocate(std::size_t object_size) {
+inline void* BlocksAllocator::Allocate(std::size_t object_size) {
 #ifdef LQT_USE_OWN_ALLOCATOR
-	if (object_size < sizeof(void*)) object_size = sizeof(void*);
 	assert(object_size <= kMaxAllowedAlloc);
-	auto size_blocks_it = size_to_blocks_.find(object_size);
-	if (size_blocks_it == size_to_blocks_.end()) {
-		size_blocks_it = size_to_blocks_.emplace(object_size, object_size).first;
-	}
-	BlocksHead& blocks_head = size_blocks_it->second;
-	assert(blocks_head.slots_in_a_block_ == kBlockSize / object_size);
+	std::size_t size_class = GetSizeClass(object_size);
+	BlocksHead& blocks_head = size_classes_[size_class];
 	if (blocks_head.first_empty_slot == nullptr) {
-		Block* new_block = new Block();
+		std::size_t slot_size = GetSlotSize(size_class);
+		BlockHeader* new_block = reinterpret_cast<BlockHeader*>(AllocateBlock());
+		new_block->previous_block = nullptr;
+		new_block->next_block = blocks_head.first_block;
+		if (blocks_head.first_block != nullptr) {
+			blocks_head.first_block->previous_block = new_block;
+		}
+		blocks_head.first_block = new_block;
 		std::size_t empties = blocks_head.slots_in_a_block_;
-		blocks_head.address_to_empty_slot_number.emplace(new_block, empties);
-		blocks_head.first_empty_slot = reinterpret_cast<void*>(new_block);
-		void* current_slot = reinterpret_cast<void*>(new_block);
+		new_block->empty_slots = empties;
+		void* current_slot =
+			reinterpret_cast<void*>(reinterpret_cast<char*>(new_block) + kBlockHeaderSize);
+		blocks_head.first_empty_slot = current_slot;
 		empties--;
 		while (empties > 0) {
 			void* next_slot =
 				reinterpret_cast<void*>(reinterpret_cast<char*>(current_slot)
-						+ object_size);
+						+ slot_size);
 			*reinterpret_cast<void**>(current_slot) = next_slot;
 			current_slot = next_slot;
 			empties--;
@@ -150,18 +227,12 @@ void* BlocksAllocator::Allocate(std::size_t object_size) {
 	assert(blocks_head.first_empty_slot != nullptr);
 	void* slot = blocks_head.first_empty_slot;
 	blocks_head.first_empty_slot = *reinterpret_cast<void**>(slot);
-	auto address_empties_it =
-		blocks_head.address_to_empty_slot_number.upper_bound(reinterpret_cast<Block*>(slot));
-	assert(address_empties_it != blocks_head.address_to_empty_slot_number.begin());
-	address_empties_it--;
-	assert(address_empties_it->first <= reinterpret_cast<Block*>(slot) &&
-		(std::size_t)(reinterpret_cast<char*>(slot) -
-			reinterpret_cast<char*>(address_empties_it->first)) < kBlockSize);
+	BlockHeader* block = GetBlockHeader(slot);
 	assert((std::size_t)(reinterpret_cast<char*>(slot) -
-		reinterpret_cast<char*>(address_empties_it->first)) % object_size == 0);
-	assert(address_empties_it->second > 0 &&
-			address_empties_it->second <= blocks_head.slots_in_a_block_);
-	address_empties_it->second--;
+		reinterpret_cast<char*>(block) - kBlockHeaderSize) % GetSlotSize(size_class) == 0);
+	assert(block->empty_slots > 0 &&
+			block->empty_slots <= blocks_head.slots_in_a_block_);
+	block->empty_slots--;
 	return slot;
 #else
 	return reinterpret_cast<void*>(new char[object_size]);
@@ -169,30 +240,21 @@ void* BlocksAllocator::Allocate(std::size_t object_size) {
 }
 
 
-void BlocksAllocator::Deallocate(void* p, std::size_t object_size) {
+inline void BlocksAllocator::Deallocate(void* p, std::size_t object_size) {
 #ifdef LQT_USE_OWN_ALLOCATOR
-	if (object_size < sizeof(void*)) object_size = sizeof(void*);
 	assert(object_size <= kMaxAllowedAlloc);
-	auto size_blocks_it = size_to_blocks_.find(object_size);
-	assert(size_blocks_it != size_to_blocks_.end());
-	BlocksHead& blocks_head = size_blocks_it->second;
-	assert(blocks_head.slots_in_a_block_ == kBlockSize / object_size);
-	auto address_empties_it =
-		blocks_head.address_to_empty_slot_number.upper_bound(reinterpret_cast<Block*>(p));
-	assert(address_empties_it != blocks_head.address_to_empty_slot_number.begin());
-	address_empties_it--;
-	assert(address_empties_it->first <= reinterpret_cast<Block*>(p) &&
-		(std::size_t)(reinterpret_cast<char*>(p) -
-			reinterpret_cast<char*>(address_empties_it->first)) < kBlockSize);
+	std::size_t size_class = GetSizeClass(object_size);
+	BlocksHead& blocks_head = size_classes_[size_class];
+	BlockHeader* block = GetBlockHeader(p);
 	assert((std::size_t)(reinterpret_cast<char*>(p) -
-		reinterpret_cast<char*>(address_empties_it->first)) % object_size == 0);
-	assert(address_empties_it->second < blocks_head.slots_in_a_block_);
+		reinterpret_cast<char*>(block) - kBlockHeaderSize) % GetSlotSize(size_class) == 0);
+	assert(block->empty_slots < blocks_head.slots_in_a_block_);
 	void* slot = p;
 	*reinterpret_cast<void**>(slot) = blocks_head.first_empty_slot;
 	blocks_head.first_empty_slot = slot;
-	address_empties_it->second++;
-	assert(address_empties_it->second > 0 &&
-			address_empties_it->second <= blocks_head.slots_in_a_block_);
+	block->empty_slots++;
+	assert(block->empty_slots > 0 &&
+			block->empty_slots <= blocks_head.slots_in_a_block_);
 #else
 	(void)object_size;
 	delete[] reinterpret_cast<char*>(p);
@@ -200,46 +262,72 @@ void BlocksAllocator::Deallocate(void* p, std::size_t object_size) {
 }
 
 
-void BlocksAllocator::ReleaseFreeBlocks() {
-	for (auto& size_block_pair : size_to_blocks_) {
-		BlocksHead& blocks_head = size_block_pair.second;
+inline void BlocksAllocator::ReleaseFreeBlocks() {
+	for (auto& blocks_head : size_classes_) {
 		void** current = &blocks_head.first_empty_slot;
 		while (*current != nullptr) {
-			auto address_empties_it =
-				blocks_head.address_to_empty_slot_number.upper_bound(reinterpret_cast<Block*>(*current));
-			assert(address_empties_it != blocks_head.address_to_empty_slot_number.begin());
-			address_empties_it--;
-			assert(address_empties_it->first <= reinterpret_cast<Block*>(*current) &&
-				(std::size_t)(reinterpret_cast<char*>(*current) -
-					reinterpret_cast<char*>(address_empties_it->first)) < kBlockSize);
-			assert((std::size_t)(reinterpret_cast<char*>(*current) -
-				reinterpret_cast<char*>(address_empties_it->first)) % size_block_pair.first == 0);
-			assert(address_empties_it->second > 0 &&
-					address_empties_it->second <= blocks_head.slots_in_a_block_);
-			if (address_empties_it->second >= blocks_head.slots_in_a_block_) {
+			BlockHeader* block = GetBlockHeader(*current);
+			assert(block->empty_slots > 0 &&
+					block->empty_slots <= blocks_head.slots_in_a_block_);
+			if (block->empty_slots >= blocks_head.slots_in_a_block_) {
 				*current = **reinterpret_cast<void***>(current);
 			}
 			else {
 				current = *reinterpret_cast<void***>(current);
 			}
 		}
-		auto address_empties_it = blocks_head.address_to_empty_slot_number.begin();
-		while (address_empties_it != blocks_head.address_to_empty_slot_number.end()) {
-			if (address_empties_it->second >= blocks_head.slots_in_a_block_) {
-				auto prev_address_empties_it = address_empties_it;
-				address_empties_it++;
-				blocks_head.address_to_empty_slot_number.erase(prev_address_empties_it);
-			}
-			else {
-				address_empties_it++;
+		BlockHeader* block = blocks_head.first_block;
+		while (block != nullptr) {
+			BlockHeader* next_block = block->next_block;
+			if (block->empty_slots >= blocks_head.slots_in_a_block_) {
+				if (block->previous_block != nullptr) {
+					block->previous_block->next_block = next_block;
+				}
+				else {
+					blocks_head.first_block = next_block;
+				}
+				if (next_block != nullptr) {
+					next_block->previous_block = block->previous_block;
+				}
+				DeallocateBlock(block);
 			}
+			block = next_block;
 		}
 	}
 }
 
 
+inline auto BlocksAllocator::GetBlockHeader(void* slot) -> BlockHeader* {
+	BlockHeader* block = reinterpret_cast<BlockHeader*>(
+		reinterpret_cast<std::uintptr_t>(slot) & ~(std::uintptr_t)(kBlockSize - 1));
+	assert(reinterpret_cast<char*>(slot) >= reinterpret_cast<char*>(block) + kBlockHeaderSize);
+	return block;
+}
+
+
+inline void* BlocksAllocator::AllocateBlock() {
+	if (block_resource_ == nullptr) {
+		return AllocateAligned(kBlockSize, kBlockSize);
+	}
+	void* block = block_resource_->AllocateBlock(kBlockSize);
+	assert((reinterpret_cast<std::uintptr_t>(block) & (kBlockSize - 1)) == 0);
+	return block;
+}
+
+
+inline void BlocksAllocator::DeallocateBlock(void* block) {
+	if (block_resource_ == nullptr) {
+		DeallocateAligned(block);
+	}
+	else {
+		block_resource_->DeallocateBlock(block, kBlockSize);
+	}
+}
+
+
 template <typename T, typename... Args>
 T* BlocksAllocator::New(Args&&... args) {
+	static_assert(sizeof(T) <= kMaxAllowedAlloc, "Type is too big for the allocator");
 	return new(Allocate(sizeof(T))) T(std::forward<Args>(args)...);
 }
 
@@ -294,498 +382,2230 @@ void BlocksAllocatorAdaptor<T>::deallocate(T* p, std::size_t n) {
 
 
 
-template <typename NumberT>
-struct MakeDistance { using Type = typename std::make_unsigned<NumberT>::type;};
-
-template <>
-struct MakeDistance<float> { using Type = float;};
+} //detail
 
-template <>
-struct MakeDistance<double> { using Type = double;};
 
-template <>
-struct MakeDistance<long double> { using Type = long double;};
 
+inline HugePageBlockResource::HugePageBlockResource() :
+	first_free_block_(nullptr), unused_begin_(nullptr), unused_end_(nullptr) {
+}
 
 
-enum class ChildPosition {
-	kNone,
-	kTopLeft,
-	kTopRight,
-	kBottomRight,
-	kBottomLeft,
-};
+inline HugePageBlockResource::~HugePageBlockResource() {
+	for (void* page : pages_) {
+#ifdef __linux__
+		munmap(page, kPageSize);
+#else
+		detail::DeallocateAligned(page);
+#endif
+	}
+}
 
 
+inline void* HugePageBlockResource::AllocateBlock(std::size_t block_size) {
+	assert(block_size > 0 && kPageSize % block_size == 0);
+	assert(block_size >= sizeof(void*));
+	if (first_free_block_ != nullptr) {
+		void* block = first_free_block_;
+		first_free_block_ = *reinterpret_cast<void**>(block);
+		return block;
+	}
+	if (unused_begin_ == unused_end_) {
+		void* page;
+#ifdef __linux__
+		// map twice the size so that a page aligned to kPageSize can be cut out of it
+		void* mapping = mmap(nullptr, kPageSize * 2, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (mapping == MAP_FAILED) {
+			throw std::bad_alloc();
+		}
+		std::uintptr_t mapping_begin = reinterpret_cast<std::uintptr_t>(mapping);
+		std::uintptr_t page_begin =
+			(mapping_begin + kPageSize - 1) & ~(std::uintptr_t)(kPageSize - 1);
+		if (page_begin > mapping_begin) {
+			munmap(mapping, page_begin - mapping_begin);
+		}
+		if (mapping_begin + kPageSize > page_begin) {
+			munmap(reinterpret_cast<void*>(page_begin + kPageSize),
+					mapping_begin + kPageSize - page_begin);
+		}
+		page = reinterpret_cast<void*>(page_begin);
+#ifdef MADV_HUGEPAGE
+		madvise(page, kPageSize, MADV_HUGEPAGE);
+#endif
+#else
+		page = detail::AllocateAligned(kPageSize, kPageSize);
+#endif
+		pages_.push_back(page);
+		unused_begin_ = reinterpret_cast<char*>(page);
+		unused_end_ = unused_begin_ + kPageSize;
+	}
+	void* block = unused_begin_;
+	unused_begin_ += block_size;
+	return block;
+}
 
-template <typename ObjectT>
-struct TreeNode {
-	using Object = ObjectT;
-	using ObjectContainer =
-		std::forward_list<Object*, BlocksAllocatorAdaptor<Object*>>;
 
-	TreeNode(BlocksAllocator& allocator) :
-		top_left(nullptr), top_right(nullptr), bottom_right(nullptr),
-		bottom_left(nullptr), objects(BlocksAllocatorAdaptor<Object*>(allocator))
-	{}
+inline void HugePageBlockResource::DeallocateBlock(void* block, std::size_t block_size) {
+	(void)block_size;
+	*reinterpret_cast<void**>(block) = first_free_block_;
+	first_free_block_ = block;
+}
 
-	TreeNode<Object>* top_left;
-	TreeNode<Object>* top_right;
-	TreeNode<Object>* bottom_right;
-	TreeNode<Object>* bottom_left;
-	ObjectContainer objects;
-};
 
 
+inline MemoryArena::MemoryArena() : allocator_(new detail::BlocksAllocator()) {
+}
 
-template <typename NumberT, typename ObjectT>
-class ForwardTreeTraversal {
-public:
-	using Number = NumberT;
-	using Object = ObjectT;
 
-	struct TreePosition {
-		TreePosition(const BoundingBox<Number>& _bbox, TreeNode<Object>* _node) :
-			bounding_box(_bbox), node(_node) {
-			current_child = ChildPosition::kNone;
-		}
+inline MemoryArena::MemoryArena(BlockResource& block_resource) :
+	allocator_(new detail::BlocksAllocator(&block_resource)) {
+}
 
-		BoundingBox<Number> bounding_box;
-		TreeNode<Object>* node;
-		ChildPosition current_child;
-	};
 
-	ForwardTreeTraversal();
-	void StartAt(TreeNode<Object>* root, const BoundingBox<Number>& root_bounds);
-	int GetDepth() const; ///< starting from 0
-	TreeNode<Object>* GetNode() const;
-	const BoundingBox<Number>& GetNodeBoundingBox() const;
-	void GoTopLeft();
-	void GoTopRight();
-	void GoBottomRight();
-	void GoBottomLeft();
+inline MemoryArena::~MemoryArena() {
+	delete allocator_;
+}
 
-protected:
-	TreePosition position_;
-	int depth_;
-};
 
+inline void MemoryArena::ReleaseFreeBlocks() {
+	allocator_->ReleaseFreeBlocks();
+}
 
 
-template <typename NumberT, typename ObjectT>
-class FullTreeTraversal : public ForwardTreeTraversal<NumberT, ObjectT> {
-public:
-	using Number = NumberT;
-	using Object = ObjectT;
-	using typename ForwardTreeTraversal<Number, Object>::TreePosition;
 
-	void StartAt(TreeNode<Object>* root, const BoundingBox<Number>& root_bounds);
-	ChildPosition GetNodeCurrentChild() const;
-	void SetNodeCurrentChild(ChildPosition child_position);
-	void GoUp();
-	void GoTopLeft();
-	void GoTopRight();
-	void GoBottomRight();
-	void GoBottomLeft();
+inline ThreadPool::ThreadPool(int threads) : stopping_(false) {
+	assert(threads >= 0);
+	for (int i = 0; i < threads; i++) {
+		threads_.emplace_back(&ThreadPool::Work, this);
+	}
+}
 
-private:
-	using ForwardTreeTraversal<Number, Object>::position_;
-	using ForwardTreeTraversal<Number, Object>::depth_;
 
-	std::vector<TreePosition> position_stack_;
-};
+inline ThreadPool::~ThreadPool() {
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		stopping_ = true;
+	}
+	task_queued_.notify_all();
+	for (std::thread& thread : threads_) {
+		thread.join();
+	}
+}
 
 
+inline int ThreadPool::GetThreadCount() const {
+	return (int)threads_.size();
+}
 
-} //detail
 
+inline void ThreadPool::operator()(std::function<void()> task) {
+	if (threads_.empty()) {
+		task(); // nothing would ever take it from the queue
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		tasks_.push_back(std::move(task));
+	}
+	task_queued_.notify_one();
+}
 
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
-class
-	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT>::Query::
-Impl {
-public:
-	enum class QueryType {kIntersects, kInside, kContains, kEndOfQuery};
+inline void ThreadPool::Work() {
+	do {
+		std::function<void()> task;
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			task_queued_.wait(lock, [this]() {
+				return stopping_ || !tasks_.empty();
+			});
+			if (tasks_.empty()) {
+				return;
+			}
+			task = std::move(tasks_.front());
+			tasks_.pop_front();
+		}
+		task();
+	} while (true);
+}
 
-	Impl();
-	void Acquire(typename LooseQuadtree<Number, Object, BoundingBoxExtractor>::Impl* quadtree,
-		const BoundingBox<Number>* query_region, QueryType query_type);
-	void Release();
-	bool IsAvailable() const;
-	bool EndOfQuery() const;
-	Object* GetCurrent() const;
-	void Next();
 
-private:
-	enum class FitType {kNoFit = 0, kPartialFit, kFreeRide};
 
-	bool CurrentObjectFits() const;
-	FitType CurrentNodeFits() const;
+namespace detail {
 
-	typename LooseQuadtree<Number, Object, BoundingBoxExtractor>::Impl* quadtree_;
-	detail::FullTreeTraversal<Number, Object> traversal_;
-	typename detail::TreeNode<Object>::ObjectContainer::iterator object_iterator_;
-	typename detail::TreeNode<Object>::ObjectContainer::iterator object_iterator_before_;
-	BoundingBox<Number> query_region_;
-	QueryType query_type_;
-	int free_ride_from_level_;
-};
 
 
+template <typename NumberT>
+struct MakeDistance { using Type = typename std::make_unsigned<NumberT>::type;};
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
-class
-	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT>::
-Impl {
-public:
-	constexpr static int kInternalMinDepth = 4;
-	constexpr static int kInternalMaxDepth = (sizeof(long long) * 8 - 1) / 2;
-	constexpr static Number kMinimalObjectExtent =
-		std::is_integral<Number>::value ? 1 :
-			std::numeric_limits<Number>::min() * 16;
+template <>
+struct MakeDistance<float> { using Type = float;};
 
-	Impl();
-	~Impl();
-	Impl(const Impl&) = delete;
-	Impl& operator=(const Impl&) = delete;
+template <>
+struct MakeDistance<double> { using Type = double;};
 
-	bool Insert(Object* object);
-	bool Update(Object* object);
-	bool Remove(Object* object);
-	bool Contains(Object* object) const;
-	Query QueryIntersectsRegion(const BoundingBox<Number>& region);
-	Query QueryInsideRegion(const BoundingBox<Number>& region);
-	Query QueryContainsRegion(const BoundingBox<Number>& region);
-	const BoundingBox<Number>& GetBoundingBox() const; ///< loose sense bounds
-	int GetSize() const;
-	void Clear();
-	void ForceCleanup();
+template <>
+struct MakeDistance<long double> { using Type = long double;};
 
-private:
-	friend class Query::Impl;
-	using ObjectPointerContainer =
-		std::unordered_map<Object*, Object**,
-		std::hash<Object*>, std::equal_to<Object*>,
-		detail::BlocksAllocatorAdaptor<std::pair<Object *const, Object**>>>;
-	using QueryPoolContainer =
-		std::deque<typename LooseQuadtree<Number, Object, BoundingBoxExtractor>::Query::Impl>;
 
-	void RecalculateMaximalDepth();
-	void DeleteTree();
-	Object** InsertIntoTree(Object* object);
-	typename Query::Impl* GetAvailableQueryFromPool();
 
-	detail::BlocksAllocator allocator_;
-	detail::TreeNode<Object>* root_;
-	BoundingBox<Number> bounding_box_;
-	ObjectPointerContainer object_pointers_;
-	int number_of_objects_;
-	int maximal_depth_;
-	detail::FullTreeTraversal<Number, Object> internal_traversal_;
-	QueryPoolContainer query_pool_;
-	int running_queries_; ///< queries which are opened and not at their end
+enum class ChildPosition {
+	kNone,
+	kTopLeft,
+	kTopRight,
+	kBottomRight,
+	kBottomLeft,
 };
 
+// Extends the bounds by half of their size on every side
+// Unsigned types would wrap around below 0, the bounds are cut there instead
+template <typename NumberT>
+BoundingBox<NumberT> GetLooseBounds(const BoundingBox<NumberT>& node_bounds) {
+	BoundingBox<NumberT> loose_bounds = node_bounds;
+	NumberT half_width =
+		(NumberT)((typename MakeDistance<NumberT>::Type)node_bounds.width / 2);
+	NumberT half_height =
+		(NumberT)((typename MakeDistance<NumberT>::Type)node_bounds.height / 2);
+	loose_bounds.width = (NumberT)(loose_bounds.width * 2);
+	loose_bounds.height = (NumberT)(loose_bounds.height * 2);
+	loose_bounds.left = (NumberT)(loose_bounds.left - half_width);
+	loose_bounds.top = (NumberT)(loose_bounds.top - half_height);
+	if (loose_bounds.left > node_bounds.left) {
+		loose_bounds.width = (NumberT)(node_bounds.left + loose_bounds.width - half_width);
+		loose_bounds.left = 0;
+	}
+	if (loose_bounds.top > node_bounds.top) {
+		loose_bounds.height = (NumberT)(node_bounds.top + loose_bounds.height - half_height);
+		loose_bounds.top = 0;
+	}
+	return loose_bounds;
+}
+
+// Left and top halves are rounded down for integral types, right and bottom ones get the rest
+template <typename NumberT>
+BoundingBox<NumberT> GetChildBounds(const BoundingBox<NumberT>& parent_bounds,
+		ChildPosition child_position) {
+	BoundingBox<NumberT> bbox = parent_bounds;
+	NumberT right = (NumberT)(bbox.left + bbox.width);
+	NumberT bottom = (NumberT)(bbox.top + bbox.height);
+	NumberT half_width = (NumberT)((typename MakeDistance<NumberT>::Type)bbox.width / 2);
+	NumberT half_height = (NumberT)((typename MakeDistance<NumberT>::Type)bbox.height / 2);
+	if (child_position == ChildPosition::kTopLeft ||
+			child_position == ChildPosition::kBottomLeft) {
+		bbox.width = half_width;
+	}
+	else {
+		assert(child_position != ChildPosition::kNone);
+		bbox.left = (NumberT)(bbox.left + half_width);
+		bbox.width = (NumberT)(right - bbox.left);
+	}
+	if (child_position == ChildPosition::kTopLeft ||
+			child_position == ChildPosition::kTopRight) {
+		bbox.height = half_height;
+	}
+	else {
+		bbox.top = (NumberT)(bbox.top + half_height);
+		bbox.height = (NumberT)(bottom - bbox.top);
+	}
+	return bbox;
+}
+
 
 
+// Cached bounding boxes are stored as separate arrays of lefts, tops, widths and heights
+template <typename NumberT, std::size_t kSlotsT, bool kCacheBoundingBoxesT>
+struct BoundsSlots {
+	NumberT* GetBoundsData() {return nullptr;}
+};
 
+template <typename NumberT, std::size_t kSlotsT>
+struct BoundsSlots<NumberT, kSlotsT, true> {
+	NumberT* GetBoundsData() {return bounds;}
+	NumberT bounds[kSlotsT * 4];
+};
 
+template <typename NumberT, bool kCacheBoundingBoxesT>
+struct BoundsAccess {
+	static BoundingBox<NumberT> Load(const NumberT*, std::size_t) {
+		assert(false);
+		return BoundingBox<NumberT>(0, 0, 0, 0);
+	}
+	static void Store(NumberT*, std::size_t, const BoundingBox<NumberT>&) {}
+	static void Copy(NumberT*, std::size_t, const NumberT*, std::size_t) {}
+	static NumberT* Offset(NumberT*, std::size_t) {return nullptr;}
+};
 
 template <typename NumberT>
-bool
-	BoundingBox<NumberT>::
-Intersects(const BoundingBox<Number>& other) const {
-	return !(
-		left + width <= other.left || other.left + other.width <= left ||
-		top + height <= other.top || other.top + other.height <= top
-		);
+struct BoundsAccess<NumberT, true> {
+	static BoundingBox<NumberT> Load(const NumberT* bounds, std::size_t stride) {
+		return BoundingBox<NumberT>(bounds[0], bounds[stride],
+				bounds[stride * 2], bounds[stride * 3]);
+	}
+	static void Store(NumberT* bounds, std::size_t stride, const BoundingBox<NumberT>& bbox) {
+		bounds[0] = bbox.left;
+		bounds[stride] = bbox.top;
+		bounds[stride * 2] = bbox.width;
+		bounds[stride * 3] = bbox.height;
+	}
+	static void Copy(NumberT* to, std::size_t to_stride,
+			const NumberT* from, std::size_t from_stride) {
+		Store(to, to_stride, Load(from, from_stride));
+	}
+	static NumberT* Offset(NumberT* bounds, std::size_t index) {return bounds + index;}
+};
+
+enum class BoundsTest {kIntersects, kInside, kContains};
+
+inline int CountTrailingZeros(std::uint64_t mask) {
+	assert(mask != 0);
+#ifdef __GNUC__
+	return __builtin_ctzll(mask);
+#else
+	int zeros = 0;
+	while ((mask & 1) == 0) {
+		mask >>= 1;
+		zeros++;
+	}
+	return zeros;
+#endif
 }
 
+// Tests boxes [first, count) of arrays holding lefts, tops, widths and heights stride apart
+// Bit i of the result is set if box i passed, so count can be at most 64
 template <typename NumberT>
-bool
-	BoundingBox<NumberT>::
-Contains(const BoundingBox<Number>& other)  const {
-	return left <= other.left && left + width >= other.left + other.width &&
-		top <= other.top && top + height >= other.top + other.height;
+std::uint64_t TestBoundsScalar(BoundsTest test, const NumberT* bounds, std::size_t stride,
+		std::size_t first, std::size_t count, const BoundingBox<NumberT>& region) {
+	std::uint64_t mask = 0;
+	for (std::size_t i = first; i < count; i++) {
+		BoundingBox<NumberT> bbox(bounds[i], bounds[stride + i],
+				bounds[stride * 2 + i], bounds[stride * 3 + i]);
+		bool passed = false;
+		switch (test) {
+		case BoundsTest::kIntersects:
+			passed = region.Intersects(bbox);
+			break;
+		case BoundsTest::kInside:
+			passed = region.Contains(bbox);
+			break;
+		case BoundsTest::kContains:
+			passed = bbox.Contains(region);
+			break;
+		}
+		mask |= (std::uint64_t)passed << i;
+	}
+	return mask;
 }
 
+// Same as TestBoundsScalar() but vectorized where possible, results are identical
 template <typename NumberT>
-bool
-	BoundingBox<NumberT>::
-Contains(Number x, Number y) const {
-	return left <= x && x < left + width &&
-		top <= y && y < top + height;
+struct BoundsTester {
+	static std::uint64_t Test(BoundsTest test, const NumberT* bounds, std::size_t stride,
+			std::size_t count, const BoundingBox<NumberT>& region) {
+		return TestBoundsScalar(test, bounds, stride, 0, count, region);
+	}
+};
+
+#ifdef LQT_USE_SIMD
+
+inline bool CpuSupportsAvx2() {
+	static const bool supported = []() {
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("avx2") != 0;
+	}();
+	return supported;
 }
 
+// LessEqual() is false for NaNs while NotLessEqual() is true, same as the scalar operators
+struct Sse2FloatOps {
+	using Number = float;
+	using Vector = __m128;
+	constexpr static std::size_t kWidth = 4;
+	static Vector Load(const float* p) {return _mm_loadu_ps(p);}
+	static Vector Broadcast(float x) {return _mm_set1_ps(x);}
+	static Vector Add(Vector a, Vector b) {return _mm_add_ps(a, b);}
+	static Vector And(Vector a, Vector b) {return _mm_and_ps(a, b);}
+	static Vector LessEqual(Vector a, Vector b) {return _mm_cmple_ps(a, b);}
+	static Vector NotLessEqual(Vector a, Vector b) {return _mm_cmpnle_ps(a, b);}
+	static int MoveMask(Vector a) {return _mm_movemask_ps(a);}
+};
 
+struct Sse2DoubleOps {
+	using Number = double;
+	using Vector = __m128d;
+	constexpr static std::size_t kWidth = 2;
+	static Vector Load(const double* p) {return _mm_loadu_pd(p);}
+	static Vector Broadcast(double x) {return _mm_set1_pd(x);}
+	static Vector Add(Vector a, Vector b) {return _mm_add_pd(a, b);}
+	static Vector And(Vector a, Vector b) {return _mm_and_pd(a, b);}
+	static Vector LessEqual(Vector a, Vector b) {return _mm_cmple_pd(a, b);}
+	static Vector NotLessEqual(Vector a, Vector b) {return _mm_cmpnle_pd(a, b);}
+	static int MoveMask(Vector a) {return _mm_movemask_pd(a);}
+};
 
-template <typename NumberT, typename ObjectT>
-	detail::ForwardTreeTraversal<NumberT, ObjectT>::
-ForwardTreeTraversal() :
-	position_(BoundingBox<Number>(0, 0, 0, 0), nullptr), depth_(0) {
-}
+struct Sse2IntOps {
+	using Number = int;
+	using Vector = __m128i;
+	constexpr static std::size_t kWidth = 4;
+	static Vector Load(const int* p) {return _mm_loadu_si128((const __m128i*)p);}
+	static Vector Broadcast(int x) {return _mm_set1_epi32(x);}
+	static Vector Add(Vector a, Vector b) {return _mm_add_epi32(a, b);}
+	static Vector And(Vector a, Vector b) {return _mm_and_si128(a, b);}
+	static Vector LessEqual(Vector a, Vector b) {
+		return _mm_xor_si128(_mm_cmpgt_epi32(a, b), _mm_set1_epi32(-1));
+	}
+	static Vector NotLessEqual(Vector a, Vector b) {return _mm_cmpgt_epi32(a, b);}
+	static int MoveMask(Vector a) {return _mm_movemask_ps(_mm_castsi128_ps(a));}
+};
 
-template <typename NumberT, typename ObjectT>
-void
-	detail::ForwardTreeTraversal<NumberT, ObjectT>::
-StartAt(TreeNode<Object>* root, const BoundingBox<Number>& root_bounds) {
-	position_.bounding_box = root_bounds;
-	position_.node = root;
-	depth_ = 0;
-}
+struct Avx2FloatOps {
+	using Number = float;
+	using Vector = __m256;
+	constexpr static std::size_t kWidth = 8;
+	LQT_TARGET_AVX2 static Vector Load(const float* p) {return _mm256_loadu_ps(p);}
+	LQT_TARGET_AVX2 static Vector Broadcast(float x) {return _mm256_set1_ps(x);}
+	LQT_TARGET_AVX2 static Vector Add(Vector a, Vector b) {return _mm256_add_ps(a, b);}
+	LQT_TARGET_AVX2 static Vector And(Vector a, Vector b) {return _mm256_and_ps(a, b);}
+	LQT_TARGET_AVX2 static Vector LessEqual(Vector a, Vector b) {
+		return _mm256_cmp_ps(a, b, _CMP_LE_OQ);
+	}
+	LQT_TARGET_AVX2 static Vector NotLessEqual(Vector a, Vector b) {
+		return _mm256_cmp_ps(a, b, _CMP_NLE_UQ);
+	}
+	LQT_TARGET_AVX2 static int MoveMask(Vector a) {return _mm256_movemask_ps(a);}
+};
 
-template <typename NumberT, typename ObjectT>
-int
-	detail::ForwardTreeTraversal<NumberT, ObjectT>::
-GetDepth() const {
-	return depth_;
-}
+struct Avx2DoubleOps {
+	using Number = double;
+	using Vector = __m256d;
+	constexpr static std::size_t kWidth = 4;
+	LQT_TARGET_AVX2 static Vector Load(const double* p) {return _mm256_loadu_pd(p);}
+	LQT_TARGET_AVX2 static Vector Broadcast(double x) {return _mm256_set1_pd(x);}
+	LQT_TARGET_AVX2 static Vector Add(Vector a, Vector b) {return _mm256_add_pd(a, b);}
+	LQT_TARGET_AVX2 static Vector And(Vector a, Vector b) {return _mm256_and_pd(a, b);}
+	LQT_TARGET_AVX2 static Vector LessEqual(Vector a, Vector b) {
+		return _mm256_cmp_pd(a, b, _CMP_LE_OQ);
+	}
+	LQT_TARGET_AVX2 static Vector NotLessEqual(Vector a, Vector b) {
+		return _mm256_cmp_pd(a, b, _CMP_NLE_UQ);
+	}
+	LQT_TARGET_AVX2 static int MoveMask(Vector a) {return _mm256_movemask_pd(a);}
+};
 
-template <typename NumberT, typename ObjectT>
-detail::TreeNode<ObjectT>*
-	detail::ForwardTreeTraversal<NumberT, ObjectT>::
-GetNode() const {
-	return position_.node;
-}
+struct Avx2IntOps {
+	using Number = int;
+	using Vector = __m256i;
+	constexpr static std::size_t kWidth = 8;
+	LQT_TARGET_AVX2 static Vector Load(const int* p) {
+		return _mm256_loadu_si256((const __m256i*)p);
+	}
+	LQT_TARGET_AVX2 static Vector Broadcast(int x) {return _mm256_set1_epi32(x);}
+	LQT_TARGET_AVX2 static Vector Add(Vector a, Vector b) {return _mm256_add_epi32(a, b);}
+	LQT_TARGET_AVX2 static Vector And(Vector a, Vector b) {return _mm256_and_si256(a, b);}
+	LQT_TARGET_AVX2 static Vector LessEqual(Vector a, Vector b) {
+		return _mm256_xor_si256(_mm256_cmpgt_epi32(a, b), _mm256_set1_epi32(-1));
+	}
+	LQT_TARGET_AVX2 static Vector NotLessEqual(Vector a, Vector b) {
+		return _mm256_cmpgt_epi32(a, b);
+	}
+	LQT_TARGET_AVX2 static int MoveMask(Vector a) {
+		return _mm256_movemask_ps(_mm256_castsi256_ps(a));
+	}
+};
 
-template <typename NumberT, typename ObjectT>
-const BoundingBox<NumberT>&
-	detail::ForwardTreeTraversal<NumberT, ObjectT>::
-GetNodeBoundingBox() const {
-	return position_.bounding_box;
+// The two kernels only differ in their target, code using AVX2 registers can not be shared
+template <typename OpsT>
+std::uint64_t TestBoundsSse2(BoundsTest test, const typename OpsT::Number* bounds,
+		std::size_t stride, std::size_t count, const BoundingBox<typename OpsT::Number>& region) {
+	using Vector = typename OpsT::Vector;
+	const Vector region_left = OpsT::Broadcast(region.left);
+	const Vector region_top = OpsT::Broadcast(region.top);
+	const Vector region_right = OpsT::Broadcast(region.left + region.width);
+	const Vector region_bottom = OpsT::Broadcast(region.top + region.height);
+	std::uint64_t mask = 0;
+	std::size_t i = 0;
+	for (; i + OpsT::kWidth <= count; i += OpsT::kWidth) {
+		const Vector left = OpsT::Load(bounds + i);
+		const Vector top = OpsT::Load(bounds + stride + i);
+		const Vector right = OpsT::Add(left, OpsT::Load(bounds + stride * 2 + i));
+		const Vector bottom = OpsT::Add(top, OpsT::Load(bounds + stride * 3 + i));
+		Vector passed;
+		switch (test) {
+		case BoundsTest::kIntersects:
+			passed = OpsT::And(
+				OpsT::And(OpsT::NotLessEqual(right, region_left),
+					OpsT::NotLessEqual(region_right, left)),
+				OpsT::And(OpsT::NotLessEqual(bottom, region_top),
+					OpsT::NotLessEqual(region_bottom, top)));
+			break;
+		case BoundsTest::kInside:
+			passed = OpsT::And(
+				OpsT::And(OpsT::LessEqual(region_left, left),
+					OpsT::LessEqual(right, region_right)),
+				OpsT::And(OpsT::LessEqual(region_top, top),
+					OpsT::LessEqual(bottom, region_bottom)));
+			break;
+		default: // BoundsTest::kContains
+			passed = OpsT::And(
+				OpsT::And(OpsT::LessEqual(left, region_left),
+					OpsT::LessEqual(region_right, right)),
+				OpsT::And(OpsT::LessEqual(top, region_top),
+					OpsT::LessEqual(region_bottom, bottom)));
+			break;
+		}
+		mask |= (std::uint64_t)OpsT::MoveMask(passed) << i;
+	}
+	return mask | TestBoundsScalar(test, bounds, stride, i, count, region);
 }
 
-template <typename NumberT, typename ObjectT>
-void
-	detail::ForwardTreeTraversal<NumberT, ObjectT>::
-GoTopLeft() {
-	BoundingBox<Number>& bbox = position_.bounding_box;
-	bbox.width = (Number)((typename MakeDistance<Number>::Type)bbox.width / 2);
-	bbox.height = (Number)((typename MakeDistance<Number>::Type)bbox.height / 2);
-	position_.node = position_.node->top_left;
-	assert(position_.node != nullptr);
-	depth_++;
+template <typename OpsT>
+LQT_TARGET_AVX2
+std::uint64_t TestBoundsAvx2(BoundsTest test, const typename OpsT::Number* bounds,
+		std::size_t stride, std::size_t count, const BoundingBox<typename OpsT::Number>& region) {
+	using Vector = typename OpsT::Vector;
+	const Vector region_left = OpsT::Broadcast(region.left);
+	const Vector region_top = OpsT::Broadcast(region.top);
+	const Vector region_right = OpsT::Broadcast(region.left + region.width);
+	const Vector region_bottom = OpsT::Broadcast(region.top + region.height);
+	std::uint64_t mask = 0;
+	std::size_t i = 0;
+	for (; i + OpsT::kWidth <= count; i += OpsT::kWidth) {
+		const Vector left = OpsT::Load(bounds + i);
+		const Vector top = OpsT::Load(bounds + stride + i);
+		const Vector right = OpsT::Add(left, OpsT::Load(bounds + stride * 2 + i));
+		const Vector bottom = OpsT::Add(top, OpsT::Load(bounds + stride * 3 + i));
+		Vector passed;
+		switch (test) {
+		case BoundsTest::kIntersects:
+			passed = OpsT::And(
+				OpsT::And(OpsT::NotLessEqual(right, region_left),
+					OpsT::NotLessEqual(region_right, left)),
+				OpsT::And(OpsT::NotLessEqual(bottom, region_top),
+					OpsT::NotLessEqual(region_bottom, top)));
+			break;
+		case BoundsTest::kInside:
+			passed = OpsT::And(
+				OpsT::And(OpsT::LessEqual(region_left, left),
+					OpsT::LessEqual(right, region_right)),
+				OpsT::And(OpsT::LessEqual(region_top, top),
+					OpsT::LessEqual(bottom, region_bottom)));
+			break;
+		default: // BoundsTest::kContains
+			passed = OpsT::And(
+				OpsT::And(OpsT::LessEqual(left, region_left),
+					OpsT::LessEqual(region_right, right)),
+				OpsT::And(OpsT::LessEqual(top, region_top),
+					OpsT::LessEqual(region_bottom, bottom)));
+			break;
+		}
+		mask |= (std::uint64_t)OpsT::MoveMask(passed) << i;
+	}
+	return mask | TestBoundsScalar(test, bounds, stride, i, count, region);
 }
 
-template <typename NumberT, typename ObjectT>
-void
-	detail::ForwardTreeTraversal<NumberT, ObjectT>::
-GoTopRight() {
-	BoundingBox<Number>& bbox = position_.bounding_box;
-	Number right = (Number)(bbox.left + bbox.width);
-	bbox.left = (Number)(bbox.left +
-			(Number)((typename MakeDistance<Number>::Type)bbox.width / 2));
-	bbox.width = (Number)(right - bbox.left);
-	bbox.height = (Number)((typename MakeDistance<Number>::Type)bbox.height / 2);
-	position_.node = position_.node->top_right;
-	assert(position_.node != nullptr);
-	depth_++;
-}
+template <>
+struct BoundsTester<float> {
+	static std::uint64_t Test(BoundsTest test, const float* bounds, std::size_t stride,
+			std::size_t count, const BoundingBox<float>& region) {
+		return CpuSupportsAvx2() ?
+			TestBoundsAvx2<Avx2FloatOps>(test, bounds, stride, count, region) :
+			TestBoundsSse2<Sse2FloatOps>(test, bounds, stride, count, region);
+	}
+};
 
-template <typename NumberT, typename ObjectT>
-void
-	detail::ForwardTreeTraversal<NumberT, ObjectT>::
-GoBottomRight() {
-	BoundingBox<Number>& bbox = position_.bounding_box;
-	Number right = (Number)(bbox.left + bbox.width);
-	bbox.left = (Number)(bbox.left +
-			(Number)((typename MakeDistance<Number>::Type)bbox.width / 2));
-	bbox.width = (Number)(right - bbox.left);
-	Number bottom = (Number)(bbox.top + bbox.height);
-	bbox.top = (Number)(bbox.top +
-			(Number)((typename MakeDistance<Number>::Type)bbox.height / 2));
-	bbox.height = (Number)(bottom - bbox.top);
-	position_.node = position_.node->bottom_right;
-	assert(position_.node != nullptr);
-	depth_++;
-}
+template <>
+struct BoundsTester<double> {
+	static std::uint64_t Test(BoundsTest test, const double* bounds, std::size_t stride,
+			std::size_t count, const BoundingBox<double>& region) {
+		return CpuSupportsAvx2() ?
+			TestBoundsAvx2<Avx2DoubleOps>(test, bounds, stride, count, region) :
+			TestBoundsSse2<Sse2DoubleOps>(test, bounds, stride, count, region);
+	}
+};
 
-template <typename NumberT, typename ObjectT>
-void
-	detail::ForwardTreeTraversal<NumberT, ObjectT>::
-GoBottomLeft() {
-	BoundingBox<Number>& bbox = position_.bounding_box;
-	bbox.width = (Number)((typename MakeDistance<Number>::Type)bbox.width / 2);
-	Number bottom = (Number)(bbox.top + bbox.height);
-	bbox.top = (Number)(bbox.top +
-			(Number)((typename MakeDistance<Number>::Type)bbox.height / 2));
-	bbox.height = (Number)(bottom - bbox.top);
-	position_.node = position_.node->bottom_left;
-	assert(position_.node != nullptr);
-	depth_++;
-}
+template <>
+struct BoundsTester<int> {
+	static std::uint64_t Test(BoundsTest test, const int* bounds, std::size_t stride,
+			std::size_t count, const BoundingBox<int>& region) {
+		return CpuSupportsAvx2() ?
+			TestBoundsAvx2<Avx2IntOps>(test, bounds, stride, count, region) :
+			TestBoundsSse2<Sse2IntOps>(test, bounds, stride, count, region);
+	}
+};
 
+#endif
 
 
-template <typename NumberT, typename ObjectT>
-void
-	detail::FullTreeTraversal<NumberT, ObjectT>::
-StartAt(TreeNode<Object>* root, const BoundingBox<Number>& root_bounds) {
-	ForwardTreeTraversal<Number, Object>::StartAt(root, root_bounds);
-	position_.current_child = ChildPosition::kNone;
-	position_stack_.clear();
-}
 
-template <typename NumberT, typename ObjectT>
-detail::ChildPosition
-	detail::FullTreeTraversal<NumberT, ObjectT>::
-GetNodeCurrentChild() const {
-	return position_.current_child;
+// Visitors either return whether to go on or nothing at all
+template <typename VisitorT, typename... ArgsT>
+auto CallVisitor(VisitorT& visitor, ArgsT... args) ->
+		typename std::enable_if<std::is_void<decltype(visitor(args...))>::value, bool>::type {
+	visitor(args...);
+	return true;
 }
 
-template <typename NumberT, typename ObjectT>
-void
-	detail::FullTreeTraversal<NumberT, ObjectT>::
-SetNodeCurrentChild(ChildPosition child_position) {
-	position_.current_child = child_position;
+template <typename VisitorT, typename... ArgsT>
+auto CallVisitor(VisitorT& visitor, ArgsT... args) ->
+		typename std::enable_if<!std::is_void<decltype(visitor(args...))>::value, bool>::type {
+	return visitor(args...);
 }
 
-template <typename NumberT, typename ObjectT>
-void
-	detail::FullTreeTraversal<NumberT, ObjectT>::
-GoTopLeft() {
-	assert((size_t)depth_ == position_stack_.size());
-	position_.current_child = ChildPosition::kTopLeft;
-	position_stack_.emplace_back(position_);
-	ForwardTreeTraversal<Number, Object>::GoTopLeft();
-	position_.current_child = ChildPosition::kNone;
-}
+// Passes the index of a region along with the objects to a visitor of many regions
+template <typename VisitorT>
+struct RegionVisitor {
+	template <typename ObjectT>
+	bool operator()(ObjectT* object) const {return CallVisitor(*visitor, region_index, object);}
+	VisitorT* visitor;
+	std::size_t region_index;
+};
 
-template <typename NumberT, typename ObjectT>
-void
-	detail::FullTreeTraversal<NumberT, ObjectT>::
-GoTopRight() {
-	assert((size_t)depth_ == position_stack_.size());
-	position_.current_child = ChildPosition::kTopRight;
-	position_stack_.emplace_back(position_);
-	ForwardTreeTraversal<Number, Object>::GoTopRight();
-	position_.current_child = ChildPosition::kNone;
-}
+// Appends the objects visited to a vector
+template <typename ObjectT>
+struct ObjectAppender {
+	void operator()(ObjectT* object) const {out->push_back(object);}
+	std::vector<ObjectT*>* out;
+};
 
-template <typename NumberT, typename ObjectT>
-void
-	detail::FullTreeTraversal<NumberT, ObjectT>::
-GoBottomRight() {
-	assert((size_t)depth_ == position_stack_.size());
-	position_.current_child = ChildPosition::kBottomRight;
-	position_stack_.emplace_back(position_);
-	ForwardTreeTraversal<Number, Object>::GoBottomRight();
-	position_.current_child = ChildPosition::kNone;
-}
+// Counts the objects visited
+struct ObjectCounter {
+	template <typename ObjectT>
+	void operator()(ObjectT*) {count++;}
+	int count;
+};
 
-template <typename NumberT, typename ObjectT>
-void
-	detail::FullTreeTraversal<NumberT, ObjectT>::
-GoBottomLeft() {
-	assert((size_t)depth_ == position_stack_.size());
-	position_.current_child = ChildPosition::kBottomLeft;
-	position_stack_.emplace_back(position_);
-	ForwardTreeTraversal<Number, Object>::GoBottomLeft();
-	position_.current_child = ChildPosition::kNone;
+// Visits every object of a node which fits the query as a whole, empty slots are skipped
+template <typename VisitorT, typename ObjectContainerT>
+bool VisitObjects(VisitorT& visitor, ObjectContainerT& objects) {
+	for (auto it = objects.begin(); it != objects.end(); ++it) {
+		if (*it != nullptr && !CallVisitor(visitor, *it)) {
+			return false;
+		}
+	}
+	return true;
 }
 
-template <typename NumberT, typename ObjectT>
-void
-	detail::FullTreeTraversal<NumberT, ObjectT>::
-GoUp() {
-	assert((size_t)depth_ == position_stack_.size() && depth_ > 0);
-	position_ = position_stack_.back();
-	depth_--;
-	position_stack_.pop_back();
+// Reserves room for the whole node at once, keeping the growth of the vector geometric
+template <typename ObjectT, typename ObjectContainerT>
+bool VisitObjects(ObjectAppender<ObjectT>& appender, ObjectContainerT& objects) {
+	std::vector<ObjectT*>& out = *appender.out;
+	std::size_t needed = out.size() + objects.size();
+	if (needed > out.capacity()) {
+		out.reserve(needed > out.capacity() * 2 ? needed : out.capacity() * 2);
+	}
+	for (auto it = objects.begin(); it != objects.end(); ++it) {
+		if (*it != nullptr) {
+			out.push_back(*it);
+		}
+	}
+	return true;
 }
 
 
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
-	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT>::Query::Impl::
-Impl() : quadtree_(nullptr), query_region_(0,0,0,0),
-	query_type_(QueryType::kEndOfQuery),
-	free_ride_from_level_(LooseQuadtree<Number, Object, BoundingBoxExtractor>::Impl::kInternalMaxDepth) {
+// Squared distance of a point from the closest point of a box, 0 inside of it
+template <typename NumberT>
+double SquaredDistance(double x, double y, const BoundingBox<NumberT>& box) {
+	double left = (double)box.left;
+	double top = (double)box.top;
+	double dx = x < left ? left - x : std::max(x - (left + (double)box.width), 0.0);
+	double dy = y < top ? top - y : std::max(y - (top + (double)box.height), 0.0);
+	return dx * dx + dy * dy;
 }
 
+// The default distance of nearest neighbour queries, only the bounding boxes count
 template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
-void
-	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT>::Query::Impl::
-Acquire(typename LooseQuadtree<Number, Object, BoundingBoxExtractor>::Impl* quadtree,
-		const BoundingBox<Number>* query_region, QueryType query_type) {
-	assert(IsAvailable());
-	assert(query_type != QueryType::kEndOfQuery);
-	quadtree_ = quadtree;
-	query_region_ = *query_region;
-	query_type_ = query_type;
-	free_ride_from_level_ =
-		LooseQuadtree<Number, Object, BoundingBoxExtractor>::Impl::kInternalMaxDepth;
-	if (quadtree->root_ == nullptr) {
-		query_type_ = QueryType::kEndOfQuery;
+struct BoundingBoxSquaredDistance {
+	double operator()(ObjectT* object) const {
+		BoundingBox<NumberT> object_bounds(0,0,0,0);
+		BoundingBoxExtractorT::ExtractBoundingBox(object, &object_bounds);
+		return SquaredDistance(x, y, object_bounds);
 	}
-	else {
-		quadtree_->running_queries_++;
-		traversal_.StartAt(quadtree->root_, quadtree->bounding_box_);
-		object_iterator_ = traversal_.GetNode()->objects.before_begin();
-		Next();
+	double x;
+	double y;
+};
+
+// Squares what a user distance functor returns
+template <typename DistanceT>
+struct SquaredUserDistance {
+	template <typename ObjectT>
+	double operator()(ObjectT* object) const {
+		double object_distance = (double)(*distance)(object);
+		assert(object_distance >= 0);
+		return object_distance * object_distance;
 	}
-}
+	DistanceT* distance;
+};
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
-void
-	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT>::Query::Impl::
-Release() {
-	assert(!IsAvailable());
-	quadtree_ = nullptr;
-}
+template <typename TreeNodeT, typename NumberT>
+struct NearestNodeCandidate {
+	double squared_distance; ///< of the loose bounds
+	TreeNodeT* node;
+	BoundingBox<NumberT> node_bounds;
+};
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
-bool
-	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT>::Query::Impl::
-IsAvailable() const {
-	return quadtree_ == nullptr;
+template <typename ObjectT>
+struct NearestObjectCandidate {
+	double squared_distance;
+	ObjectT* object;
+};
+
+// Slab test of a ray against a box, borders included, entry_t is 0 if the origin is inside
+template <typename NumberT>
+bool RayEntry(double origin_x, double origin_y, double direction_x, double direction_y,
+		double max_t, const BoundingBox<NumberT>& box, double* entry_t) {
+	double t_enter = 0.0;
+	double t_exit = max_t;
+	const double origins[2] = {origin_x, origin_y};
+	const double directions[2] = {direction_x, direction_y};
+	const double lows[2] = {(double)box.left, (double)box.top};
+	const double highs[2] = {(double)box.left + (double)box.width,
+		(double)box.top + (double)box.height};
+	for (int axis = 0; axis < 2; axis++) {
+		if (directions[axis] == 0.0) {
+			if (origins[axis] < lows[axis] || origins[axis] > highs[axis]) {
+				return false;
+			}
+			continue;
+		}
+		double t_low = (lows[axis] - origins[axis]) / directions[axis];
+		double t_high = (highs[axis] - origins[axis]) / directions[axis];
+		if (t_low > t_high) {
+			std::swap(t_low, t_high);
+		}
+		t_enter = std::max(t_enter, t_low);
+		t_exit = std::min(t_exit, t_high);
+		if (t_enter > t_exit) {
+			return false;
+		}
+	}
+	*entry_t = t_enter;
+	return true;
 }
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
-bool
-	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT>::Query::Impl::
-EndOfQuery() const {
-	assert(!IsAvailable());
-	return query_type_ == QueryType::kEndOfQuery;
+// Nodes and the objects hit in them wait in the same heap ordered by entry t
+template <typename TreeNodeT, typename NumberT, typename ObjectT>
+struct RayCandidate {
+	double entry_t;
+	TreeNodeT* node; ///< nullptr for objects
+	ObjectT* object;
+	BoundingBox<NumberT> node_bounds;
+};
+
+// An object waiting to be paired, with its bounding box extracted once
+template <typename NumberT, typename ObjectT>
+struct PairCandidate {
+	ObjectT* object;
+	BoundingBox<NumberT> object_bounds;
+};
+
+template <typename BoundingBoxExtractorT, typename TreeNodeT, typename PairCandidateT>
+void GatherPairCandidates(TreeNodeT* node, std::vector<PairCandidateT>& candidates) {
+	auto end = node->objects.end();
+	for (auto it = node->objects.begin(); it != end; ++it) {
+		if (*it == nullptr) {
+			continue;
+		}
+		PairCandidateT candidate = {*it, BoundingBox<typename TreeNodeT::Number>(0,0,0,0)};
+		BoundingBoxExtractorT::ExtractBoundingBox(*it, &candidate.object_bounds);
+		candidates.push_back(candidate);
+	}
 }
 
+// Turns pairs around for visitors expecting them in the order of the trees
+template <typename VisitorT>
+struct SwappedPairVisitor {
+	template <typename FirstT, typename SecondT>
+	bool operator()(FirstT* first, SecondT* second) const {
+		return CallVisitor(*visitor, second, first);
+	}
+	VisitorT* visitor;
+};
+
+// Boxes intersect a circle if their closest point is strictly inside of it
+template <typename NumberT>
+struct Circle {
+	bool Intersects(const BoundingBox<NumberT>& box) const {
+		return SquaredDistance(x, y, box) < radius * radius;
+	}
+	bool Contains(const BoundingBox<NumberT>& box) const { ///< strictly inside
+		double dx = std::max(x - (double)box.left, (double)box.left + (double)box.width - x);
+		double dy = std::max(y - (double)box.top, (double)box.top + (double)box.height - y);
+		return dx * dx + dy * dy < radius * radius;
+	}
+	double x;
+	double y;
+	double radius;
+};
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
-ObjectT*
-	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT>::Query::Impl::
-GetCurrent() const {
-	assert(!IsAvailable());
-	assert(!EndOfQuery());
-	return *object_iterator_;
+// Separating axis tests against the edges of the polygon and the axes of the box
+template <typename NumberT>
+class ConvexPolygon {
+public:
+	explicit ConvexPolygon(const std::vector<std::pair<NumberT, NumberT>>& vertices);
+	bool Intersects(const BoundingBox<NumberT>& box) const;
+	bool Contains(const BoundingBox<NumberT>& box) const; ///< strictly inside
+
+private:
+	struct Edge {
+		double normal_x; ///< points outwards
+		double normal_y;
+		double offset; ///< the polygon is where normal * point <= offset
+	};
+	std::vector<Edge> edges_;
+	double left_;
+	double top_;
+	double right_;
+	double bottom_;
+};
+
+// Tasks shared by the calling thread and the helpers started through an executor,
+// every thread takes the next task left, so the idle ones take over the work of busy ones
+class ParallelTasks {
+public:
+	ParallelTasks(std::size_t task_count, std::function<bool(std::size_t)> run_task);
+	ParallelTasks(const ParallelTasks&) = delete;
+	ParallelTasks& operator=(const ParallelTasks&) = delete;
+
+	void Work(); ///< runs tasks until none is left, helpers starting late return at once
+	void WaitUntilFinished(); ///< every task got finished, run_task is not called any more
+	bool IsStopped() const; ///< a task gave back false, the ones not started yet got skipped
+
+private:
+	const std::size_t task_count_;
+	const std::function<bool(std::size_t)> run_task_;
+	std::atomic<std::size_t> next_task_;
+	std::atomic<bool> stopped_;
+	std::mutex mutex_;
+	std::condition_variable finished_;
+	std::size_t finished_tasks_; ///< guarded by mutex_
+};
+
+// The helpers only keep the shared tasks alive, so an executor may start them any time later
+template <typename ExecutorT>
+bool RunInParallel(std::size_t task_count, int helpers, ExecutorT& executor,
+		std::function<bool(std::size_t)> run_task) { ///< false if a task stopped them
+	assert(helpers >= 0);
+	std::shared_ptr<ParallelTasks> tasks =
+		std::make_shared<ParallelTasks>(task_count, std::move(run_task));
+	for (std::size_t i = 0; i < (std::size_t)helpers && i + 1 < task_count; i++) {
+		executor(std::function<void()>([tasks]() {
+			tasks->Work();
+		}));
+	}
+	tasks->Work();
+	tasks->WaitUntilFinished();
+	return !tasks->IsStopped();
 }
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
-void
-	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT>::Query::Impl::
-Next() {
-	assert(!IsAvailable());
-	assert(!EndOfQuery());
-	do {
-		object_iterator_before_ = object_iterator_;
-		object_iterator_++;
-		if (object_iterator_ == traversal_.GetNode()->objects.end()) {
-			do {
-				switch (traversal_.GetNodeCurrentChild()) {
-				case detail::ChildPosition::kNone:
-					if (traversal_.GetNode()->top_left == nullptr) {
-						traversal_.SetNodeCurrentChild(detail::ChildPosition::kTopLeft);
-						continue;
-					}
-					else {
-						traversal_.GoTopLeft();
-					}
-					break;
-				case detail::ChildPosition::kTopLeft:
-					if (traversal_.GetNode()->top_right == nullptr) {
-						traversal_.SetNodeCurrentChild(detail::ChildPosition::kTopRight);
-						continue;
-					}
+
+
+template <typename NumberT, typename ObjectT, std::size_t kSlotsT, bool kCacheBoundingBoxesT>
+struct ObjectSegment : BoundsSlots<NumberT, kSlotsT, kCacheBoundingBoxesT> {
+	ObjectT* objects[kSlotsT];
+	std::uint32_t tags[kSlotsT];
+};
+
+
+
+// The first few slots are stored in place, the rest go to a chain of chunks
+// Slots never move unless Compact() is called, removed objects are left as nullptr
+template <typename NumberT, typename ObjectT, bool kCacheBoundingBoxesT = false>
+class ChunkedObjectList {
+public:
+	using Number = NumberT;
+	using Object = ObjectT;
+	constexpr static bool kCacheBoundingBoxes = kCacheBoundingBoxesT;
+	constexpr static std::size_t kInlineSlots = 4;
+	constexpr static std::size_t kChunkSlots =
+		((kCacheBoundingBoxes ? BlocksAllocator::kMaxAllowedAlloc :
+			BlocksAllocator::kMaxAllowedAlloc / 4) - 2 * sizeof(void*)) /
+		(sizeof(Object*) + sizeof(std::uint32_t) + (kCacheBoundingBoxes ? sizeof(Number) * 4 : 0));
+	static_assert(kChunkSlots <= 64, "hit masks have to cover whole segments");
+
+private:
+	using InlineSegment =
+		ObjectSegment<Number, Object, kInlineSlots, kCacheBoundingBoxes>;
+	struct Chunk : ObjectSegment<Number, Object, kChunkSlots, kCacheBoundingBoxes> {
+		Chunk* previous;
+		Chunk* next;
+	};
+	using Bounds = BoundsAccess<Number, kCacheBoundingBoxes>;
+
+public:
+	// Refers to an object and its cached bounding box, stays valid until Compact() or Clear()
+	struct Slot {
+		Object** object;
+		std::uint32_t* tag; ///< stored along with the object, it is moved with it
+		Number* bounds; ///< lefts, tops, widths and heights stride apart, nullptr if not cached
+		std::size_t stride;
+
+		void SetBoundingBox(const BoundingBox<Number>& object_bounds) const;
+	};
+
+	class iterator {
+	public:
+		iterator();
+		Object*& operator*() const;
+		iterator& operator++();
+		iterator operator++(int);
+		bool operator==(const iterator& other) const;
+		bool operator!=(const iterator& other) const;
+		BoundingBox<Number> GetBoundingBox() const; ///< only if bounding boxes are cached
+		iterator& Advance(std::size_t count); ///< can only step to the end of the segment
+		std::size_t GetSegmentRemaining() const; ///< slots left in this segment, current included
+		const Number* GetSegmentBounds() const; ///< starts at the current slot, if cached
+		std::size_t GetSegmentStride() const; ///< distance between lefts, tops, widths and heights
+		Slot GetSlot() const;
+
+	private:
+		friend class ChunkedObjectList<Number, Object, kCacheBoundingBoxes>;
+		iterator(Object** segment, std::uint32_t* segment_tags, Number* segment_bounds,
+				std::size_t capacity, Chunk* next_chunk, std::size_t remaining);
+
+		Object** segment_;
+		std::uint32_t* segment_tags_;
+		Number* segment_bounds_;
+		std::size_t index_;
+		std::size_t capacity_;
+		Chunk* next_chunk_;
+		std::size_t remaining_;
+	};
+
+	ChunkedObjectList();
+	~ChunkedObjectList();
+	ChunkedObjectList(const ChunkedObjectList&) = delete;
+	ChunkedObjectList& operator=(const ChunkedObjectList&) = delete;
+
+	bool empty() const; ///< true if there are no slots, not even empty ones
+	std::size_t size() const; ///< number of slots including the empty ones
+	iterator begin();
+	iterator end();
+	Slot Add(Object* object, std::uint32_t tag, const BoundingBox<Number>& object_bounds,
+			BlocksAllocator& allocator); ///< gives back a stable slot
+	template <typename MovedCallbackT>
+	void Compact(BlocksAllocator& allocator, MovedCallbackT moved);
+	///< fills empty slots from the back, moved(object, new_slot) is called on every move
+	void Clear(BlocksAllocator& allocator);
+
+private:
+	iterator Back();
+	void PopBack(BlocksAllocator& allocator);
+
+	std::size_t size_;
+	InlineSegment inline_segment_;
+	Chunk* first_chunk_;
+	Chunk* last_chunk_;
+};
+
+
+
+// Open addressing hash map from pointers to 32-bit values with linear probing
+// Keys are hashed by multiplication because the low bits of pointers tend to be 0
+// Erasing shifts the following entries back, so no tombstones are left behind
+template <typename KeyT>
+class PointerMap {
+public:
+	using Key = KeyT;
+
+	PointerMap();
+	PointerMap(const PointerMap&) = delete;
+	PointerMap& operator=(const PointerMap&) = delete;
+
+	std::size_t size() const;
+	std::size_t capacity() const; ///< keys it can hold without rehashing
+	std::uint32_t* Find(const Key* key); ///< nullptr if it is not in the map
+	const std::uint32_t* Find(const Key* key) const;
+	std::pair<std::uint32_t*, bool> Emplace(Key* key, std::uint32_t value);
+	///< gives back the value in the map and false if the key was already there
+	bool Extract(const Key* key, std::uint32_t* value); ///< erases it, false if not found
+	void Reserve(std::size_t count); ///< no rehashing happens until count keys are reached
+	void Clear(); ///< keeps the memory
+
+private:
+	struct Entry {
+		Key* key; ///< nullptr for empty entries
+		std::uint32_t value;
+	};
+	constexpr static std::size_t kMinCapacity = 16;
+
+	std::size_t GetHome(const Key* key) const;
+	std::size_t Probe(const Key* key) const; ///< the entry of the key or the empty one ending its run
+	void Rehash(std::size_t capacity);
+
+	std::vector<Entry> entries_;
+	std::size_t size_;
+	int shift_; ///< 64 - log2(capacity)
+};
+
+
+
+template <typename NumberT, typename ObjectT, bool kCacheBoundingBoxesT = false>
+struct TreeNode {
+	using Number = NumberT;
+	using Object = ObjectT;
+	constexpr static bool kCacheBoundingBoxes = kCacheBoundingBoxesT;
+	using ObjectContainer = ChunkedObjectList<Number, Object, kCacheBoundingBoxes>;
+
+	TreeNode() :
+		top_left(nullptr), top_right(nullptr), bottom_right(nullptr),
+		bottom_left(nullptr), object_count(0), changed(true)
+	{}
+
+	TreeNode<Number, Object, kCacheBoundingBoxes>* top_left;
+	TreeNode<Number, Object, kCacheBoundingBoxes>* top_right;
+	TreeNode<Number, Object, kCacheBoundingBoxes>* bottom_right;
+	TreeNode<Number, Object, kCacheBoundingBoxes>* bottom_left;
+	int object_count; ///< objects in the whole subtree, empty slots are not counted
+	bool changed; ///< something in the subtree changed since the last snapshot
+	ObjectContainer objects;
+};
+
+
+
+// Immutable copy of a tree node, shared by the snapshots taken while the subtree stayed the same
+template <typename NumberT, typename ObjectT>
+struct SnapshotNode {
+	using Number = NumberT;
+	using Object = ObjectT;
+
+	struct Entry {
+		Object* object;
+		BoundingBox<Number> bounds;
+	};
+
+	std::shared_ptr<const SnapshotNode<Number, Object>> children[4];
+	///< top left, top right, bottom right, bottom left, empty subtrees are nullptr
+	std::vector<Entry> objects;
+};
+
+
+
+template <typename NumberT, typename ObjectT, bool kCacheBoundingBoxesT = false>
+class ForwardTreeTraversal {
+public:
+	using Number = NumberT;
+	using Object = ObjectT;
+	constexpr static bool kCacheBoundingBoxes = kCacheBoundingBoxesT;
+
+	struct TreePosition {
+		TreePosition(const BoundingBox<Number>& _bbox, TreeNode<Number, Object, kCacheBoundingBoxesT>* _node) :
+			bounding_box(_bbox), node(_node) {
+			current_child = ChildPosition::kNone;
+		}
+
+		BoundingBox<Number> bounding_box;
+		TreeNode<Number, Object, kCacheBoundingBoxesT>* node;
+		ChildPosition current_child;
+	};
+
+	ForwardTreeTraversal();
+	void StartAt(TreeNode<Number, Object, kCacheBoundingBoxesT>* root, const BoundingBox<Number>& root_bounds);
+	int GetDepth() const; ///< starting from 0
+	TreeNode<Number, Object, kCacheBoundingBoxesT>* GetNode() const;
+	const BoundingBox<Number>& GetNodeBoundingBox() const;
+	void GoTopLeft();
+	void GoTopRight();
+	void GoBottomRight();
+	void GoBottomLeft();
+
+protected:
+	TreePosition position_;
+	int depth_;
+};
+
+
+
+template <typename NumberT, typename ObjectT, bool kCacheBoundingBoxesT = false>
+class FullTreeTraversal :
+	public ForwardTreeTraversal<NumberT, ObjectT, kCacheBoundingBoxesT> {
+public:
+	using Number = NumberT;
+	using Object = ObjectT;
+	constexpr static bool kCacheBoundingBoxes = kCacheBoundingBoxesT;
+	using typename ForwardTreeTraversal<Number, Object, kCacheBoundingBoxes>::TreePosition;
+
+	void StartAt(TreeNode<Number, Object, kCacheBoundingBoxesT>* root, const BoundingBox<Number>& root_bounds);
+	ChildPosition GetNodeCurrentChild() const;
+	void SetNodeCurrentChild(ChildPosition child_position);
+	void GoUp();
+	void GoTopLeft();
+	void GoTopRight();
+	void GoBottomRight();
+	void GoBottomLeft();
+
+private:
+	using ForwardTreeTraversal<Number, Object, kCacheBoundingBoxes>::position_;
+	using ForwardTreeTraversal<Number, Object, kCacheBoundingBoxes>::depth_;
+
+	std::vector<TreePosition> position_stack_;
+};
+
+
+
+} //detail
+
+
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+class
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Query::
+Impl {
+public:
+	enum class QueryType {kIntersects, kInside, kContains, kEndOfQuery};
+	enum class FitType {kNoFit = 0, kPartialFit, kFreeRide};
+	using TreeNode = detail::TreeNode<Number, Object, Traits::kCacheBoundingBoxes>;
+	using FullTreeTraversal =
+		detail::FullTreeTraversal<Number, Object, Traits::kCacheBoundingBoxes>;
+
+	static detail::BoundsTest GetBoundsTest(QueryType query_type);
+	static bool ObjectFits(QueryType query_type, const BoundingBox<Number>& query_region,
+		const BoundingBox<Number>& object_bounds);
+	static FitType NodeFits(QueryType query_type, const BoundingBox<Number>& query_region,
+		const BoundingBox<Number>& node_bounds);
+
+	explicit Impl(bool pooled);
+	void Acquire(typename LooseQuadtree<Number, Object, BoundingBoxExtractor, Traits>::Impl* quadtree,
+		const BoundingBox<Number>* query_region, QueryType query_type);
+	void Release(); ///< gives it back to the pool if it came from there
+	bool IsAvailable() const;
+	bool EndOfQuery() const;
+	Object* GetCurrent() const;
+	void Next();
+
+private:
+	void Seek(); ///< moves forward until a fitting object is found, current one included
+	void StepObjects(std::size_t count); ///< keeps the hit mask in sync with the iterator
+	void CalculateHitMask(); ///< tests the rest of the current segment at once
+	bool CurrentObjectFits() const;
+	FitType CurrentNodeFits() const;
+
+	friend class LooseQuadtree<Number, Object, BoundingBoxExtractor, Traits>::Impl;
+	typename LooseQuadtree<Number, Object, BoundingBoxExtractor, Traits>::Impl* quadtree_;
+	FullTreeTraversal traversal_;
+	typename TreeNode::ObjectContainer::iterator object_iterator_;
+	BoundingBox<Number> query_region_;
+	QueryType query_type_;
+	int free_ride_from_level_;
+	std::uint64_t hit_mask_; ///< only with cached bounding boxes, bit 0 is the current object
+	std::size_t hit_mask_slots_; ///< 0 if the hit mask needs to be calculated
+	std::size_t hit_mask_modifications_; ///< tested slots can be reused or updated in place
+	bool pooled_; ///< false for local queries
+	Impl* next_available_; ///< links the available queries of the pool
+};
+
+
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+class
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::
+Impl {
+public:
+	constexpr static int kInternalMinDepth = 4;
+	constexpr static std::uint32_t kFreeRideRegion = 1u << 31; ///< flags active regions
+	constexpr static int kInternalMaxDepth = (sizeof(long long) * 8 - 1) / 2;
+	constexpr static Number kMinimalObjectExtent =
+		std::is_integral<Number>::value ? 1 :
+			std::numeric_limits<Number>::min() * 16;
+	using TreeNode = detail::TreeNode<Number, Object, Traits::kCacheBoundingBoxes>;
+	using ForwardTreeTraversal =
+		detail::ForwardTreeTraversal<Number, Object, Traits::kCacheBoundingBoxes>;
+	using FullTreeTraversal =
+		detail::FullTreeTraversal<Number, Object, Traits::kCacheBoundingBoxes>;
+
+	explicit Impl(detail::BlocksAllocator* shared_allocator = nullptr);
+	///< without a shared allocator the tree gets one of its own
+	~Impl();
+	Impl(const Impl&) = delete;
+	Impl& operator=(const Impl&) = delete;
+
+	bool Insert(Object* object);
+	bool Update(Object* object);
+	bool Remove(Object* object);
+	bool Contains(Object* object) const;
+	Handle InsertWithHandle(Object* object);
+	void Update(Handle handle);
+	bool Remove(Handle handle);
+	bool Contains(Handle handle) const;
+	template <typename ObjectIteratorT>
+	void BulkLoad(ObjectIteratorT first, ObjectIteratorT last);
+	template <typename ObjectIteratorT>
+	void UpdateMany(ObjectIteratorT first, ObjectIteratorT last);
+	template <typename ObjectIteratorT>
+	int RemoveMany(ObjectIteratorT first, ObjectIteratorT last);
+	Query QueryIntersectsRegion(const BoundingBox<Number>& region);
+	Query QueryInsideRegion(const BoundingBox<Number>& region);
+	Query QueryContainsRegion(const BoundingBox<Number>& region);
+	void QueryIntersectsRegion(const BoundingBox<Number>& region, std::vector<Object*>& out) const;
+	void QueryInsideRegion(const BoundingBox<Number>& region, std::vector<Object*>& out) const;
+	void QueryContainsRegion(const BoundingBox<Number>& region, std::vector<Object*>& out) const;
+	// The non-const visitor calls keep running queries from cleaning up under the visitor,
+	// the const ones touch nothing in the tree, so they can run from many threads at once
+	template <typename VisitorT>
+	bool ForEachIntersecting(const BoundingBox<Number>& region, VisitorT& visitor);
+	template <typename VisitorT>
+	bool ForEachIntersecting(const BoundingBox<Number>& region, VisitorT& visitor) const;
+	template <typename VisitorT>
+	bool ForEachInside(const BoundingBox<Number>& region, VisitorT& visitor);
+	template <typename VisitorT>
+	bool ForEachInside(const BoundingBox<Number>& region, VisitorT& visitor) const;
+	template <typename VisitorT>
+	bool ForEachContaining(const BoundingBox<Number>& region, VisitorT& visitor);
+	template <typename VisitorT>
+	bool ForEachContaining(const BoundingBox<Number>& region, VisitorT& visitor) const;
+	template <typename VisitorT>
+	bool ForEachIntersectingRegions(const std::vector<BoundingBox<Number>>& regions,
+		VisitorT& visitor);
+	template <typename VisitorT>
+	bool ForEachIntersectingRegions(const std::vector<BoundingBox<Number>>& regions,
+		VisitorT& visitor) const;
+	void QueryIntersectsRegions(const std::vector<BoundingBox<Number>>& regions,
+		std::vector<std::vector<Object*>>& out) const;
+	template <typename SquaredDistanceT>
+	void QueryNearest(Number x, Number y, int k, double max_distance,
+		SquaredDistanceT& squared_distance, std::vector<Object*>& out) const;
+	template <typename VisitorT>
+	bool ForEachOnRay(Number origin_x, Number origin_y, double direction_x, double direction_y,
+		double max_t, VisitorT& visitor);
+	template <typename VisitorT>
+	bool ForEachOnRay(Number origin_x, Number origin_y, double direction_x, double direction_y,
+		double max_t, VisitorT& visitor) const;
+	template <typename ShapeT, typename VisitorT>
+	bool ForEachIntersectingShape(const ShapeT& shape, VisitorT& visitor);
+	template <typename ShapeT, typename VisitorT>
+	bool ForEachIntersectingShape(const ShapeT& shape, VisitorT& visitor) const;
+	int CountIntersectsRegion(const BoundingBox<Number>& region) const;
+	int CountInsideRegion(const BoundingBox<Number>& region) const;
+	template <typename ExecutorT>
+	void QueryIntersectsRegionParallel(const BoundingBox<Number>& region, std::vector<Object*>& out,
+		int helpers, ExecutorT& executor) const;
+	template <typename ExecutorT, typename VisitorT>
+	bool ForEachIntersectingParallel(const BoundingBox<Number>& region, int helpers,
+		ExecutorT& executor, VisitorT& visitor) const;
+	template <typename VisitorT>
+	bool ForEachIntersectingPair(VisitorT& visitor);
+	template <typename OtherTreeT, typename VisitorT>
+	bool ForEachIntersectingPair(typename OtherTreeT::Impl& other, VisitorT& visitor);
+	std::shared_ptr<const Snapshot> TakeSnapshot();
+	template <typename VisitorT>
+	static bool VisitSnapshotNode(const detail::SnapshotNode<Number, Object>* node,
+		const BoundingBox<Number>& node_bounds, bool free_ride,
+		typename Query::Impl::QueryType query_type, const BoundingBox<Number>& region,
+		VisitorT& visitor);
+	const BoundingBox<Number>& GetBoundingBox() const; ///< loose sense bounds
+	int GetSize() const;
+	void Reserve(std::size_t number_of_objects);
+	std::size_t GetCapacity() const;
+	void Clear();
+	void ForceCleanup();
+	bool Maintain(int max_node_visits, std::chrono::microseconds max_time,
+		bool release_free_blocks);
+
+private:
+	friend class Query::Impl;
+	template <typename, typename, typename, typename>
+	friend class LooseQuadtree; ///< joins reach into other trees
+	// Remembers where an object went, so updates can tell if it still fits there
+	// Records are indexed by handles and by the tags next to the objects in the nodes
+	struct ObjectRecord {
+		typename TreeNode::ObjectContainer::Slot slot;
+		BoundingBox<Number> node_bounds;
+		int node_level; ///< depth of the node minus the root regrowths before it
+		std::uint32_t generation; ///< changes when the record is released, never 0
+	};
+	// An object waiting to be placed by a batch operation
+	struct PendingObject {
+		Object* object;
+		BoundingBox<Number> object_bounds;
+		Number maximal_object_extent;
+		Number object_center_x;
+		Number object_center_y;
+		std::uint32_t record;
+	};
+	// An object taken out by RemoveMany(), its node is found again by the center of it
+	struct RemovedObject {
+		Number node_center_x;
+		Number node_center_y;
+		int node_depth;
+	};
+	// A part of a query run in parallel with the others
+	struct ParallelTask {
+		TreeNode* node;
+		BoundingBox<Number> node_bounds;
+		bool free_ride;
+		bool whole_subtree; ///< else only the objects of the node itself
+	};
+	struct MaintenanceBudget {
+		int node_visits_left;
+		bool timed;
+		std::chrono::steady_clock::time_point deadline; ///< only if timed
+	};
+	using ObjectPointerContainer = detail::PointerMap<Object>;
+	using QueryPoolContainer =
+		std::deque<typename LooseQuadtree<Number, Object, BoundingBoxExtractor, Traits>::Query::Impl,
+		detail::BlocksAllocatorAdaptor<
+			typename LooseQuadtree<Number, Object, BoundingBoxExtractor, Traits>::Query::Impl>>;
+
+	static void GetPlacement(const BoundingBox<Number>& object_bounds,
+		Number* maximal_object_extent, Number* object_center_x, Number* object_center_y);
+	static BoundingBox<Number> GetLooseBounds(const BoundingBox<Number>& node_bounds);
+
+	static bool IsEmptyNode(const TreeNode* node); ///< no objects and no children
+	void RecalculateMaximalDepth();
+	void DeleteTree();
+	void CleanupNode(TreeNode* node, int depth); ///< drops empty slots, moves up too deep objects
+	bool MaintainSubtree(TreeNode* node, int depth, bool resume, MaintenanceBudget& budget);
+	///< false if the budget ran out, maintenance_path_ then tells where to go on from
+	bool StaysInNode(const ObjectRecord& record, const BoundingBox<Number>& object_bounds) const;
+	std::uint32_t AcquireRecord();
+	void ReleaseRecord(std::uint32_t record_index);
+	void InsertNew(Object* object, std::uint32_t record_index);
+	void Relocate(std::uint32_t record_index);
+	template <typename ObjectIteratorT>
+	void ReserveForBatch(ObjectIteratorT first, ObjectIteratorT last,
+		std::vector<PendingObject>& pending, std::forward_iterator_tag);
+	///< sizes the bookkeeping as if every object of the range was new
+	template <typename ObjectIteratorT>
+	void ReserveForBatch(ObjectIteratorT, ObjectIteratorT, std::vector<PendingObject>&,
+		std::input_iterator_tag) {} ///< single pass ranges cannot be measured
+	void Unlink(std::uint32_t record_index); ///< removes it without recalculating the maximal depth
+	void AdjustObjectCounts(const ObjectRecord& record, int delta); ///< from the root to its node
+	///< marks the nodes on the way as changed for the next snapshot
+	void CreateRoot(const std::vector<PendingObject>& pending);
+	void GrowRoot(Number object_center_x, Number object_center_y, Number maximal_object_extent);
+	void PlaceObjects(std::vector<PendingObject>& pending);
+	void SubtractObjectCounts(TreeNode* node, const BoundingBox<Number>& node_bounds, int depth,
+		RemovedObject* first, RemovedObject* last); ///< visits every node once for all below it
+	void PlaceObjects(TreeNode* node, const BoundingBox<Number>& node_bounds, int depth,
+		PendingObject* first, PendingObject* last);
+	void InsertIntoTree(Object* object, std::uint32_t record_index,
+		const BoundingBox<Number>& object_bounds);
+	template <typename VisitorT>
+	bool ForEach(typename Query::Impl::QueryType query_type, const BoundingBox<Number>& region,
+		VisitorT& visitor); ///< false if the visitor stopped it
+	template <typename VisitorT>
+	bool ForEach(typename Query::Impl::QueryType query_type, const BoundingBox<Number>& region,
+		VisitorT& visitor) const;
+	template <typename VisitorT>
+	bool VisitNode(TreeNode* node, const BoundingBox<Number>& node_bounds, bool free_ride,
+		typename Query::Impl::QueryType query_type, const BoundingBox<Number>& region,
+		VisitorT& visitor) const;
+	template <typename VisitorT>
+	bool VisitNodeObjects(TreeNode* node, bool free_ride,
+		typename Query::Impl::QueryType query_type, const BoundingBox<Number>& region,
+		VisitorT& visitor) const; ///< the node itself has to fit the query already
+	void GatherParallelTasks(TreeNode* node, const BoundingBox<Number>& node_bounds,
+		bool free_ride, int levels_left, typename Query::Impl::QueryType query_type,
+		const BoundingBox<Number>& region, std::vector<ParallelTask>& tasks) const;
+	///< the nodes above the split get tasks for their own objects, in the order of VisitNode()
+	template <typename VisitorT>
+	bool VisitParallelTask(const ParallelTask& task, typename Query::Impl::QueryType query_type,
+		const BoundingBox<Number>& region, VisitorT& visitor) const;
+	static int GetParallelSplitLevels(int helpers); ///< enough tasks to balance the threads
+	using PairCandidate = detail::PairCandidate<Number, Object>;
+	template <typename VisitorT>
+	static bool PairWithinSubtree(TreeNode* node, const BoundingBox<Number>& node_bounds,
+		std::vector<PairCandidate>& candidates, std::vector<PairCandidate>& gathered,
+		VisitorT& visitor);
+	template <typename OtherTreeT, typename VisitorT>
+	static bool PairBetweenSubtrees(TreeNode* node, const BoundingBox<Number>& node_bounds,
+		typename OtherTreeT::Impl::TreeNode* other_node,
+		const BoundingBox<Number>& other_node_bounds, std::vector<PairCandidate>& candidates,
+		std::vector<typename OtherTreeT::Impl::PairCandidate>& other_candidates,
+		VisitorT& visitor);
+	template <typename BoundingBoxExtractorOfNodeT, typename TreeNodeT, typename CarriedT,
+		typename GatheredT, typename VisitorT>
+	static bool PairWithSubtree(TreeNodeT* node, const BoundingBox<Number>& node_bounds,
+		std::vector<CarriedT>& carried, std::size_t parent_first, std::size_t parent_last,
+		std::vector<GatheredT>& gathered, VisitorT& visitor);
+	int CountNode(TreeNode* node, const BoundingBox<Number>& node_bounds,
+		typename Query::Impl::QueryType query_type, const BoundingBox<Number>& region) const;
+	template <typename ShapeT, typename VisitorT>
+	bool VisitNodeForShape(TreeNode* node, const BoundingBox<Number>& node_bounds, bool free_ride,
+		const ShapeT& shape, VisitorT& visitor) const;
+	template <typename VisitorT>
+	bool VisitSegment(const typename TreeNode::ObjectContainer::iterator& it,
+		detail::BoundsTest test, const BoundingBox<Number>& region, VisitorT& visitor) const;
+	///< visits the objects of the segment the iterator is in whose cached bounds pass the test
+	template <typename VisitorT>
+	bool VisitNodeForRegions(TreeNode* node, const BoundingBox<Number>& node_bounds,
+		const std::vector<BoundingBox<Number>>& regions,
+		std::vector<std::uint32_t>& active_regions, std::size_t parent_first,
+		std::size_t parent_last, VisitorT& visitor) const;
+	typename Query::Impl* GetAvailableQueryFromPool(); ///< constant time, pops the free list
+	std::shared_ptr<const detail::SnapshotNode<Number, Object>> SnapshotSubtree(TreeNode* node,
+		const BoundingBox<Number>& node_bounds,
+		const std::shared_ptr<const detail::SnapshotNode<Number, Object>>& previous,
+		const BoundingBox<Number>& previous_bounds);
+	///< previous is the node of the last snapshot at previous_bounds, inside node_bounds or nullptr
+
+	std::unique_ptr<detail::BlocksAllocator> own_allocator_; ///< not created for shared arenas
+	detail::BlocksAllocator& allocator_; ///< either own_allocator_ or a shared arena
+	TreeNode* root_;
+	BoundingBox<Number> bounding_box_;
+	ObjectPointerContainer object_pointers_; ///< only used if Traits::kMapObjectPointers
+	std::vector<ObjectRecord> records_;
+	std::vector<std::uint32_t> free_records_;
+	int number_of_objects_;
+	int maximal_depth_;
+	FullTreeTraversal internal_traversal_;
+	QueryPoolContainer query_pool_; ///< the deque keeps the addresses stable as it grows
+	typename Query::Impl* available_queries_; ///< head of the free list threaded through the pool
+	int running_queries_; ///< queries which are opened and not at their end
+	int running_visitors_; ///< ForEach calls, running queries must not clean up under them
+	int root_regrowths_; ///< number of times the root got a new parent
+	std::vector<std::uint8_t> maintenance_path_;
+	///< child in progress on each level from the root, 4 if only the node itself is left
+	int maintenance_root_regrowths_; ///< the path is only valid under the same root
+	std::size_t modifications_; ///< lets running queries know that their hit masks are stale
+	std::shared_ptr<const Snapshot> last_snapshot_;
+	///< its nodes are reused for unchanged subtrees, in place updates only mark paths if it is set
+};
+
+
+
+
+
+
+template <typename NumberT>
+bool
+	BoundingBox<NumberT>::
+Intersects(const BoundingBox<Number>& other) const {
+	return !(
+		left + width <= other.left || other.left + other.width <= left ||
+		top + height <= other.top || other.top + other.height <= top
+		);
+}
+
+template <typename NumberT>
+bool
+	BoundingBox<NumberT>::
+Contains(const BoundingBox<Number>& other)  const {
+	return left <= other.left && left + width >= other.left + other.width &&
+		top <= other.top && top + height >= other.top + other.height;
+}
+
+template <typename NumberT>
+bool
+	BoundingBox<NumberT>::
+Contains(Number x, Number y) const {
+	return left <= x && x < left + width &&
+		top <= y && y < top + height;
+}
+
+
+
+template <typename NumberT, typename ObjectT, bool kCacheBoundingBoxesT>
+	detail::ForwardTreeTraversal<NumberT, ObjectT, kCacheBoundingBoxesT>::
+ForwardTreeTraversal() :
+	position_(BoundingBox<Number>(0, 0, 0, 0), nullptr), depth_(0) {
+}
+
+template <typename NumberT, typename ObjectT, bool kCacheBoundingBoxesT>
+void
+	detail::ForwardTreeTraversal<NumberT, ObjectT, kCacheBoundingBoxesT>::
+StartAt(TreeNode<Number, Object, kCacheBoundingBoxesT>* root, const BoundingBox<Number>& root_bounds) {
+	position_.bounding_box = root_bounds;
+	position_.node = root;
+	depth_ = 0;
+}
+
+template <typename NumberT, typename ObjectT, bool kCacheBoundingBoxesT>
+int
+	detail::ForwardTreeTraversal<NumberT, ObjectT, kCacheBoundingBoxesT>::
+GetDepth() const {
+	return depth_;
+}
+
+template <typename NumberT, typename ObjectT, bool kCacheBoundingBoxesT>
+detail::TreeNode<NumberT, ObjectT, kCacheBoundingBoxesT>*
+	detail::ForwardTreeTraversal<NumberT, ObjectT, kCacheBoundingBoxesT>::
+GetNode() const {
+	return position_.node;
+}
+
+template <typename NumberT, typename ObjectT, bool kCacheBoundingBoxesT>
+const BoundingBox<NumberT>&
+	detail::ForwardTreeTraversal<NumberT, ObjectT, kCacheBoundingBoxesT>::
+GetNodeBoundingBox() const {
+	return position_.bounding_box;
+}
+
+template <typename NumberT, typename ObjectT, bool kCacheBoundingBoxesT>
+void
+	detail::ForwardTreeTraversal<NumberT, ObjectT, kCacheBoundingBoxesT>::
+GoTopLeft() {
+	position_.bounding_box =
+		GetChildBounds(position_.bounding_box, ChildPosition::kTopLeft);
+	position_.node = position_.node->top_left;
+	assert(position_.node != nullptr);
+	depth_++;
+}
+
+template <typename NumberT, typename ObjectT, bool kCacheBoundingBoxesT>
+void
+	detail::ForwardTreeTraversal<NumberT, ObjectT, kCacheBoundingBoxesT>::
+GoTopRight() {
+	position_.bounding_box =
+		GetChildBounds(position_.bounding_box, ChildPosition::kTopRight);
+	position_.node = position_.node->top_right;
+	assert(position_.node != nullptr);
+	depth_++;
+}
+
+template <typename NumberT, typename ObjectT, bool kCacheBoundingBoxesT>
+void
+	detail::ForwardTreeTraversal<NumberT, ObjectT, kCacheBoundingBoxesT>::
+GoBottomRight() {
+	position_.bounding_box =
+		GetChildBounds(position_.bounding_box, ChildPosition::kBottomRight);
+	position_.node = position_.node->bottom_right;
+	assert(position_.node != nullptr);
+	depth_++;
+}
+
+template <typename NumberT, typename ObjectT, bool kCacheBoundingBoxesT>
+void
+	detail::ForwardTreeTraversal<NumberT, ObjectT, kCacheBoundingBoxesT>::
+GoBottomLeft() {
+	position_.bounding_box =
+		GetChildBounds(position_.bounding_box, ChildPosition::kBottomLeft);
+	position_.node = position_.node->bottom_left;
+	assert(position_.node != nullptr);
+	depth_++;
+}
+
+
+
+template <typename NumberT, typename ObjectT, bool kCacheBoundingBoxesT>
+void
+	detail::FullTreeTraversal<NumberT, ObjectT, kCacheBoundingBoxesT>::
+StartAt(TreeNode<Number, Object, kCacheBoundingBoxesT>* root, const BoundingBox<Number>& root_bounds) {
+	ForwardTreeTraversal<Number, Object, kCacheBoundingBoxes>::StartAt(root, root_bounds);
+	position_.current_child = ChildPosition::kNone;
+	position_stack_.clear();
+}
+
+template <typename NumberT, typename ObjectT, bool kCacheBoundingBoxesT>
+detail::ChildPosition
+	detail::FullTreeTraversal<NumberT, ObjectT, kCacheBoundingBoxesT>::
+GetNodeCurrentChild() const {
+	return position_.current_child;
+}
+
+template <typename NumberT, typename ObjectT, bool kCacheBoundingBoxesT>
+void
+	detail::FullTreeTraversal<NumberT, ObjectT, kCacheBoundingBoxesT>::
+SetNodeCurrentChild(ChildPosition child_position) {
+	position_.current_child = child_position;
+}
+
+template <typename NumberT, typename ObjectT, bool kCacheBoundingBoxesT>
+void
+	detail::FullTreeTraversal<NumberT, ObjectT, kCacheBoundingBoxesT>::
+GoTopLeft() {
+	assert((size_t)depth_ == position_stack_.size());
+	position_.current_child = ChildPosition::kTopLeft;
+	position_stack_.emplace_back(position_);
+	ForwardTreeTraversal<Number, Object, kCacheBoundingBoxes>::GoTopLeft();
+	position_.current_child = ChildPosition::kNone;
+}
+
+template <typename NumberT, typename ObjectT, bool kCacheBoundingBoxesT>
+void
+	detail::FullTreeTraversal<NumberT, ObjectT, kCacheBoundingBoxesT>::
+GoTopRight() {
+	assert((size_t)depth_ == position_stack_.size());
+	position_.current_child = ChildPosition::kTopRight;
+	position_stack_.emplace_back(position_);
+	ForwardTreeTraversal<Number, Object, kCacheBoundingBoxes>::GoTopRight();
+	position_.current_child = ChildPosition::kNone;
+}
+
+template <typename NumberT, typename ObjectT, bool kCacheBoundingBoxesT>
+void
+	detail::FullTreeTraversal<NumberT, ObjectT, kCacheBoundingBoxesT>::
+GoBottomRight() {
+	assert((size_t)depth_ == position_stack_.size());
+	position_.current_child = ChildPosition::kBottomRight;
+	position_stack_.emplace_back(position_);
+	ForwardTreeTraversal<Number, Object, kCacheBoundingBoxes>::GoBottomRight();
+	position_.current_child = ChildPosition::kNone;
+}
+
+template <typename NumberT, typename ObjectT, bool kCacheBoundingBoxesT>
+void
+	detail::FullTreeTraversal<NumberT, ObjectT, kCacheBoundingBoxesT>::
+GoBottomLeft() {
+	assert((size_t)depth_ == position_stack_.size());
+	position_.current_child = ChildPosition::kBottomLeft;
+	position_stack_.emplace_back(position_);
+	ForwardTreeTraversal<Number, Object, kCacheBoundingBoxes>::GoBottomLeft();
+	position_.current_child = ChildPosition::kNone;
+}
+
+template <typename NumberT, typename ObjectT, bool kCacheBoundingBoxesT>
+void
+	detail::FullTreeTraversal<NumberT, ObjectT, kCacheBoundingBoxesT>::
+GoUp() {
+	assert((size_t)depth_ == position_stack_.size() && depth_ > 0);
+	position_ = position_stack_.back();
+	depth_--;
+	position_stack_.pop_back();
+}
+
+
+
+template <typename NumberT, typename ObjectT, bool kCacheBoundingBoxesT>
+void
+	detail::ChunkedObjectList<NumberT, ObjectT, kCacheBoundingBoxesT>::Slot::
+SetBoundingBox(const BoundingBox<Number>& object_bounds) const {
+	Bounds::Store(bounds, stride, object_bounds);
+}
+
+template <typename NumberT, typename ObjectT, bool kCacheBoundingBoxesT>
+	detail::ChunkedObjectList<NumberT, ObjectT, kCacheBoundingBoxesT>::iterator::
+iterator() : segment_(nullptr), segment_tags_(nullptr), segment_bounds_(nullptr), index_(0),
+	capacity_(0), next_chunk_(nullptr), remaining_(0) {
+}
+
+template <typename NumberT, typename ObjectT, bool kCacheBoundingBoxesT>
+	detail::ChunkedObjectList<NumberT, ObjectT, kCacheBoundingBoxesT>::iterator::
+iterator(Object** segment, std::uint32_t* segment_tags, Number* segment_bounds,
+		std::size_t capacity, Chunk* next_chunk, std::size_t remaining) :
+	segment_(segment), segment_tags_(segment_tags), segment_bounds_(segment_bounds), index_(0),
+	capacity_(capacity), next_chunk_(next_chunk), remaining_(remaining) {
+}
+
+template <typename NumberT, typename ObjectT, bool kCacheBoundingBoxesT>
+ObjectT*&
+	detail::ChunkedObjectList<NumberT, ObjectT, kCacheBoundingBoxesT>::iterator::
+operator*() const {
+	assert(remaining_ > 0);
+	return segment_[index_];
+}
+
+template <typename NumberT, typename ObjectT, bool kCacheBoundingBoxesT>
+auto
+	detail::ChunkedObjectList<NumberT, ObjectT, kCacheBoundingBoxesT>::iterator::
+operator++() -> iterator& {
+	assert(remaining_ > 0);
+	remaining_--;
+	index_++;
+	if (index_ == capacity_ && remaining_ > 0) {
+		assert(next_chunk_ != nullptr);
+		segment_ = next_chunk_->objects;
+		segment_tags_ = next_chunk_->tags;
+		segment_bounds_ = next_chunk_->GetBoundsData();
+		index_ = 0;
+		capacity_ = kChunkSlots;
+		next_chunk_ = next_chunk_->next;
+	}
+	return *this;
+}
+
+template <typename NumberT, typename ObjectT, bool kCacheBoundingBoxesT>
+auto
+	detail::ChunkedObjectList<NumberT, ObjectT, kCacheBoundingBoxesT>::iterator::
+operator++(int) -> iterator {
+	iterator previous = *this;
+	++*this;
+	return previous;
+}
+
+template <typename NumberT, typename ObjectT, bool kCacheBoundingBoxesT>
+bool
+	detail::ChunkedObjectList<NumberT, ObjectT, kCacheBoundingBoxesT>::iterator::
+operator==(const iterator& other) const {
+	return remaining_ == other.remaining_;
+}
+
+template <typename NumberT, typename ObjectT, bool kCacheBoundingBoxesT>
+bool
+	detail::ChunkedObjectList<NumberT, ObjectT, kCacheBoundingBoxesT>::iterator::
+operator!=(const iterator& other) const {
+	return remaining_ != other.remaining_;
+}
+
+template <typename NumberT, typename ObjectT, bool kCacheBoundingBoxesT>
+BoundingBox<NumberT>
+	detail::ChunkedObjectList<NumberT, ObjectT, kCacheBoundingBoxesT>::iterator::
+GetBoundingBox() const {
+	assert(kCacheBoundingBoxes);
+	assert(remaining_ > 0);
+	return Bounds::Load(Bounds::Offset(segment_bounds_, index_), capacity_);
+}
+
+template <typename NumberT, typename ObjectT, bool kCacheBoundingBoxesT>
+auto
+	detail::ChunkedObjectList<NumberT, ObjectT, kCacheBoundingBoxesT>::iterator::
+Advance(std::size_t count) -> iterator& {
+	assert(count > 0 && count <= GetSegmentRemaining());
+	remaining_ -= count - 1;
+	index_ += count - 1;
+	return ++*this;
+}
+
+template <typename NumberT, typename ObjectT, bool kCacheBoundingBoxesT>
+std::size_t
+	detail::ChunkedObjectList<NumberT, ObjectT, kCacheBoundingBoxesT>::iterator::
+GetSegmentRemaining() const {
+	return capacity_ - index_ < remaining_ ? capacity_ - index_ : remaining_;
+}
+
+template <typename NumberT, typename ObjectT, bool kCacheBoundingBoxesT>
+auto
+	detail::ChunkedObjectList<NumberT, ObjectT, kCacheBoundingBoxesT>::iterator::
+GetSegmentBounds() const -> const Number* {
+	assert(kCacheBoundingBoxes);
+	assert(remaining_ > 0);
+	return Bounds::Offset(segment_bounds_, index_);
+}
+
+template <typename NumberT, typename ObjectT, bool kCacheBoundingBoxesT>
+std::size_t
+	detail::ChunkedObjectList<NumberT, ObjectT, kCacheBoundingBoxesT>::iterator::
+GetSegmentStride() const {
+	return capacity_;
+}
+
+template <typename NumberT, typename ObjectT, bool kCacheBoundingBoxesT>
+auto
+	detail::ChunkedObjectList<NumberT, ObjectT, kCacheBoundingBoxesT>::iterator::
+GetSlot() const -> Slot {
+	assert(remaining_ > 0);
+	Slot slot;
+	slot.object = &segment_[index_];
+	slot.tag = &segment_tags_[index_];
+	slot.bounds = Bounds::Offset(segment_bounds_, index_);
+	slot.stride = capacity_;
+	return slot;
+}
+
+template <typename NumberT, typename ObjectT, bool kCacheBoundingBoxesT>
+	detail::ChunkedObjectList<NumberT, ObjectT, kCacheBoundingBoxesT>::
+ChunkedObjectList() : size_(0), first_chunk_(nullptr), last_chunk_(nullptr) {
+}
+
+template <typename NumberT, typename ObjectT, bool kCacheBoundingBoxesT>
+	detail::ChunkedObjectList<NumberT, ObjectT, kCacheBoundingBoxesT>::
+~ChunkedObjectList() {
+	assert(first_chunk_ == nullptr); // Clear() needs to be called with the allocator
+}
+
+template <typename NumberT, typename ObjectT, bool kCacheBoundingBoxesT>
+bool
+	detail::ChunkedObjectList<NumberT, ObjectT, kCacheBoundingBoxesT>::
+empty() const {
+	return size_ == 0;
+}
+
+template <typename NumberT, typename ObjectT, bool kCacheBoundingBoxesT>
+std::size_t
+	detail::ChunkedObjectList<NumberT, ObjectT, kCacheBoundingBoxesT>::
+size() const {
+	return size_;
+}
+
+template <typename NumberT, typename ObjectT, bool kCacheBoundingBoxesT>
+auto
+	detail::ChunkedObjectList<NumberT, ObjectT, kCacheBoundingBoxesT>::
+begin() -> iterator {
+	return iterator(inline_segment_.objects, inline_segment_.tags,
+			inline_segment_.GetBoundsData(), kInlineSlots, first_chunk_, size_);
+}
+
+template <typename NumberT, typename ObjectT, bool kCacheBoundingBoxesT>
+auto
+	detail::ChunkedObjectList<NumberT, ObjectT, kCacheBoundingBoxesT>::
+end() -> iterator {
+	return iterator();
+}
+
+template <typename NumberT, typename ObjectT, bool kCacheBoundingBoxesT>
+auto
+	detail::ChunkedObjectList<NumberT, ObjectT, kCacheBoundingBoxesT>::
+Add(Object* object, std::uint32_t tag, const BoundingBox<Number>& object_bounds,
+		BlocksAllocator& allocator) -> Slot {
+	if (size_ == 0 || *Back() != nullptr) {
+		if (size_ >= kInlineSlots && (size_ - kInlineSlots) % kChunkSlots == 0) {
+			Chunk* chunk = allocator.New<Chunk>();
+			chunk->previous = last_chunk_;
+			chunk->next = nullptr;
+			if (last_chunk_ != nullptr) {
+				last_chunk_->next = chunk;
+			}
+			else {
+				first_chunk_ = chunk;
+			}
+			last_chunk_ = chunk;
+		}
+		size_++;
+	}
+	Slot slot = Back().GetSlot();
+	*slot.object = object;
+	*slot.tag = tag;
+	slot.SetBoundingBox(object_bounds);
+	return slot;
+}
+
+template <typename NumberT, typename ObjectT, bool kCacheBoundingBoxesT>
+template <typename MovedCallbackT>
+void
+	detail::ChunkedObjectList<NumberT, ObjectT, kCacheBoundingBoxesT>::
+Compact(BlocksAllocator& allocator, MovedCallbackT moved) {
+	while (size_ > 0 && *Back() == nullptr) {
+		PopBack(allocator);
+	}
+	iterator it = begin();
+	for (std::size_t index = 0; index < size_; index++) {
+		if (*it == nullptr) {
+			// the back is not empty, so it is surely behind this slot
+			Slot slot = it.GetSlot();
+			Slot back = Back().GetSlot();
+			*slot.object = *back.object;
+			*slot.tag = *back.tag;
+			Bounds::Copy(slot.bounds, slot.stride, back.bounds, back.stride);
+			PopBack(allocator);
+			moved(*slot.object, slot);
+			while (*Back() == nullptr) {
+				PopBack(allocator);
+			}
+		}
+		// do not step into a chunk which might have been freed
+		if (index + 1 < size_) {
+			++it;
+		}
+	}
+}
+
+template <typename NumberT, typename ObjectT, bool kCacheBoundingBoxesT>
+void
+	detail::ChunkedObjectList<NumberT, ObjectT, kCacheBoundingBoxesT>::
+Clear(BlocksAllocator& allocator) {
+	Chunk* chunk = first_chunk_;
+	while (chunk != nullptr) {
+		Chunk* next_chunk = chunk->next;
+		allocator.Delete(chunk);
+		chunk = next_chunk;
+	}
+	first_chunk_ = nullptr;
+	last_chunk_ = nullptr;
+	size_ = 0;
+}
+
+template <typename NumberT, typename ObjectT, bool kCacheBoundingBoxesT>
+auto
+	detail::ChunkedObjectList<NumberT, ObjectT, kCacheBoundingBoxesT>::
+Back() -> iterator {
+	assert(size_ > 0);
+	if (size_ <= kInlineSlots) {
+		iterator back(inline_segment_.objects, inline_segment_.tags,
+				inline_segment_.GetBoundsData(), kInlineSlots, nullptr, 1);
+		back.index_ = size_ - 1;
+		return back;
+	}
+	assert(last_chunk_ != nullptr);
+	iterator back(last_chunk_->objects, last_chunk_->tags, last_chunk_->GetBoundsData(),
+			kChunkSlots, nullptr, 1);
+	back.index_ = (size_ - kInlineSlots - 1) % kChunkSlots;
+	return back;
+}
+
+template <typename NumberT, typename ObjectT, bool kCacheBoundingBoxesT>
+void
+	detail::ChunkedObjectList<NumberT, ObjectT, kCacheBoundingBoxesT>::
+PopBack(BlocksAllocator& allocator) {
+	assert(size_ > 0);
+	size_--;
+	if (size_ >= kInlineSlots && (size_ - kInlineSlots) % kChunkSlots == 0) {
+		Chunk* chunk = last_chunk_;
+		assert(chunk != nullptr);
+		last_chunk_ = chunk->previous;
+		if (last_chunk_ != nullptr) {
+			last_chunk_->next = nullptr;
+		}
+		else {
+			first_chunk_ = nullptr;
+		}
+		allocator.Delete(chunk);
+	}
+}
+
+
+
+
+template <typename KeyT>
+	detail::PointerMap<KeyT>::
+PointerMap() : size_(0), shift_(64) {
+}
+
+template <typename KeyT>
+std::size_t
+	detail::PointerMap<KeyT>::
+size() const {
+	return size_;
+}
+
+template <typename KeyT>
+std::size_t
+	detail::PointerMap<KeyT>::
+capacity() const {
+	return entries_.size() * 3 / 4;
+}
+
+template <typename KeyT>
+std::uint32_t*
+	detail::PointerMap<KeyT>::
+Find(const Key* key) {
+	if (size_ == 0) {
+		return nullptr;
+	}
+	Entry& entry = entries_[Probe(key)];
+	return entry.key != nullptr ? &entry.value : nullptr;
+}
+
+template <typename KeyT>
+const std::uint32_t*
+	detail::PointerMap<KeyT>::
+Find(const Key* key) const {
+	if (size_ == 0) {
+		return nullptr;
+	}
+	const Entry& entry = entries_[Probe(key)];
+	return entry.key != nullptr ? &entry.value : nullptr;
+}
+
+template <typename KeyT>
+std::pair<std::uint32_t*, bool>
+	detail::PointerMap<KeyT>::
+Emplace(Key* key, std::uint32_t value) {
+	assert(key != nullptr);
+	// the load factor is kept under 3/4
+	if ((size_ + 1) * 4 > entries_.size() * 3) {
+		Rehash(entries_.size() < kMinCapacity ? kMinCapacity : entries_.size() * 2);
+	}
+	Entry& entry = entries_[Probe(key)];
+	if (entry.key != nullptr) {
+		return std::make_pair(&entry.value, false);
+	}
+	entry.key = key;
+	entry.value = value;
+	size_++;
+	return std::make_pair(&entry.value, true);
+}
+
+template <typename KeyT>
+bool
+	detail::PointerMap<KeyT>::
+Extract(const Key* key, std::uint32_t* value) {
+	if (size_ == 0) {
+		return false;
+	}
+	std::size_t hole = Probe(key);
+	if (entries_[hole].key == nullptr) {
+		return false;
+	}
+	*value = entries_[hole].value;
+	size_--;
+	const std::size_t mask = entries_.size() - 1;
+	std::size_t index = hole;
+	while (true) {
+		index = (index + 1) & mask;
+		if (entries_[index].key == nullptr) {
+			break;
+		}
+		// an entry can fill the hole if the hole is not before its home in its run
+		std::size_t home = GetHome(entries_[index].key);
+		if (((index - home) & mask) >= ((index - hole) & mask)) {
+			entries_[hole] = entries_[index];
+			hole = index;
+		}
+	}
+	entries_[hole].key = nullptr;
+	return true;
+}
+
+template <typename KeyT>
+void
+	detail::PointerMap<KeyT>::
+Reserve(std::size_t count) {
+	std::size_t capacity = entries_.size() < kMinCapacity ? kMinCapacity : entries_.size();
+	while (count * 4 > capacity * 3) {
+		capacity *= 2;
+	}
+	if (capacity > entries_.size()) {
+		Rehash(capacity);
+	}
+}
+
+template <typename KeyT>
+void
+	detail::PointerMap<KeyT>::
+Clear() {
+	for (Entry& entry : entries_) {
+		entry.key = nullptr;
+	}
+	size_ = 0;
+}
+
+template <typename KeyT>
+std::size_t
+	detail::PointerMap<KeyT>::
+GetHome(const Key* key) const {
+	std::uint64_t hash = (std::uint64_t)(std::uintptr_t)key * 0x9E3779B97F4A7C15ull;
+	return (std::size_t)(hash >> shift_);
+}
+
+template <typename KeyT>
+std::size_t
+	detail::PointerMap<KeyT>::
+Probe(const Key* key) const {
+	assert(!entries_.empty());
+	const std::size_t mask = entries_.size() - 1;
+	std::size_t index = GetHome(key);
+	while (entries_[index].key != nullptr && entries_[index].key != key) {
+		index = (index + 1) & mask;
+	}
+	return index;
+}
+
+template <typename KeyT>
+void
+	detail::PointerMap<KeyT>::
+Rehash(std::size_t capacity) {
+	assert((capacity & (capacity - 1)) == 0 && capacity * 3 >= size_ * 4);
+	std::vector<Entry> entries(capacity, Entry{nullptr, 0});
+	entries_.swap(entries);
+	shift_ = 64;
+	for (std::size_t i = capacity; i > 1; i >>= 1) {
+		shift_--;
+	}
+	for (const Entry& entry : entries) {
+		if (entry.key != nullptr) {
+			entries_[Probe(entry.key)] = entry;
+		}
+	}
+}
+
+template <typename NumberT>
+	detail::ConvexPolygon<NumberT>::
+ConvexPolygon(const std::vector<std::pair<NumberT, NumberT>>& vertices) {
+	assert(vertices.size() >= 3);
+	double doubled_area = 0.0;
+	left_ = right_ = (double)vertices[0].first;
+	top_ = bottom_ = (double)vertices[0].second;
+	for (std::size_t i = 0; i < vertices.size(); i++) {
+		const std::pair<NumberT, NumberT>& a = vertices[i];
+		const std::pair<NumberT, NumberT>& b = vertices[(i + 1) % vertices.size()];
+		doubled_area += (double)a.first * (double)b.second - (double)b.first * (double)a.second;
+		left_ = std::min(left_, (double)a.first);
+		right_ = std::max(right_, (double)a.first);
+		top_ = std::min(top_, (double)a.second);
+		bottom_ = std::max(bottom_, (double)a.second);
+	}
+	assert(doubled_area != 0.0);
+	const double orientation = doubled_area > 0.0 ? 1.0 : -1.0;
+	edges_.reserve(vertices.size());
+	for (std::size_t i = 0; i < vertices.size(); i++) {
+		const std::pair<NumberT, NumberT>& a = vertices[i];
+		const std::pair<NumberT, NumberT>& b = vertices[(i + 1) % vertices.size()];
+		Edge edge;
+		edge.normal_x = orientation * ((double)b.second - (double)a.second);
+		edge.normal_y = orientation * ((double)a.first - (double)b.first);
+		edge.offset = edge.normal_x * (double)a.first + edge.normal_y * (double)a.second;
+		edges_.push_back(edge);
+	}
+}
+
+template <typename NumberT>
+bool
+	detail::ConvexPolygon<NumberT>::
+Intersects(const BoundingBox<NumberT>& box) const {
+	const double left = (double)box.left;
+	const double top = (double)box.top;
+	const double right = left + (double)box.width;
+	const double bottom = top + (double)box.height;
+	if (right <= left_ || right_ <= left || bottom <= top_ || bottom_ <= top) {
+		return false;
+	}
+	for (const Edge& edge : edges_) {
+		double nearest = edge.normal_x * (edge.normal_x > 0.0 ? left : right) +
+			edge.normal_y * (edge.normal_y > 0.0 ? top : bottom);
+		if (nearest >= edge.offset) {
+			return false;
+		}
+	}
+	return true;
+}
+
+template <typename NumberT>
+bool
+	detail::ConvexPolygon<NumberT>::
+Contains(const BoundingBox<NumberT>& box) const {
+	const double left = (double)box.left;
+	const double top = (double)box.top;
+	const double right = left + (double)box.width;
+	const double bottom = top + (double)box.height;
+	for (const Edge& edge : edges_) {
+		double farthest = edge.normal_x * (edge.normal_x > 0.0 ? right : left) +
+			edge.normal_y * (edge.normal_y > 0.0 ? bottom : top);
+		if (farthest >= edge.offset) {
+			return false;
+		}
+	}
+	return true;
+}
+
+inline
+	detail::ParallelTasks::
+ParallelTasks(std::size_t task_count, std::function<bool(std::size_t)> run_task) :
+	task_count_(task_count), run_task_(std::move(run_task)), next_task_(0), stopped_(false),
+	finished_tasks_(0) {
+}
+
+inline void
+	detail::ParallelTasks::
+Work() {
+	do {
+		std::size_t task = next_task_.fetch_add(1);
+		if (task >= task_count_) {
+			return;
+		}
+		if (!stopped_.load(std::memory_order_relaxed) && !run_task_(task)) {
+			stopped_.store(true, std::memory_order_relaxed);
+		}
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (++finished_tasks_ == task_count_) {
+			finished_.notify_all();
+		}
+	} while (true);
+}
+
+inline void
+	detail::ParallelTasks::
+WaitUntilFinished() {
+	std::unique_lock<std::mutex> lock(mutex_);
+	finished_.wait(lock, [this]() {
+		return finished_tasks_ == task_count_;
+	});
+}
+
+inline bool
+	detail::ParallelTasks::
+IsStopped() const {
+	return stopped_.load();
+}
+
+
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Query::Impl::
+Impl(bool pooled) : quadtree_(nullptr), query_region_(0,0,0,0),
+	query_type_(QueryType::kEndOfQuery),
+	free_ride_from_level_(LooseQuadtree<Number, Object, BoundingBoxExtractor, Traits>::Impl::kInternalMaxDepth),
+	hit_mask_(0), hit_mask_slots_(0), hit_mask_modifications_(0),
+	pooled_(pooled), next_available_(nullptr) {
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+void
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Query::Impl::
+Acquire(typename LooseQuadtree<Number, Object, BoundingBoxExtractor, Traits>::Impl* quadtree,
+		const BoundingBox<Number>* query_region, QueryType query_type) {
+	assert(IsAvailable());
+	assert(query_type != QueryType::kEndOfQuery);
+	quadtree_ = quadtree;
+	query_region_ = *query_region;
+	query_type_ = query_type;
+	free_ride_from_level_ =
+		LooseQuadtree<Number, Object, BoundingBoxExtractor, Traits>::Impl::kInternalMaxDepth;
+	if (quadtree->root_ == nullptr) {
+		query_type_ = QueryType::kEndOfQuery;
+	}
+	else {
+		quadtree_->running_queries_++;
+		traversal_.StartAt(quadtree->root_, quadtree->bounding_box_);
+		object_iterator_ = traversal_.GetNode()->objects.begin();
+		hit_mask_slots_ = 0;
+		Seek();
+	}
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+void
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Query::Impl::
+Release() {
+	assert(!IsAvailable());
+	if (query_type_ != QueryType::kEndOfQuery) {
+		// abandoned before its end, it must not hold back the cleanup of other queries
+		quadtree_->running_queries_--;
+		query_type_ = QueryType::kEndOfQuery;
+	}
+	if (pooled_) {
+		next_available_ = quadtree_->available_queries_;
+		quadtree_->available_queries_ = this;
+	}
+	quadtree_ = nullptr;
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+bool
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Query::Impl::
+IsAvailable() const {
+	return quadtree_ == nullptr;
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+bool
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Query::Impl::
+EndOfQuery() const {
+	assert(!IsAvailable());
+	return query_type_ == QueryType::kEndOfQuery;
+}
+
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+ObjectT*
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Query::Impl::
+GetCurrent() const {
+	assert(!IsAvailable());
+	assert(!EndOfQuery());
+	return *object_iterator_;
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+void
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Query::Impl::
+Next() {
+	assert(!IsAvailable());
+	assert(!EndOfQuery());
+	StepObjects(1);
+	Seek();
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+void
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Query::Impl::
+Seek() {
+	do {
+		if (object_iterator_ == traversal_.GetNode()->objects.end()) {
+			do {
+				switch (traversal_.GetNodeCurrentChild()) {
+				case detail::ChildPosition::kNone:
+					if (traversal_.GetNode()->top_left == nullptr) {
+						traversal_.SetNodeCurrentChild(detail::ChildPosition::kTopLeft);
+						continue;
+					}
+					else {
+						traversal_.GoTopLeft();
+					}
+					break;
+				case detail::ChildPosition::kTopLeft:
+					if (traversal_.GetNode()->top_right == nullptr) {
+						traversal_.SetNodeCurrentChild(detail::ChildPosition::kTopRight);
+						continue;
+					}
 					else {
 						traversal_.GoTopRight();
 					}
@@ -805,462 +2625,2244 @@ Next() {
 						continue;
 					}
 					else {
-						traversal_.GoBottomLeft();
+						traversal_.GoBottomLeft();
+					}
+					break;
+				case detail::ChildPosition::kBottomLeft:
+					assert(quadtree_->running_queries_ > 0);
+
+					//only run this if no parallel queries are running
+					if (quadtree_->running_queries_ == 1 && quadtree_->running_visitors_ == 0) {
+						quadtree_->CleanupNode(traversal_.GetNode(), traversal_.GetDepth());
+					}
+
+					if (traversal_.GetDepth() > 0) {
+						bool remove_node =
+							LooseQuadtree<Number, Object, BoundingBoxExtractor, Traits>::Impl::
+								IsEmptyNode(traversal_.GetNode());
+						TreeNode* node = traversal_.GetNode();
+						traversal_.GoUp();
+
+						// if the node is empty no other queries can be invalidated by deleting
+						if (remove_node) {
+							assert(node->object_count == 0);
+							switch (traversal_.GetNodeCurrentChild()) {
+							case detail::ChildPosition::kTopLeft:
+								traversal_.GetNode()->top_left = nullptr;
+								break;
+							case detail::ChildPosition::kTopRight:
+								traversal_.GetNode()->top_right = nullptr;
+								break;
+							case detail::ChildPosition::kBottomRight:
+								traversal_.GetNode()->bottom_right = nullptr;
+								break;
+							case detail::ChildPosition::kBottomLeft:
+								traversal_.GetNode()->bottom_left = nullptr;
+								break;
+							case detail::ChildPosition::kNone:
+								assert(false);
+							}
+							quadtree_->allocator_.Delete(node);
+						}
+
+						if (free_ride_from_level_ == traversal_.GetDepth() + 1) {
+							free_ride_from_level_ =
+								LooseQuadtree<Number, Object,
+									BoundingBoxExtractor, Traits>::Impl::kInternalMaxDepth;
+						}
+						continue;
+					}
+					else {
+						// if the root is empty no other queries can be invalidated by deleting
+						if (LooseQuadtree<Number, Object, BoundingBoxExtractor, Traits>::Impl::
+								IsEmptyNode(traversal_.GetNode())) {
+							assert(traversal_.GetNode() == quadtree_->root_);
+							assert(quadtree_->GetSize() == 0);
+							quadtree_->allocator_.Delete(quadtree_->root_);
+							quadtree_->root_ = nullptr;
+							quadtree_->bounding_box_ = BoundingBox<Number>(0,0,0,0);
+						}
+
+						quadtree_->running_queries_--;
+						query_type_ = QueryType::kEndOfQuery;
+						return;
+					}
+					break;
+				}
+				assert(traversal_.GetNodeCurrentChild() == detail::ChildPosition::kNone);
+				{
+					FitType fit = FitType::kPartialFit;
+					if (traversal_.GetDepth() >= free_ride_from_level_ ||
+							(fit = CurrentNodeFits()) != FitType::kNoFit) {
+						if (fit == FitType::kFreeRide) {
+							free_ride_from_level_ = traversal_.GetDepth();
+						}
+					}
+					else {
+						traversal_.SetNodeCurrentChild(detail::ChildPosition::kBottomLeft);
+						continue;
 					}
-					break;
-				case detail::ChildPosition::kBottomLeft:
+				}
+				object_iterator_ = traversal_.GetNode()->objects.begin();
+				hit_mask_slots_ = 0;
+				break;
+			} while (true);
+		}
+		else if (Traits::kCacheBoundingBoxes && traversal_.GetDepth() < free_ride_from_level_) {
+			if (hit_mask_slots_ == 0 || hit_mask_modifications_ != quadtree_->modifications_) {
+				CalculateHitMask();
+			}
+			if (hit_mask_ == 0) {
+				StepObjects(hit_mask_slots_);
+				continue;
+			}
+			std::size_t misses = (std::size_t)detail::CountTrailingZeros(hit_mask_);
+			if (misses > 0) {
+				StepObjects(misses);
+			}
+			else if (*object_iterator_ != nullptr) {
+				break;
+			}
+			else {
+				StepObjects(1);
+			}
+		}
+		else {
+			// empty slots are only removed by Compact() when leaving the node
+			if (*object_iterator_ != nullptr &&
+					(traversal_.GetDepth() >= free_ride_from_level_ ||
+					CurrentObjectFits())) {
+				break;
+			}
+			StepObjects(1);
+		}
+	} while (true);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+void
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Query::Impl::
+StepObjects(std::size_t count) {
+	object_iterator_.Advance(count);
+	if (count < hit_mask_slots_) {
+		hit_mask_ >>= count;
+		hit_mask_slots_ -= count;
+	}
+	else {
+		hit_mask_ = 0;
+		hit_mask_slots_ = 0;
+	}
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+void
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Query::Impl::
+CalculateHitMask() {
+	hit_mask_slots_ = object_iterator_.GetSegmentRemaining();
+	hit_mask_modifications_ = quadtree_->modifications_;
+	hit_mask_ = detail::BoundsTester<Number>::Test(GetBoundsTest(query_type_),
+			object_iterator_.GetSegmentBounds(), object_iterator_.GetSegmentStride(),
+			hit_mask_slots_, query_region_);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+bool
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Query::Impl::
+CurrentObjectFits() const {
+	// cached bounding boxes are tested by CalculateHitMask() instead
+	assert(!Traits::kCacheBoundingBoxes);
+	BoundingBox<Number> object_bounds(0,0,0,0);
+	BoundingBoxExtractor::ExtractBoundingBox(GetCurrent(), &object_bounds);
+	return ObjectFits(query_type_, query_region_, object_bounds);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+auto
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Query::Impl::
+CurrentNodeFits() const -> FitType {
+	return NodeFits(query_type_, query_region_, traversal_.GetNodeBoundingBox());
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+detail::BoundsTest
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Query::Impl::
+GetBoundsTest(QueryType query_type) {
+	switch (query_type) {
+	case QueryType::kIntersects:
+		return detail::BoundsTest::kIntersects;
+	case QueryType::kInside:
+		return detail::BoundsTest::kInside;
+	case QueryType::kContains:
+		return detail::BoundsTest::kContains;
+	case QueryType::kEndOfQuery:
+		assert(false);
+	}
+	return detail::BoundsTest::kIntersects;
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+bool
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Query::Impl::
+ObjectFits(QueryType query_type, const BoundingBox<Number>& query_region,
+		const BoundingBox<Number>& object_bounds) {
+	switch (query_type) {
+	case QueryType::kIntersects:
+		return query_region.Intersects(object_bounds);
+	case QueryType::kInside:
+		return query_region.Contains(object_bounds);
+	case QueryType::kContains:
+		return object_bounds.Contains(query_region);
+	case QueryType::kEndOfQuery:
+		assert(false);
+	}
+	return false;
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+auto
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Query::Impl::
+NodeFits(QueryType query_type, const BoundingBox<Number>& query_region,
+		const BoundingBox<Number>& node_bounds) -> FitType {
+	BoundingBox<Number> extended_bounds = detail::GetLooseBounds(node_bounds);
+	switch (query_type) {
+	case QueryType::kIntersects:
+		if (!query_region.Intersects(extended_bounds)) {
+			return FitType::kNoFit;
+		}
+		else if (query_region.Contains(node_bounds)) {
+			return FitType::kFreeRide;
+		}
+		return FitType::kPartialFit;
+	case QueryType::kInside:
+		if (!query_region.Intersects(node_bounds)) {
+			return FitType::kNoFit;
+		}
+		else if (query_region.Contains(extended_bounds)) {
+			return FitType::kFreeRide;
+		}
+		return FitType::kPartialFit;
+	case QueryType::kContains:
+		if (!extended_bounds.Contains(query_region)) {
+			return FitType::kNoFit;
+		}
+		return FitType::kPartialFit;
+	case QueryType::kEndOfQuery:
+		assert(false);
+	}
+	return FitType::kNoFit;
+}
+
+
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+Impl(detail::BlocksAllocator* shared_allocator) :
+	own_allocator_(shared_allocator == nullptr ? new detail::BlocksAllocator() : nullptr),
+	allocator_(shared_allocator == nullptr ? *own_allocator_ : *shared_allocator), root_(nullptr), bounding_box_(0, 0, 0, 0),
+	number_of_objects_(0), maximal_depth_(kInternalMinDepth),
+	query_pool_(detail::BlocksAllocatorAdaptor<typename Query::Impl>(allocator_)),
+	available_queries_(nullptr), running_queries_(0), running_visitors_(0), root_regrowths_(0),
+	maintenance_root_regrowths_(0), modifications_(0) {
+	assert(maximal_depth_ < kInternalMaxDepth);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+~Impl() {
+	DeleteTree();
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+bool
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+Insert(Object* object) {
+	static_assert(Traits::kMapObjectPointers, "use the handles or map the object pointers");
+	auto found = object_pointers_.Emplace(object, 0);
+	if (!found.second) {
+		Relocate(*found.first);
+		return false;
+	}
+	std::uint32_t record_index = AcquireRecord();
+	*found.first = record_index;
+	InsertNew(object, record_index);
+	return true;
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+bool
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+Update(Object* object) {
+	return !Insert(object);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+bool
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+Remove(Object* object) {
+	static_assert(Traits::kMapObjectPointers, "use the handles or map the object pointers");
+	std::uint32_t record_index;
+	if (object_pointers_.Extract(object, &record_index)) {
+		Unlink(record_index);
+		RecalculateMaximalDepth();
+		return true;
+	}
+	return false;
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+bool
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+Contains(Object* object) const {
+	static_assert(Traits::kMapObjectPointers, "use the handles or map the object pointers");
+	return object_pointers_.Find(object) != nullptr;
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+auto
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+InsertWithHandle(Object* object) -> Handle {
+	std::uint32_t record_index;
+	if (Traits::kMapObjectPointers) {
+		auto found = object_pointers_.Emplace(object, 0);
+		if (!found.second) {
+			Relocate(*found.first);
+			return Handle(*found.first, records_[*found.first].generation);
+		}
+		record_index = AcquireRecord();
+		*found.first = record_index;
+	}
+	else {
+		record_index = AcquireRecord();
+	}
+	InsertNew(object, record_index);
+	return Handle(record_index, records_[record_index].generation);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+void
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+Update(Handle handle) {
+	assert(Contains(handle));
+	Relocate(handle.index_);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+bool
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+Remove(Handle handle) {
+	if (!Contains(handle)) {
+		return false;
+	}
+	if (Traits::kMapObjectPointers) {
+		std::uint32_t record_index;
+		object_pointers_.Extract(*records_[handle.index_].slot.object, &record_index);
+		assert(record_index == handle.index_);
+	}
+	Unlink(handle.index_);
+	RecalculateMaximalDepth();
+	return true;
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+bool
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+Contains(Handle handle) const {
+	return handle.index_ < records_.size() &&
+		records_[handle.index_].generation == handle.generation_;
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+template <typename ObjectIteratorT>
+void
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+BulkLoad(ObjectIteratorT first, ObjectIteratorT last) {
+	static_assert(Traits::kMapObjectPointers, "batches need the object pointers mapped");
+	if (number_of_objects_ != 0) {
+		UpdateMany(first, last); // the objects already in the tree stay where they are
+		return;
+	}
+	if (root_ != nullptr) {
+		DeleteTree(); // only empty nodes are left, the new root is sized for the objects
+	}
+	std::vector<PendingObject> pending;
+	ReserveForBatch(first, last, pending,
+		typename std::iterator_traits<ObjectIteratorT>::iterator_category());
+	for (; first != last; ++first) {
+		auto found = object_pointers_.Emplace(*first, 0);
+		if (!found.second) {
+			continue; // it is in the range twice
+		}
+		PendingObject entry = {*first, BoundingBox<Number>(0, 0, 0, 0), 0, 0, 0, 0};
+		BoundingBoxExtractor::ExtractBoundingBox(entry.object, &entry.object_bounds);
+		entry.record = AcquireRecord();
+		*found.first = entry.record;
+		number_of_objects_++;
+		GetPlacement(entry.object_bounds, &entry.maximal_object_extent,
+			&entry.object_center_x, &entry.object_center_y);
+		pending.push_back(entry);
+	}
+	modifications_++;
+	if (!pending.empty()) {
+		PlaceObjects(pending);
+	}
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+template <typename ObjectIteratorT>
+void
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+UpdateMany(ObjectIteratorT first, ObjectIteratorT last) {
+	static_assert(Traits::kMapObjectPointers, "batches need the object pointers mapped");
+	std::vector<PendingObject> pending;
+	ReserveForBatch(first, last, pending,
+		typename std::iterator_traits<ObjectIteratorT>::iterator_category());
+	for (; first != last; ++first) {
+		PendingObject entry = {*first, BoundingBox<Number>(0, 0, 0, 0), 0, 0, 0, 0};
+		BoundingBoxExtractor::ExtractBoundingBox(entry.object, &entry.object_bounds);
+		auto found = object_pointers_.Emplace(entry.object, 0);
+		if (!found.second) {
+			ObjectRecord& record = records_[*found.first];
+			if (record.slot.object == nullptr) {
+				continue; // it is in the range twice and already waits to be placed
+			}
+			assert(*record.slot.object == entry.object);
+			if (StaysInNode(record, entry.object_bounds)) {
+				record.slot.SetBoundingBox(entry.object_bounds);
+				if (last_snapshot_ != nullptr) {
+					AdjustObjectCounts(record, 0);
+				}
+				continue;
+			}
+			*record.slot.object = nullptr;
+			AdjustObjectCounts(record, -1);
+			record.slot.object = nullptr;
+			entry.record = *found.first;
+		}
+		else {
+			// a new record has no slot yet, so it is seen as pending
+			entry.record = AcquireRecord();
+			*found.first = entry.record;
+			number_of_objects_++;
+		}
+		GetPlacement(entry.object_bounds, &entry.maximal_object_extent,
+			&entry.object_center_x, &entry.object_center_y);
+		pending.push_back(entry);
+	}
+	modifications_++;
+	if (!pending.empty()) {
+		PlaceObjects(pending);
+	}
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+template <typename ObjectIteratorT>
+int
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+RemoveMany(ObjectIteratorT first, ObjectIteratorT last) {
+	static_assert(Traits::kMapObjectPointers, "batches need the object pointers mapped");
+	std::vector<RemovedObject> removed;
+	for (; first != last; ++first) {
+		std::uint32_t record_index;
+		if (!object_pointers_.Extract(*first, &record_index)) {
+			continue;
+		}
+		const ObjectRecord& record = records_[record_index];
+		*record.slot.object = nullptr;
+		const BoundingBox<Number>& node_bounds = record.node_bounds;
+		RemovedObject entry = {
+			(Number)(node_bounds.left +
+				(Number)((typename detail::MakeDistance<Number>::Type)node_bounds.width / 2)),
+			(Number)(node_bounds.top +
+				(Number)((typename detail::MakeDistance<Number>::Type)node_bounds.height / 2)),
+			record.node_level + root_regrowths_};
+		removed.push_back(entry);
+		ReleaseRecord(record_index);
+		number_of_objects_--;
+	}
+	if (!removed.empty()) {
+		// the objects share the way down from the root instead of descending one by one
+		SubtractObjectCounts(root_, bounding_box_, 0,
+			removed.data(), removed.data() + removed.size());
+	}
+	RecalculateMaximalDepth();
+	return (int)removed.size();
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+auto
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+QueryIntersectsRegion(const BoundingBox<Number>& region) -> Query {
+	typename Query::Impl* query_impl = GetAvailableQueryFromPool();
+	query_impl->Acquire(this, &region, Query::Impl::QueryType::kIntersects);
+	return Query(query_impl);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+auto
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+QueryInsideRegion(const BoundingBox<Number>& region) -> Query {
+	typename Query::Impl* query_impl = GetAvailableQueryFromPool();
+	query_impl->Acquire(this, &region, Query::Impl::QueryType::kInside);
+	return Query(query_impl);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+auto
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+QueryContainsRegion(const BoundingBox<Number>& region) -> Query {
+	typename Query::Impl* query_impl = GetAvailableQueryFromPool();
+	query_impl->Acquire(this, &region, Query::Impl::QueryType::kContains);
+	return Query(query_impl);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+void
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+QueryIntersectsRegion(const BoundingBox<Number>& region, std::vector<Object*>& out) const {
+	detail::ObjectAppender<Object> appender = {&out};
+	ForEach(Query::Impl::QueryType::kIntersects, region, appender);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+void
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+QueryInsideRegion(const BoundingBox<Number>& region, std::vector<Object*>& out) const {
+	detail::ObjectAppender<Object> appender = {&out};
+	ForEach(Query::Impl::QueryType::kInside, region, appender);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+void
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+QueryContainsRegion(const BoundingBox<Number>& region, std::vector<Object*>& out) const {
+	detail::ObjectAppender<Object> appender = {&out};
+	ForEach(Query::Impl::QueryType::kContains, region, appender);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+template <typename VisitorT>
+bool
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+ForEachIntersecting(const BoundingBox<Number>& region, VisitorT& visitor) {
+	return ForEach(Query::Impl::QueryType::kIntersects, region, visitor);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+template <typename VisitorT>
+bool
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+ForEachIntersecting(const BoundingBox<Number>& region, VisitorT& visitor) const {
+	return ForEach(Query::Impl::QueryType::kIntersects, region, visitor);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+template <typename VisitorT>
+bool
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+ForEachInside(const BoundingBox<Number>& region, VisitorT& visitor) {
+	return ForEach(Query::Impl::QueryType::kInside, region, visitor);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+template <typename VisitorT>
+bool
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+ForEachInside(const BoundingBox<Number>& region, VisitorT& visitor) const {
+	return ForEach(Query::Impl::QueryType::kInside, region, visitor);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+template <typename VisitorT>
+bool
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+ForEachContaining(const BoundingBox<Number>& region, VisitorT& visitor) {
+	return ForEach(Query::Impl::QueryType::kContains, region, visitor);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+template <typename VisitorT>
+bool
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+ForEachContaining(const BoundingBox<Number>& region, VisitorT& visitor) const {
+	return ForEach(Query::Impl::QueryType::kContains, region, visitor);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+template <typename VisitorT>
+bool
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+ForEach(typename Query::Impl::QueryType query_type, const BoundingBox<Number>& region,
+		VisitorT& visitor) {
+	running_visitors_++;
+	bool finished = static_cast<const Impl&>(*this).ForEach(query_type, region, visitor);
+	running_visitors_--;
+	return finished;
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+template <typename VisitorT>
+bool
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+ForEach(typename Query::Impl::QueryType query_type, const BoundingBox<Number>& region,
+		VisitorT& visitor) const {
+	if (root_ == nullptr) {
+		return true;
+	}
+	return VisitNode(root_, bounding_box_, false, query_type, region, visitor);
+}
+
+// Recursion is bounded by kInternalMaxDepth, the visitor is inlined into every level
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+template <typename VisitorT>
+bool
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+VisitNode(TreeNode* node, const BoundingBox<Number>& node_bounds, bool free_ride,
+		typename Query::Impl::QueryType query_type, const BoundingBox<Number>& region,
+		VisitorT& visitor) const {
+	using QueryImpl = typename Query::Impl;
+	if (!free_ride) {
+		typename QueryImpl::FitType fit = QueryImpl::NodeFits(query_type, region, node_bounds);
+		if (fit == QueryImpl::FitType::kNoFit) {
+			return true;
+		}
+		free_ride = fit == QueryImpl::FitType::kFreeRide;
+	}
+
+	if (!VisitNodeObjects(node, free_ride, query_type, region, visitor)) {
+		return false;
+	}
+
+	if (node->top_left != nullptr && !VisitNode(node->top_left,
+			detail::GetChildBounds(node_bounds, detail::ChildPosition::kTopLeft),
+			free_ride, query_type, region, visitor)) {
+		return false;
+	}
+	if (node->top_right != nullptr && !VisitNode(node->top_right,
+			detail::GetChildBounds(node_bounds, detail::ChildPosition::kTopRight),
+			free_ride, query_type, region, visitor)) {
+		return false;
+	}
+	if (node->bottom_right != nullptr && !VisitNode(node->bottom_right,
+			detail::GetChildBounds(node_bounds, detail::ChildPosition::kBottomRight),
+			free_ride, query_type, region, visitor)) {
+		return false;
+	}
+	if (node->bottom_left != nullptr && !VisitNode(node->bottom_left,
+			detail::GetChildBounds(node_bounds, detail::ChildPosition::kBottomLeft),
+			free_ride, query_type, region, visitor)) {
+		return false;
+	}
+	return true;
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+template <typename VisitorT>
+bool
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+VisitNodeObjects(TreeNode* node, bool free_ride,
+		typename Query::Impl::QueryType query_type, const BoundingBox<Number>& region,
+		VisitorT& visitor) const {
+	using QueryImpl = typename Query::Impl;
+	auto it = node->objects.begin();
+	auto end = node->objects.end();
+	if (free_ride) {
+		return detail::VisitObjects(visitor, node->objects);
+	}
+	else if (Traits::kCacheBoundingBoxes) {
+		const detail::BoundsTest test = QueryImpl::GetBoundsTest(query_type);
+		while (it != end) {
+			const std::size_t count = it.GetSegmentRemaining();
+			if (!VisitSegment(it, test, region, visitor)) {
+				return false;
+			}
+			it.Advance(count);
+		}
+	}
+	else {
+		for (; it != end; ++it) {
+			Object* object = *it;
+			if (object == nullptr) {
+				continue;
+			}
+			BoundingBox<Number> object_bounds(0,0,0,0);
+			BoundingBoxExtractor::ExtractBoundingBox(object, &object_bounds);
+			if (QueryImpl::ObjectFits(query_type, region, object_bounds) &&
+					!detail::CallVisitor(visitor, object)) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+template <typename ExecutorT>
+void
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+QueryIntersectsRegionParallel(const BoundingBox<Number>& region, std::vector<Object*>& out,
+		int helpers, ExecutorT& executor) const {
+	using QueryType = typename Query::Impl::QueryType;
+	if (root_ == nullptr) {
+		return;
+	}
+	std::vector<ParallelTask> tasks;
+	GatherParallelTasks(root_, bounding_box_, false, GetParallelSplitLevels(helpers),
+		QueryType::kIntersects, region, tasks);
+	std::vector<std::vector<Object*>> results(tasks.size());
+	detail::RunInParallel(tasks.size(), helpers, executor, [&](std::size_t task) {
+		detail::ObjectAppender<Object> appender = {&results[task]};
+		return VisitParallelTask(tasks[task], QueryType::kIntersects, region, appender);
+	});
+	// copying is cheap next to the traversal, it is not worth handing out to the helpers again
+	std::size_t size = out.size();
+	for (const std::vector<Object*>& result : results) {
+		size += result.size();
+	}
+	out.reserve(size);
+	for (const std::vector<Object*>& result : results) {
+		out.insert(out.end(), result.begin(), result.end());
+	}
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+template <typename ExecutorT, typename VisitorT>
+bool
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+ForEachIntersectingParallel(const BoundingBox<Number>& region, int helpers,
+		ExecutorT& executor, VisitorT& visitor) const {
+	using QueryType = typename Query::Impl::QueryType;
+	if (root_ == nullptr) {
+		return true;
+	}
+	std::vector<ParallelTask> tasks;
+	GatherParallelTasks(root_, bounding_box_, false, GetParallelSplitLevels(helpers),
+		QueryType::kIntersects, region, tasks);
+	// a visitor stopping in one task stops the running ones too
+	std::atomic<bool> stopped(false);
+	auto stoppable_visitor = [&visitor, &stopped](Object* object) {
+		if (stopped.load(std::memory_order_relaxed)) {
+			return false;
+		}
+		if (!detail::CallVisitor(visitor, object)) {
+			stopped.store(true, std::memory_order_relaxed);
+			return false;
+		}
+		return true;
+	};
+	return detail::RunInParallel(tasks.size(), helpers, executor, [&](std::size_t task) {
+		return VisitParallelTask(tasks[task], QueryType::kIntersects, region, stoppable_visitor);
+	});
+}
 
-#ifndef NDEBUG
-					int running_queries = 0;
-					for (auto& query : quadtree_->query_pool_) {
-						if (!query.IsAvailable() && !query.EndOfQuery()) running_queries++;
-					}
-					assert(running_queries == quadtree_->running_queries_);
-#endif
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+void
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+GatherParallelTasks(TreeNode* node, const BoundingBox<Number>& node_bounds,
+		bool free_ride, int levels_left, typename Query::Impl::QueryType query_type,
+		const BoundingBox<Number>& region, std::vector<ParallelTask>& tasks) const {
+	using QueryImpl = typename Query::Impl;
+	if (!free_ride) {
+		typename QueryImpl::FitType fit = QueryImpl::NodeFits(query_type, region, node_bounds);
+		if (fit == QueryImpl::FitType::kNoFit) {
+			return;
+		}
+		free_ride = fit == QueryImpl::FitType::kFreeRide;
+	}
+	if (levels_left == 0) {
+		tasks.push_back(ParallelTask{node, node_bounds, free_ride, true});
+		return;
+	}
+	if (!node->objects.empty()) {
+		tasks.push_back(ParallelTask{node, node_bounds, free_ride, false});
+	}
+	TreeNode* children[4] = {node->top_left, node->top_right,
+		node->bottom_right, node->bottom_left};
+	const detail::ChildPosition positions[4] = {detail::ChildPosition::kTopLeft,
+		detail::ChildPosition::kTopRight, detail::ChildPosition::kBottomRight,
+		detail::ChildPosition::kBottomLeft};
+	for (int i = 0; i < 4; i++) {
+		if (children[i] != nullptr) {
+			GatherParallelTasks(children[i], detail::GetChildBounds(node_bounds, positions[i]),
+				free_ride, levels_left - 1, query_type, region, tasks);
+		}
+	}
+}
 
-					//only run this if no parallel queries are running
-					if (traversal_.GetDepth() > quadtree_->maximal_depth_ &&
-							quadtree_->running_queries_ == 1) {
-						typename detail::TreeNode<Object>::ObjectContainer& objects =
-								traversal_.GetNode()->objects;
-						auto iterator = objects.begin();
-						while (iterator != objects.end()) {
-							if (*iterator != nullptr) {
-								quadtree_->Update(*iterator);
-								assert(*iterator == nullptr);
-							}
-							iterator++;
-						}
-						objects.clear();
-					}
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+template <typename VisitorT>
+bool
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+VisitParallelTask(const ParallelTask& task, typename Query::Impl::QueryType query_type,
+		const BoundingBox<Number>& region, VisitorT& visitor) const {
+	if (task.whole_subtree) {
+		return VisitNode(task.node, task.node_bounds, task.free_ride, query_type, region, visitor);
+	}
+	return VisitNodeObjects(task.node, task.free_ride, query_type, region, visitor);
+}
 
-					if (traversal_.GetDepth() > 0) {
-						bool remove_node = (traversal_.GetNode()->objects.empty() &&
-								traversal_.GetNode()->top_left == nullptr &&
-								traversal_.GetNode()->top_right == nullptr &&
-								traversal_.GetNode()->bottom_right == nullptr &&
-								traversal_.GetNode()->bottom_left == nullptr);
-						detail::TreeNode<Object>* node = traversal_.GetNode();
-						traversal_.GoUp();
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+int
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+GetParallelSplitLevels(int helpers) {
+	// about 16 tasks per thread if the tree is full, less where it is sparse
+	int levels = 0;
+	while ((1ll << (levels << 1)) < 16ll * (helpers + 1) && levels < kInternalMinDepth) {
+		levels++;
+	}
+	return levels;
+}
 
-						// if the node is empty no other queries can be invalidated by deleting
-						if (remove_node) {
-							switch (traversal_.GetNodeCurrentChild()) {
-							case detail::ChildPosition::kTopLeft:
-								traversal_.GetNode()->top_left = nullptr;
-								break;
-							case detail::ChildPosition::kTopRight:
-								traversal_.GetNode()->top_right = nullptr;
-								break;
-							case detail::ChildPosition::kBottomRight:
-								traversal_.GetNode()->bottom_right = nullptr;
-								break;
-							case detail::ChildPosition::kBottomLeft:
-								traversal_.GetNode()->bottom_left = nullptr;
-								break;
-							case detail::ChildPosition::kNone:
-								assert(false);
-							}
-							quadtree_->allocator_.Delete(node);
-						}
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+template <typename VisitorT>
+bool
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+VisitSegment(const typename TreeNode::ObjectContainer::iterator& it, detail::BoundsTest test,
+		const BoundingBox<Number>& region, VisitorT& visitor) const {
+	// the visitor can add slots but those are not visited, the segment stays in place
+	Object* const* objects = &*it;
+	const Number* bounds = it.GetSegmentBounds();
+	const std::size_t stride = it.GetSegmentStride();
+	const std::size_t count = it.GetSegmentRemaining();
+	std::size_t first = 0;
+	std::size_t modifications = modifications_;
+	std::uint64_t hit_mask = detail::BoundsTester<Number>::Test(test, bounds, stride, count, region);
+	while (hit_mask != 0) {
+		std::size_t index = first + (std::size_t)detail::CountTrailingZeros(hit_mask);
+		hit_mask &= hit_mask - 1;
+		if (objects[index] == nullptr) {
+			continue;
+		}
+		if (!detail::CallVisitor(visitor, objects[index])) {
+			return false;
+		}
+		// updates in place change the cached bounding boxes, retest the rest
+		if (modifications != modifications_) {
+			first = index + 1;
+			modifications = modifications_;
+			hit_mask = first < count ?
+				detail::BoundsTester<Number>::Test(test, bounds + first, stride,
+					count - first, region) :
+				0;
+		}
+	}
+	return true;
+}
 
-						if (free_ride_from_level_ == traversal_.GetDepth() + 1) {
-							free_ride_from_level_ =
-								LooseQuadtree<Number, Object,
-									BoundingBoxExtractor>::Impl::kInternalMaxDepth;
-						}
-						continue;
-					}
-					else {
-						// if the root is empty no other queries can be invalidated by deleting
-						if (traversal_.GetNode()->objects.empty() &&
-								traversal_.GetNode()->top_left == nullptr &&
-								traversal_.GetNode()->top_right == nullptr &&
-								traversal_.GetNode()->bottom_right == nullptr &&
-								traversal_.GetNode()->bottom_left == nullptr) {
-							assert(traversal_.GetNode() == quadtree_->root_);
-							assert(quadtree_->GetSize() == 0);
-							assert(quadtree_->object_pointers_.size() == 0);
-							quadtree_->allocator_.Delete(quadtree_->root_);
-							quadtree_->root_ = nullptr;
-							quadtree_->bounding_box_ = BoundingBox<Number>(0,0,0,0);
-						}
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+template <typename VisitorT>
+bool
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+ForEachIntersectingRegions(const std::vector<BoundingBox<Number>>& regions, VisitorT& visitor) {
+	running_visitors_++;
+	bool finished = static_cast<const Impl&>(*this).ForEachIntersectingRegions(regions, visitor);
+	running_visitors_--;
+	return finished;
+}
 
-						quadtree_->running_queries_--;
-						query_type_ = QueryType::kEndOfQuery;
-						return;
-					}
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+template <typename VisitorT>
+bool
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+ForEachIntersectingRegions(const std::vector<BoundingBox<Number>>& regions,
+		VisitorT& visitor) const {
+	assert(regions.size() < kFreeRideRegion);
+	if (root_ == nullptr || regions.empty()) {
+		return true;
+	}
+	std::vector<std::uint32_t> active_regions;
+	active_regions.reserve(regions.size() * 2);
+	for (std::size_t i = 0; i < regions.size(); i++) {
+		active_regions.push_back((std::uint32_t)i);
+	}
+	return VisitNodeForRegions(root_, bounding_box_, regions, active_regions,
+		0, regions.size(), visitor);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+void
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+QueryIntersectsRegions(const std::vector<BoundingBox<Number>>& regions,
+		std::vector<std::vector<Object*>>& out) const {
+	if (out.size() < regions.size()) {
+		out.resize(regions.size());
+	}
+	auto append = [&out](std::size_t region_index, Object* object) {
+		out[region_index].push_back(object);
+	};
+	ForEachIntersectingRegions(regions, append);
+}
+
+// Best-first search, nodes are visited in the order of the distance of their loose bounds
+// until none of the remaining ones can be closer than the k-th best object found so far
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+template <typename SquaredDistanceT>
+void
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+QueryNearest(Number x, Number y, int k, double max_distance,
+		SquaredDistanceT& squared_distance, std::vector<Object*>& out) const {
+	using NodeCandidate = detail::NearestNodeCandidate<TreeNode, Number>;
+	using ObjectCandidate = detail::NearestObjectCandidate<Object>;
+	assert(k >= 0);
+	assert(max_distance >= 0);
+	if (root_ == nullptr || k <= 0) {
+		return;
+	}
+	const std::size_t wanted = (std::size_t)k;
+	auto farther_node = [](const NodeCandidate& a, const NodeCandidate& b) {
+		return a.squared_distance > b.squared_distance;
+	};
+	auto closer_object = [](const ObjectCandidate& a, const ObjectCandidate& b) {
+		return a.squared_distance < b.squared_distance;
+	};
+	std::vector<NodeCandidate> nodes; // min heap
+	std::vector<ObjectCandidate> best; // max heap of at most k objects
+	best.reserve(std::min(wanted, (std::size_t)number_of_objects_));
+	double limit = max_distance * max_distance;
+	nodes.push_back(NodeCandidate{
+		detail::SquaredDistance((double)x, (double)y, GetLooseBounds(bounding_box_)),
+		root_, bounding_box_});
+	while (!nodes.empty()) {
+		std::pop_heap(nodes.begin(), nodes.end(), farther_node);
+		NodeCandidate current = nodes.back();
+		nodes.pop_back();
+		if (current.squared_distance > limit) {
+			break;
+		}
+		auto end = current.node->objects.end();
+		for (auto it = current.node->objects.begin(); it != end; ++it) {
+			Object* object = *it;
+			if (object == nullptr) {
+				continue;
+			}
+			double object_squared_distance = squared_distance(object);
+			if (object_squared_distance > limit) {
+				continue;
+			}
+			if (best.size() < wanted) {
+				best.push_back(ObjectCandidate{object_squared_distance, object});
+				std::push_heap(best.begin(), best.end(), closer_object);
+			}
+			else if (object_squared_distance < best.front().squared_distance) {
+				std::pop_heap(best.begin(), best.end(), closer_object);
+				best.back() = ObjectCandidate{object_squared_distance, object};
+				std::push_heap(best.begin(), best.end(), closer_object);
+			}
+			else {
+				continue;
+			}
+			if (best.size() == wanted) {
+				limit = std::min(limit, best.front().squared_distance);
+			}
+		}
+		TreeNode* children[4] = {current.node->top_left, current.node->top_right,
+			current.node->bottom_right, current.node->bottom_left};
+		const detail::ChildPosition positions[4] = {detail::ChildPosition::kTopLeft,
+			detail::ChildPosition::kTopRight, detail::ChildPosition::kBottomRight,
+			detail::ChildPosition::kBottomLeft};
+		for (int i = 0; i < 4; i++) {
+			if (children[i] == nullptr) {
+				continue;
+			}
+			BoundingBox<Number> child_bounds =
+				detail::GetChildBounds(current.node_bounds, positions[i]);
+			double child_squared_distance =
+				detail::SquaredDistance((double)x, (double)y, GetLooseBounds(child_bounds));
+			if (child_squared_distance <= limit) {
+				nodes.push_back(NodeCandidate{child_squared_distance, children[i], child_bounds});
+				std::push_heap(nodes.begin(), nodes.end(), farther_node);
+			}
+		}
+	}
+	std::sort_heap(best.begin(), best.end(), closer_object);
+	out.reserve(out.size() + best.size());
+	for (const ObjectCandidate& candidate : best) {
+		out.push_back(candidate.object);
+	}
+}
+
+// Nodes are opened front to back, an object is only reported once no node left
+// could hold an object the ray enters earlier
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+template <typename VisitorT>
+bool
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+ForEachOnRay(Number origin_x, Number origin_y, double direction_x, double direction_y,
+		double max_t, VisitorT& visitor) {
+	running_visitors_++;
+	bool finished = static_cast<const Impl&>(*this).ForEachOnRay(origin_x, origin_y,
+		direction_x, direction_y, max_t, visitor);
+	running_visitors_--;
+	return finished;
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+template <typename VisitorT>
+bool
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+ForEachOnRay(Number origin_x, Number origin_y, double direction_x, double direction_y,
+		double max_t, VisitorT& visitor) const {
+	using Candidate = detail::RayCandidate<TreeNode, Number, Object>;
+	assert(max_t >= 0);
+	const double x = (double)origin_x;
+	const double y = (double)origin_y;
+	double entry_t;
+	if (root_ == nullptr || !detail::RayEntry(x, y, direction_x, direction_y, max_t,
+			GetLooseBounds(bounding_box_), &entry_t)) {
+		return true;
+	}
+	auto later = [](const Candidate& a, const Candidate& b) {
+		return a.entry_t > b.entry_t;
+	};
+	std::vector<Candidate> candidates; // min heap
+	candidates.push_back(Candidate{entry_t, root_, nullptr, bounding_box_});
+	bool finished = true;
+	while (!candidates.empty()) {
+		std::pop_heap(candidates.begin(), candidates.end(), later);
+		Candidate current = candidates.back();
+		candidates.pop_back();
+		if (current.node == nullptr) {
+			if (!detail::CallVisitor(visitor, current.object, current.entry_t)) {
+				finished = false;
+				break;
+			}
+			continue;
+		}
+		auto end = current.node->objects.end();
+		for (auto it = current.node->objects.begin(); it != end; ++it) {
+			Object* object = *it;
+			if (object == nullptr) {
+				continue;
+			}
+			BoundingBox<Number> object_bounds(0,0,0,0);
+			BoundingBoxExtractor::ExtractBoundingBox(object, &object_bounds);
+			if (detail::RayEntry(x, y, direction_x, direction_y, max_t, object_bounds, &entry_t)) {
+				candidates.push_back(Candidate{entry_t, nullptr, object, object_bounds});
+				std::push_heap(candidates.begin(), candidates.end(), later);
+			}
+		}
+		TreeNode* children[4] = {current.node->top_left, current.node->top_right,
+			current.node->bottom_right, current.node->bottom_left};
+		const detail::ChildPosition positions[4] = {detail::ChildPosition::kTopLeft,
+			detail::ChildPosition::kTopRight, detail::ChildPosition::kBottomRight,
+			detail::ChildPosition::kBottomLeft};
+		for (int i = 0; i < 4; i++) {
+			if (children[i] == nullptr) {
+				continue;
+			}
+			BoundingBox<Number> child_bounds =
+				detail::GetChildBounds(current.node_bounds, positions[i]);
+			if (detail::RayEntry(x, y, direction_x, direction_y, max_t,
+					GetLooseBounds(child_bounds), &entry_t)) {
+				candidates.push_back(Candidate{entry_t, children[i], nullptr, child_bounds});
+				std::push_heap(candidates.begin(), candidates.end(), later);
+			}
+		}
+	}
+	return finished;
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+int
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+CountIntersectsRegion(const BoundingBox<Number>& region) const {
+	if (root_ == nullptr) {
+		return 0;
+	}
+	return CountNode(root_, bounding_box_, Query::Impl::QueryType::kIntersects, region);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+int
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+CountInsideRegion(const BoundingBox<Number>& region) const {
+	if (root_ == nullptr) {
+		return 0;
+	}
+	return CountNode(root_, bounding_box_, Query::Impl::QueryType::kInside, region);
+}
+
+// Subtrees fully in the region are counted as a whole, objects are only tested elsewhere
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+int
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+CountNode(TreeNode* node, const BoundingBox<Number>& node_bounds,
+		typename Query::Impl::QueryType query_type, const BoundingBox<Number>& region) const {
+	using QueryImpl = typename Query::Impl;
+	typename QueryImpl::FitType fit = QueryImpl::NodeFits(query_type, region, node_bounds);
+	if (fit == QueryImpl::FitType::kNoFit) {
+		return 0;
+	}
+	if (fit == QueryImpl::FitType::kFreeRide) {
+		return node->object_count;
+	}
+
+	detail::ObjectCounter counter = {0};
+	auto end = node->objects.end();
+	if (Traits::kCacheBoundingBoxes) {
+		const detail::BoundsTest test = QueryImpl::GetBoundsTest(query_type);
+		for (auto it = node->objects.begin(); it != end;) {
+			const std::size_t count = it.GetSegmentRemaining();
+			VisitSegment(it, test, region, counter);
+			it.Advance(count);
+		}
+	}
+	else {
+		for (auto it = node->objects.begin(); it != end; ++it) {
+			Object* object = *it;
+			if (object == nullptr) {
+				continue;
+			}
+			BoundingBox<Number> object_bounds(0,0,0,0);
+			BoundingBoxExtractor::ExtractBoundingBox(object, &object_bounds);
+			if (QueryImpl::ObjectFits(query_type, region, object_bounds)) {
+				counter.count++;
+			}
+		}
+	}
+
+	if (node->top_left != nullptr) {
+		counter.count += CountNode(node->top_left,
+			detail::GetChildBounds(node_bounds, detail::ChildPosition::kTopLeft),
+			query_type, region);
+	}
+	if (node->top_right != nullptr) {
+		counter.count += CountNode(node->top_right,
+			detail::GetChildBounds(node_bounds, detail::ChildPosition::kTopRight),
+			query_type, region);
+	}
+	if (node->bottom_right != nullptr) {
+		counter.count += CountNode(node->bottom_right,
+			detail::GetChildBounds(node_bounds, detail::ChildPosition::kBottomRight),
+			query_type, region);
+	}
+	if (node->bottom_left != nullptr) {
+		counter.count += CountNode(node->bottom_left,
+			detail::GetChildBounds(node_bounds, detail::ChildPosition::kBottomLeft),
+			query_type, region);
+	}
+	return counter.count;
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+template <typename VisitorT>
+bool
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+ForEachIntersectingPair(VisitorT& visitor) {
+	if (root_ == nullptr) {
+		return true;
+	}
+	std::vector<PairCandidate> candidates;
+	std::vector<PairCandidate> gathered;
+	running_visitors_++;
+	bool finished = PairWithinSubtree(root_, bounding_box_, candidates, gathered, visitor);
+	running_visitors_--;
+	return finished;
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+template <typename OtherTreeT, typename VisitorT>
+bool
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+ForEachIntersectingPair(typename OtherTreeT::Impl& other, VisitorT& visitor) {
+	assert(static_cast<void*>(&other) != static_cast<void*>(this));
+	if (root_ == nullptr || other.root_ == nullptr) {
+		return true;
+	}
+	std::vector<PairCandidate> candidates;
+	std::vector<typename OtherTreeT::Impl::PairCandidate> other_candidates;
+	running_visitors_++;
+	other.running_visitors_++;
+	bool finished = PairBetweenSubtrees<OtherTreeT>(root_, bounding_box_,
+		other.root_, other.bounding_box_, candidates, other_candidates, visitor);
+	other.running_visitors_--;
+	running_visitors_--;
+	return finished;
+}
+
+// Pairs in a subtree are either in the same node, between a node and its subtree,
+// or between the subtrees of two different children, loose bounds overlap so the last
+// ones are not just the first two seen from a common ancestor
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+template <typename VisitorT>
+bool
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+PairWithinSubtree(TreeNode* node, const BoundingBox<Number>& node_bounds,
+		std::vector<PairCandidate>& candidates, std::vector<PairCandidate>& gathered,
+		VisitorT& visitor) {
+	const std::size_t first = candidates.size();
+	detail::GatherPairCandidates<BoundingBoxExtractor>(node, candidates);
+	const std::size_t last = candidates.size();
+	bool finished = true;
+	for (std::size_t j = first + 1; j < last && finished; j++) {
+		for (std::size_t i = first; i < j; i++) {
+			if (candidates[i].object_bounds.Intersects(candidates[j].object_bounds) &&
+					!detail::CallVisitor(visitor, candidates[i].object, candidates[j].object)) {
+				finished = false;
+				break;
+			}
+		}
+	}
+
+	TreeNode* children[4] = {node->top_left, node->top_right,
+		node->bottom_right, node->bottom_left};
+	BoundingBox<Number> children_bounds[4] = {
+		detail::GetChildBounds(node_bounds, detail::ChildPosition::kTopLeft),
+		detail::GetChildBounds(node_bounds, detail::ChildPosition::kTopRight),
+		detail::GetChildBounds(node_bounds, detail::ChildPosition::kBottomRight),
+		detail::GetChildBounds(node_bounds, detail::ChildPosition::kBottomLeft)};
+	for (int i = 0; i < 4 && finished && first != last; i++) {
+		finished = children[i] == nullptr || PairWithSubtree<BoundingBoxExtractor>(children[i],
+			children_bounds[i], candidates, first, last, gathered, visitor);
+	}
+	candidates.erase(candidates.begin() + (std::ptrdiff_t)first, candidates.end());
+	for (int i = 0; i < 4 && finished; i++) {
+		finished = children[i] == nullptr ||
+			PairWithinSubtree(children[i], children_bounds[i], candidates, gathered, visitor);
+	}
+	for (int i = 0; i < 4 && finished; i++) {
+		for (int j = i + 1; j < 4 && finished; j++) {
+			finished = children[i] == nullptr || children[j] == nullptr ||
+				PairBetweenSubtrees<LooseQuadtree>(children[i], children_bounds[i],
+					children[j], children_bounds[j], candidates, gathered, visitor);
+		}
+	}
+	return finished;
+}
+
+// Every object in the first subtree with every one in the other, which can be in another tree
+// The objects of the bigger node are paired with the whole other subtree first,
+// then its children go on with it, this way both sides are pruned by loose bounds
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+template <typename OtherTreeT, typename VisitorT>
+bool
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+PairBetweenSubtrees(TreeNode* node, const BoundingBox<Number>& node_bounds,
+		typename OtherTreeT::Impl::TreeNode* other_node,
+		const BoundingBox<Number>& other_node_bounds, std::vector<PairCandidate>& candidates,
+		std::vector<typename OtherTreeT::Impl::PairCandidate>& other_candidates,
+		VisitorT& visitor) {
+	if (!GetLooseBounds(node_bounds).Intersects(GetLooseBounds(other_node_bounds))) {
+		return true;
+	}
+	const detail::ChildPosition positions[4] = {detail::ChildPosition::kTopLeft,
+		detail::ChildPosition::kTopRight, detail::ChildPosition::kBottomRight,
+		detail::ChildPosition::kBottomLeft};
+	bool finished;
+	if (node_bounds.width >= other_node_bounds.width) {
+		const std::size_t first = candidates.size();
+		detail::GatherPairCandidates<BoundingBoxExtractor>(node, candidates);
+		const std::size_t last = candidates.size();
+		finished = first == last ||
+			PairWithSubtree<typename OtherTreeT::BoundingBoxExtractor>(other_node,
+				other_node_bounds, candidates, first, last, other_candidates, visitor);
+		candidates.erase(candidates.begin() + (std::ptrdiff_t)first, candidates.end());
+		TreeNode* children[4] = {node->top_left, node->top_right,
+			node->bottom_right, node->bottom_left};
+		for (int i = 0; i < 4 && finished; i++) {
+			finished = children[i] == nullptr || PairBetweenSubtrees<OtherTreeT>(children[i],
+				detail::GetChildBounds(node_bounds, positions[i]), other_node, other_node_bounds,
+				candidates, other_candidates, visitor);
+		}
+	}
+	else {
+		const std::size_t first = other_candidates.size();
+		detail::GatherPairCandidates<typename OtherTreeT::BoundingBoxExtractor>(other_node,
+			other_candidates);
+		const std::size_t last = other_candidates.size();
+		detail::SwappedPairVisitor<VisitorT> swapped_visitor = {&visitor};
+		finished = first == last || PairWithSubtree<BoundingBoxExtractor>(node, node_bounds,
+			other_candidates, first, last, candidates, swapped_visitor);
+		other_candidates.erase(other_candidates.begin() + (std::ptrdiff_t)first,
+			other_candidates.end());
+		typename OtherTreeT::Impl::TreeNode* children[4] = {other_node->top_left,
+			other_node->top_right, other_node->bottom_right, other_node->bottom_left};
+		for (int i = 0; i < 4 && finished; i++) {
+			finished = children[i] == nullptr || PairBetweenSubtrees<OtherTreeT>(node,
+				node_bounds, children[i], detail::GetChildBounds(other_node_bounds, positions[i]),
+				candidates, other_candidates, visitor);
+		}
+	}
+	return finished;
+}
+
+// The candidates from parent_first to parent_last reaching into the loose bounds of
+// the node are carried down, and paired with the objects gathered on the way
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+template <typename BoundingBoxExtractorOfNodeT, typename TreeNodeT, typename CarriedT,
+	typename GatheredT, typename VisitorT>
+bool
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+PairWithSubtree(TreeNodeT* node, const BoundingBox<Number>& node_bounds,
+		std::vector<CarriedT>& carried, std::size_t parent_first, std::size_t parent_last,
+		std::vector<GatheredT>& gathered, VisitorT& visitor) {
+	const BoundingBox<Number> loose_bounds = GetLooseBounds(node_bounds);
+	const std::size_t first = carried.size();
+	for (std::size_t i = parent_first; i < parent_last; i++) {
+		if (carried[i].object_bounds.Intersects(loose_bounds)) {
+			CarriedT candidate = carried[i];
+			carried.push_back(candidate);
+		}
+	}
+	const std::size_t last = carried.size();
+	if (first == last) {
+		return true;
+	}
+	const std::size_t gathered_first = gathered.size();
+	detail::GatherPairCandidates<BoundingBoxExtractorOfNodeT>(node, gathered);
+	bool finished = true;
+	for (std::size_t j = gathered_first; j < gathered.size() && finished; j++) {
+		for (std::size_t i = first; i < last; i++) {
+			if (carried[i].object_bounds.Intersects(gathered[j].object_bounds) &&
+					!detail::CallVisitor(visitor, carried[i].object, gathered[j].object)) {
+				finished = false;
+				break;
+			}
+		}
+	}
+	gathered.erase(gathered.begin() + (std::ptrdiff_t)gathered_first, gathered.end());
+	finished = finished &&
+		(node->top_left == nullptr || PairWithSubtree<BoundingBoxExtractorOfNodeT>(
+			node->top_left, detail::GetChildBounds(node_bounds, detail::ChildPosition::kTopLeft),
+			carried, first, last, gathered, visitor)) &&
+		(node->top_right == nullptr || PairWithSubtree<BoundingBoxExtractorOfNodeT>(
+			node->top_right, detail::GetChildBounds(node_bounds, detail::ChildPosition::kTopRight),
+			carried, first, last, gathered, visitor)) &&
+		(node->bottom_right == nullptr || PairWithSubtree<BoundingBoxExtractorOfNodeT>(
+			node->bottom_right,
+			detail::GetChildBounds(node_bounds, detail::ChildPosition::kBottomRight),
+			carried, first, last, gathered, visitor)) &&
+		(node->bottom_left == nullptr || PairWithSubtree<BoundingBoxExtractorOfNodeT>(
+			node->bottom_left,
+			detail::GetChildBounds(node_bounds, detail::ChildPosition::kBottomLeft),
+			carried, first, last, gathered, visitor));
+	carried.erase(carried.begin() + (std::ptrdiff_t)first, carried.end());
+	return finished;
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+template <typename ShapeT, typename VisitorT>
+bool
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+ForEachIntersectingShape(const ShapeT& shape, VisitorT& visitor) {
+	running_visitors_++;
+	bool finished = static_cast<const Impl&>(*this).ForEachIntersectingShape(shape, visitor);
+	running_visitors_--;
+	return finished;
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+template <typename ShapeT, typename VisitorT>
+bool
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+ForEachIntersectingShape(const ShapeT& shape, VisitorT& visitor) const {
+	if (root_ == nullptr) {
+		return true;
+	}
+	return VisitNodeForShape(root_, bounding_box_, false, shape, visitor);
+}
+
+// Like VisitNode, but the shape is tested exactly against the loose bounds of the nodes
+// and against the bounding boxes of the objects, the cached ones are not used
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+template <typename ShapeT, typename VisitorT>
+bool
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+VisitNodeForShape(TreeNode* node, const BoundingBox<Number>& node_bounds, bool free_ride,
+		const ShapeT& shape, VisitorT& visitor) const {
+	if (!free_ride) {
+		BoundingBox<Number> loose_bounds = GetLooseBounds(node_bounds);
+		if (!shape.Intersects(loose_bounds)) {
+			return true;
+		}
+		free_ride = shape.Contains(loose_bounds);
+	}
+
+	if (free_ride) {
+		if (!detail::VisitObjects(visitor, node->objects)) {
+			return false;
+		}
+	}
+	else {
+		auto end = node->objects.end();
+		for (auto it = node->objects.begin(); it != end; ++it) {
+			Object* object = *it;
+			if (object == nullptr) {
+				continue;
+			}
+			BoundingBox<Number> object_bounds(0,0,0,0);
+			BoundingBoxExtractor::ExtractBoundingBox(object, &object_bounds);
+			if (shape.Intersects(object_bounds) && !detail::CallVisitor(visitor, object)) {
+				return false;
+			}
+		}
+	}
+
+	return
+		(node->top_left == nullptr || VisitNodeForShape(node->top_left,
+			detail::GetChildBounds(node_bounds, detail::ChildPosition::kTopLeft),
+			free_ride, shape, visitor)) &&
+		(node->top_right == nullptr || VisitNodeForShape(node->top_right,
+			detail::GetChildBounds(node_bounds, detail::ChildPosition::kTopRight),
+			free_ride, shape, visitor)) &&
+		(node->bottom_right == nullptr || VisitNodeForShape(node->bottom_right,
+			detail::GetChildBounds(node_bounds, detail::ChildPosition::kBottomRight),
+			free_ride, shape, visitor)) &&
+		(node->bottom_left == nullptr || VisitNodeForShape(node->bottom_left,
+			detail::GetChildBounds(node_bounds, detail::ChildPosition::kBottomLeft),
+			free_ride, shape, visitor));
+}
+
+// The regions still active in a node are pushed onto active_regions above the parent's,
+// each of them is tested against the node once, and against its objects if needed
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+template <typename VisitorT>
+bool
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+VisitNodeForRegions(TreeNode* node, const BoundingBox<Number>& node_bounds,
+		const std::vector<BoundingBox<Number>>& regions,
+		std::vector<std::uint32_t>& active_regions, std::size_t parent_first,
+		std::size_t parent_last, VisitorT& visitor) const {
+	using QueryImpl = typename Query::Impl;
+	const std::size_t first = active_regions.size();
+	bool any_partial = false;
+	for (std::size_t i = parent_first; i < parent_last; i++) {
+		std::uint32_t active = active_regions[i];
+		if ((active & kFreeRideRegion) == 0) {
+			typename QueryImpl::FitType fit = QueryImpl::NodeFits(
+				QueryImpl::QueryType::kIntersects, regions[active], node_bounds);
+			if (fit == QueryImpl::FitType::kNoFit) {
+				continue;
+			}
+			if (fit == QueryImpl::FitType::kFreeRide) {
+				active |= kFreeRideRegion;
+			}
+			else {
+				any_partial = true;
+			}
+		}
+		active_regions.push_back(active);
+	}
+	const std::size_t last = active_regions.size();
+	if (first == last) {
+		return true;
+	}
+
+	bool finished = true;
+	if (Traits::kCacheBoundingBoxes) {
+		for (std::size_t i = first; i < last && finished; i++) {
+			std::uint32_t active = active_regions[i];
+			detail::RegionVisitor<VisitorT> region_visitor = {&visitor, active & ~kFreeRideRegion};
+			if ((active & kFreeRideRegion) != 0) {
+				finished = detail::VisitObjects(region_visitor, node->objects);
+				continue;
+			}
+			auto end = node->objects.end();
+			for (auto it = node->objects.begin(); it != end && finished;) {
+				const std::size_t count = it.GetSegmentRemaining();
+				finished = VisitSegment(it, detail::BoundsTest::kIntersects, regions[active],
+					region_visitor);
+				it.Advance(count);
+			}
+		}
+	}
+	else {
+		// the bounding box of each object is extracted once for all the regions
+		auto end = node->objects.end();
+		for (auto it = node->objects.begin(); it != end && finished; ++it) {
+			Object* object = *it;
+			if (object == nullptr) {
+				continue;
+			}
+			BoundingBox<Number> object_bounds(0,0,0,0);
+			if (any_partial) {
+				BoundingBoxExtractor::ExtractBoundingBox(object, &object_bounds);
+			}
+			for (std::size_t i = first; i < last; i++) {
+				std::uint32_t active = active_regions[i];
+				if (((active & kFreeRideRegion) != 0 ||
+						regions[active].Intersects(object_bounds)) &&
+						!detail::CallVisitor(visitor, (std::size_t)(active & ~kFreeRideRegion),
+							object)) {
+					finished = false;
 					break;
 				}
-				assert(traversal_.GetNodeCurrentChild() == detail::ChildPosition::kNone);
-				{
-					FitType fit = FitType::kPartialFit;
-					if (traversal_.GetDepth() >= free_ride_from_level_ ||
-							(fit = CurrentNodeFits()) != FitType::kNoFit) {
-						if (fit == FitType::kFreeRide) {
-							free_ride_from_level_ = traversal_.GetDepth();
-						}
-					}
-					else {
-						traversal_.SetNodeCurrentChild(detail::ChildPosition::kBottomLeft);
-						continue;
-					}
-				}
-				object_iterator_ = traversal_.GetNode()->objects.before_begin();
-				break;
-			} while (true);
+			}
+		}
+	}
+
+	finished = finished &&
+		(node->top_left == nullptr || VisitNodeForRegions(node->top_left,
+			detail::GetChildBounds(node_bounds, detail::ChildPosition::kTopLeft),
+			regions, active_regions, first, last, visitor)) &&
+		(node->top_right == nullptr || VisitNodeForRegions(node->top_right,
+			detail::GetChildBounds(node_bounds, detail::ChildPosition::kTopRight),
+			regions, active_regions, first, last, visitor)) &&
+		(node->bottom_right == nullptr || VisitNodeForRegions(node->bottom_right,
+			detail::GetChildBounds(node_bounds, detail::ChildPosition::kBottomRight),
+			regions, active_regions, first, last, visitor)) &&
+		(node->bottom_left == nullptr || VisitNodeForRegions(node->bottom_left,
+			detail::GetChildBounds(node_bounds, detail::ChildPosition::kBottomLeft),
+			regions, active_regions, first, last, visitor));
+	active_regions.resize(first);
+	return finished;
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+const BoundingBox<NumberT>&
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+GetBoundingBox() const {
+	return bounding_box_;
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+void
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+ForceCleanup() {
+	Query query = QueryIntersectsRegion(bounding_box_);
+	while (!query.EndOfQuery()) {
+		query.Next();
+	}
+	allocator_.ReleaseFreeBlocks();
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+bool
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+Maintain(int max_node_visits, std::chrono::microseconds max_time,
+		bool release_free_blocks) {
+	assert(max_node_visits >= 0);
+	if (running_queries_ > 0 || running_visitors_ > 0) {
+		return false;
+	}
+	if (maintenance_root_regrowths_ != root_regrowths_) {
+		maintenance_path_.clear();
+		maintenance_root_regrowths_ = root_regrowths_;
+	}
+	if (root_ != nullptr) {
+		MaintenanceBudget budget = {max_node_visits, max_time != std::chrono::microseconds::max(),
+			std::chrono::steady_clock::time_point()};
+		if (budget.timed) {
+			budget.deadline = std::chrono::steady_clock::now() + max_time;
 		}
-		else if (*object_iterator_ == nullptr) {
-			// other queries also cannot stop on an empty object,
-			// so we are not invalidating any iterators/queries with this
-			traversal_.GetNode()->objects.erase_after(object_iterator_before_);
-			object_iterator_ = object_iterator_before_;
+		if (!MaintainSubtree(root_, 0, !maintenance_path_.empty(), budget)) {
+			return false;
 		}
-		else {
-			if (traversal_.GetDepth() >= free_ride_from_level_ ||
-					CurrentObjectFits()) {
-				break;
-			}
+		maintenance_path_.clear();
+		if (IsEmptyNode(root_)) {
+			assert(GetSize() == 0);
+			allocator_.Delete(root_);
+			root_ = nullptr;
+			bounding_box_ = BoundingBox<Number>(0,0,0,0);
 		}
-	} while (true);
+	}
+	if (release_free_blocks) {
+		allocator_.ReleaseFreeBlocks();
+	}
+	return true;
 }
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
-bool
-	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT>::Query::Impl::
-CurrentObjectFits() const {
-	BoundingBox<Number> object_bounds(0,0,0,0);
-	BoundingBoxExtractor::ExtractBoundingBox(GetCurrent(), &object_bounds);
-	switch (query_type_) {
-	case QueryType::kIntersects:
-		return query_region_.Intersects(object_bounds);
-	case QueryType::kInside:
-		return query_region_.Contains(object_bounds);
-	case QueryType::kContains:
-		return object_bounds.Contains(query_region_);
-	case QueryType::kEndOfQuery:
-		assert(false);
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+int
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+GetSize() const {
+	return number_of_objects_;
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+void
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+Reserve(std::size_t number_of_objects) {
+	if (Traits::kMapObjectPointers) {
+		object_pointers_.Reserve(number_of_objects);
 	}
-	return false;
+	records_.reserve(number_of_objects);
 }
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+std::size_t
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+GetCapacity() const {
+	if (Traits::kMapObjectPointers) {
+		return std::min(object_pointers_.capacity(), records_.capacity());
+	}
+	return records_.capacity();
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+void
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+Clear() {
+	DeleteTree();
+	last_snapshot_.reset();
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
 auto
-	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT>::Query::Impl::
-CurrentNodeFits() const -> FitType {
-	const BoundingBox<Number>& node_bounds = traversal_.GetNodeBoundingBox();
-	BoundingBox<Number> extended_bounds = node_bounds;
-	Number half_width =
-		(Number)((typename detail::MakeDistance<Number>::Type)node_bounds.width / 2);
-	Number half_height =
-		(Number)((typename detail::MakeDistance<Number>::Type)node_bounds.height / 2);
-	extended_bounds.width = (Number)(extended_bounds.width * 2);
-	extended_bounds.height = (Number)(extended_bounds.height * 2);
-	extended_bounds.left = (Number)(extended_bounds.left - half_width);
-	extended_bounds.top = (Number)(extended_bounds.top - half_height);
-	switch (query_type_) {
-	case QueryType::kIntersects:
-		if (!query_region_.Intersects(extended_bounds)) {
-			return FitType::kNoFit;
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+TakeSnapshot() -> std::shared_ptr<const Snapshot> {
+	if (last_snapshot_ != nullptr && (root_ == nullptr ? last_snapshot_->root_ == nullptr :
+			!root_->changed && last_snapshot_->root_ != nullptr)) {
+		return last_snapshot_;
+	}
+	std::shared_ptr<const detail::SnapshotNode<Number, Object>> root;
+	if (root_ != nullptr) {
+		if (last_snapshot_ != nullptr) {
+			root = SnapshotSubtree(root_, bounding_box_,
+				last_snapshot_->root_, last_snapshot_->bounding_box_);
 		}
-		else if (query_region_.Contains(node_bounds)) {
-			return FitType::kFreeRide;
+		else {
+			root = SnapshotSubtree(root_, bounding_box_, nullptr, bounding_box_);
 		}
-		return FitType::kPartialFit;
-	case QueryType::kInside:
-		if (!query_region_.Intersects(node_bounds)) {
-			return FitType::kNoFit;
+	}
+	last_snapshot_.reset(new Snapshot(std::move(root), bounding_box_, number_of_objects_));
+	return last_snapshot_;
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+template <typename VisitorT>
+bool
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+VisitSnapshotNode(const detail::SnapshotNode<Number, Object>* node,
+		const BoundingBox<Number>& node_bounds, bool free_ride,
+		typename Query::Impl::QueryType query_type, const BoundingBox<Number>& region,
+		VisitorT& visitor) {
+	using QueryImpl = typename Query::Impl;
+	if (!free_ride) {
+		typename QueryImpl::FitType fit = QueryImpl::NodeFits(query_type, region, node_bounds);
+		if (fit == QueryImpl::FitType::kNoFit) {
+			return true;
 		}
-		else if (query_region_.Contains(extended_bounds)) {
-			return FitType::kFreeRide;
+		free_ride = fit == QueryImpl::FitType::kFreeRide;
+	}
+	for (const auto& entry : node->objects) {
+		if ((free_ride || QueryImpl::ObjectFits(query_type, region, entry.bounds)) &&
+				!detail::CallVisitor(visitor, entry.object)) {
+			return false;
 		}
-		return FitType::kPartialFit;
-	case QueryType::kContains:
-		if (!extended_bounds.Contains(query_region_)) {
-			return FitType::kNoFit;
+	}
+	const detail::ChildPosition positions[4] = {detail::ChildPosition::kTopLeft,
+		detail::ChildPosition::kTopRight, detail::ChildPosition::kBottomRight,
+		detail::ChildPosition::kBottomLeft};
+	for (int i = 0; i < 4; i++) {
+		const detail::SnapshotNode<Number, Object>* child = node->children[i].get();
+		if (child != nullptr && !VisitSnapshotNode(child,
+				detail::GetChildBounds(node_bounds, positions[i]),
+				free_ride, query_type, region, visitor)) {
+			return false;
 		}
-		return FitType::kPartialFit;
-	case QueryType::kEndOfQuery:
-		assert(false);
 	}
-	return FitType::kNoFit;
+	return true;
 }
 
 
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
-	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT>::Impl::
-Impl() :
-	root_(nullptr), bounding_box_(0, 0, 0, 0),
-	object_pointers_(64, std::hash<Object*>(), std::equal_to<Object*>(),
-		detail::BlocksAllocatorAdaptor<std::pair<const Object*, Object**>>(allocator_)),
-	number_of_objects_(0), maximal_depth_(kInternalMinDepth),
-	running_queries_(0) {
-	assert(maximal_depth_ < kInternalMaxDepth);
-	//object_pointers_.reserve(64);
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+void
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+GetPlacement(const BoundingBox<Number>& object_bounds,
+		Number* maximal_object_extent, Number* object_center_x, Number* object_center_y) {
+	assert(object_bounds.width >= 0);
+	assert(object_bounds.height >= 0);
+	assert(object_bounds.left <= object_bounds.left + object_bounds.width);
+	assert(object_bounds.top <= object_bounds.top + object_bounds.height);
+	*maximal_object_extent = object_bounds.width >= object_bounds.height ?
+		object_bounds.width : object_bounds.height;
+	if (*maximal_object_extent < kMinimalObjectExtent) {
+		*maximal_object_extent = kMinimalObjectExtent;
+	}
+	*object_center_x = (Number)(object_bounds.left +
+		(Number)((typename detail::MakeDistance<Number>::Type)object_bounds.width / 2));
+	*object_center_y = (Number)(object_bounds.top +
+		(Number)((typename detail::MakeDistance<Number>::Type)object_bounds.height / 2));
 }
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
-	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT>::Impl::
-~Impl() {
-	DeleteTree();
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+BoundingBox<NumberT>
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+GetLooseBounds(const BoundingBox<Number>& node_bounds) {
+	return detail::GetLooseBounds(node_bounds);
 }
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
 bool
-	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT>::Impl::
-Insert(Object* object) {
-	bool was_removed = Remove(object);
-	Object** place = InsertIntoTree(object);
-	object_pointers_.emplace(object, place);
-	number_of_objects_++;
-	RecalculateMaximalDepth();
-	return !was_removed;
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+IsEmptyNode(const TreeNode* node) {
+	return node->objects.empty() &&
+		node->top_left == nullptr && node->top_right == nullptr &&
+		node->bottom_right == nullptr && node->bottom_left == nullptr;
 }
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
-bool
-	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT>::Impl::
-Update(Object* object) {
-	return !Insert(object);
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+void
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+RecalculateMaximalDepth() {
+	do {
+		if (maximal_depth_ < kInternalMaxDepth &&
+				number_of_objects_ > 1ll << (maximal_depth_ << 1)) {
+			maximal_depth_++;
+		}
+		else if (maximal_depth_ > kInternalMinDepth &&
+				number_of_objects_ <= 1ll << ((maximal_depth_ - 1) << 1)) {
+			maximal_depth_--;
+		}
+		else {
+			break;
+		}
+	} while (true);
 }
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+void
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+DeleteTree() {
+	object_pointers_.Clear();
+	// every record is released, so the handles given out so far go stale
+	free_records_.clear();
+	for (std::size_t i = records_.size(); i-- > 0;) {
+		records_[i].slot.object = nullptr;
+		records_[i].generation = records_[i].generation + 1 == 0 ? 1 : records_[i].generation + 1;
+		free_records_.push_back((std::uint32_t)i);
+	}
+	FullTreeTraversal& trav = internal_traversal_;
+	trav.StartAt(root_, bounding_box_);
+	while (root_ != nullptr) {
+		assert(trav.GetDepth() >= 0 && trav.GetDepth() <= kInternalMaxDepth);
+		TreeNode* node = trav.GetNode();
+		if (node->top_left != nullptr) {
+			trav.GoTopLeft();
+		}
+		else if (node->top_right != nullptr) {
+			trav.GoTopRight();
+		}
+		else if (node->bottom_right != nullptr) {
+			trav.GoBottomRight();
+		}
+		else if (node->bottom_left != nullptr) {
+			trav.GoBottomLeft();
+		}
+		else {
+			node->objects.Clear(allocator_);
+			if (trav.GetDepth() > 0) {
+				trav.GoUp();
+				switch (trav.GetNodeCurrentChild()) {
+				case detail::ChildPosition::kNone:
+					assert(false);
+					break;
+				case detail::ChildPosition::kTopLeft:
+					assert(node == trav.GetNode()->top_left);
+					trav.GetNode()->top_left = nullptr;
+					break;
+				case detail::ChildPosition::kTopRight:
+					assert(node == trav.GetNode()->top_right);
+					trav.GetNode()->top_right = nullptr;
+					break;
+				case detail::ChildPosition::kBottomRight:
+					assert(node == trav.GetNode()->bottom_right);
+					trav.GetNode()->bottom_right = nullptr;
+					break;
+				case detail::ChildPosition::kBottomLeft:
+					assert(node == trav.GetNode()->bottom_left);
+					trav.GetNode()->bottom_left = nullptr;
+					break;
+				}
+				allocator_.Delete(node);
+			}
+			else {
+				assert(node == root_);
+				allocator_.Delete(root_);
+				root_ = nullptr;
+			}
+		}
+	}
+
+	bounding_box_ = BoundingBox<Number>(0, 0, 0, 0);
+	number_of_objects_ = 0;
+	maximal_depth_ = kInternalMinDepth;
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+void
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+CleanupNode(TreeNode* node, int depth) {
+	typename TreeNode::ObjectContainer& objects = node->objects;
+	if (depth > maximal_depth_) {
+		auto iterator = objects.begin();
+		while (iterator != objects.end()) {
+			if (*iterator != nullptr) {
+				Relocate(*iterator.GetSlot().tag);
+				assert(*iterator == nullptr);
+			}
+			iterator++;
+		}
+		objects.Clear(allocator_);
+	}
+	else {
+		auto& records = records_;
+		objects.Compact(allocator_,
+			[&records](Object*, typename TreeNode::ObjectContainer::Slot slot) {
+				records[*slot.tag].slot = slot;
+			});
+	}
+}
+
+// Post-order like the queries, a node is cleaned after its children and deleted by its parent
+// if it became empty, on resume the path is followed as far as its nodes still exist
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
 bool
-	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT>::Impl::
-Remove(Object* object) {
-	auto it = object_pointers_.find(object);
-	if (it != object_pointers_.end()) {
-		assert(*(it->second) == it->first);
-		*(it->second) = nullptr;
-		object_pointers_.erase(it);
-		number_of_objects_--;
-		RecalculateMaximalDepth();
-		return true;
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+MaintainSubtree(TreeNode* node, int depth, bool resume, MaintenanceBudget& budget) {
+	resume = resume && (std::size_t)depth < maintenance_path_.size();
+	TreeNode** children[4] = {&node->top_left, &node->top_right,
+		&node->bottom_right, &node->bottom_left};
+	std::uint8_t first_child = resume ? maintenance_path_[(std::size_t)depth] : 0;
+	for (std::uint8_t i = first_child; i < 4; i++) {
+		TreeNode* child = *children[i];
+		if (child == nullptr) {
+			continue;
+		}
+		if (!MaintainSubtree(child, depth + 1, resume && i == first_child, budget)) {
+			maintenance_path_[(std::size_t)depth] = i;
+			return false;
+		}
+		if (IsEmptyNode(child)) {
+			assert(child->object_count == 0);
+			*children[i] = nullptr;
+			allocator_.Delete(child);
+		}
 	}
-	return false;
+	if (budget.node_visits_left <= 0 ||
+			(budget.timed && std::chrono::steady_clock::now() >= budget.deadline)) {
+		maintenance_path_.resize((std::size_t)depth + 1);
+		maintenance_path_[(std::size_t)depth] = 4;
+		return false;
+	}
+	budget.node_visits_left--;
+	CleanupNode(node, depth);
+	return true;
 }
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
 bool
-	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT>::Impl::
-Contains(Object* object) const {
-	return object_pointers_.find(object) != object_pointers_.end();
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+StaysInNode(const ObjectRecord& record, const BoundingBox<Number>& object_bounds) const {
+	int depth = record.node_level + root_regrowths_;
+	if (depth > maximal_depth_) {
+		return false;
+	}
+	Number maximal_object_extent;
+	Number object_center_x;
+	Number object_center_y;
+	GetPlacement(object_bounds, &maximal_object_extent, &object_center_x, &object_center_y);
+	const BoundingBox<Number>& node_bounds = record.node_bounds;
+	if (!node_bounds.Contains(object_center_x, object_center_y)) {
+		return false;
+	}
+	Number maximal_bb_extent =
+			node_bounds.width >= node_bounds.height ? node_bounds.width : node_bounds.height;
+	Number half_bb_extent =
+		(Number)((typename detail::MakeDistance<Number>::Type)maximal_bb_extent / 2);
+	// InsertIntoTree() would take it deeper
+	if (maximal_object_extent <= half_bb_extent && depth < maximal_depth_) {
+		return false;
+	}
+	return GetLooseBounds(node_bounds).Contains(object_bounds);
 }
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
-auto
-	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT>::Impl::
-QueryIntersectsRegion(const BoundingBox<Number>& region) -> Query {
-	typename Query::Impl* query_impl = GetAvailableQueryFromPool();
-	query_impl->Acquire(this, &region, Query::Impl::QueryType::kIntersects);
-	return Query(query_impl);
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+void
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+InsertNew(Object* object, std::uint32_t record_index) {
+	BoundingBox<Number> object_bounds(0,0,0,0);
+	BoundingBoxExtractor::ExtractBoundingBox(object, &object_bounds);
+	InsertIntoTree(object, record_index, object_bounds);
+	number_of_objects_++;
+	modifications_++;
+	RecalculateMaximalDepth();
 }
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
-auto
-	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT>::Impl::
-QueryInsideRegion(const BoundingBox<Number>& region) -> Query {
-	typename Query::Impl* query_impl = GetAvailableQueryFromPool();
-	query_impl->Acquire(this, &region, Query::Impl::QueryType::kInside);
-	return Query(query_impl);
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+void
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+Relocate(std::uint32_t record_index) {
+	ObjectRecord& record = records_[record_index];
+	Object* object = *record.slot.object;
+	assert(object != nullptr);
+	BoundingBox<Number> object_bounds(0,0,0,0);
+	BoundingBoxExtractor::ExtractBoundingBox(object, &object_bounds);
+	modifications_++;
+	if (StaysInNode(record, object_bounds)) {
+		record.slot.SetBoundingBox(object_bounds);
+		if (last_snapshot_ != nullptr) {
+			AdjustObjectCounts(record, 0);
+		}
+	}
+	else {
+		*record.slot.object = nullptr;
+		AdjustObjectCounts(record, -1);
+		InsertIntoTree(object, record_index, object_bounds);
+	}
 }
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
-auto
-	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT>::Impl::
-QueryContainsRegion(const BoundingBox<Number>& region) -> Query {
-	typename Query::Impl* query_impl = GetAvailableQueryFromPool();
-	query_impl->Acquire(this, &region, Query::Impl::QueryType::kContains);
-	return Query(query_impl);
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+template <typename ObjectIteratorT>
+void
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+ReserveForBatch(ObjectIteratorT first, ObjectIteratorT last,
+		std::vector<PendingObject>& pending, std::forward_iterator_tag) {
+	std::size_t count = (std::size_t)std::distance(first, last);
+	Reserve((std::size_t)number_of_objects_ + count);
+	pending.reserve(count);
 }
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
-const BoundingBox<NumberT>&
-	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT>::Impl::
-GetBoundingBox() const {
-	return bounding_box_;
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+void
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+Unlink(std::uint32_t record_index) {
+	*records_[record_index].slot.object = nullptr;
+	AdjustObjectCounts(records_[record_index], -1);
+	ReleaseRecord(record_index);
+	number_of_objects_--;
 }
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
+// Descends like InsertIntoTree() did, the center of the node leads the way
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
 void
-	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT>::Impl::
-ForceCleanup() {
-	Query query = QueryIntersectsRegion(bounding_box_);
-	while (!query.EndOfQuery()) {
-		query.Next();
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+AdjustObjectCounts(const ObjectRecord& record, int delta) {
+	const BoundingBox<Number>& target_bounds = record.node_bounds;
+	Number target_x = (Number)(target_bounds.left +
+		(Number)((typename detail::MakeDistance<Number>::Type)target_bounds.width / 2));
+	Number target_y = (Number)(target_bounds.top +
+		(Number)((typename detail::MakeDistance<Number>::Type)target_bounds.height / 2));
+	const int target_depth = record.node_level + root_regrowths_;
+	TreeNode* node = root_;
+	BoundingBox<Number> node_bounds = bounding_box_;
+	for (int depth = 0; ; depth++) {
+		assert(node != nullptr);
+		node->object_count += delta;
+		node->changed = true;
+		assert(node->object_count >= 0);
+		if (depth == target_depth) {
+			break;
+		}
+		Number node_center_x = (Number)(node_bounds.left +
+			(Number)((typename detail::MakeDistance<Number>::Type)node_bounds.width / 2));
+		Number node_center_y = (Number)(node_bounds.top +
+			(Number)((typename detail::MakeDistance<Number>::Type)node_bounds.height / 2));
+		detail::ChildPosition position = target_x < node_center_x ?
+			(target_y < node_center_y ?
+				detail::ChildPosition::kTopLeft : detail::ChildPosition::kBottomLeft) :
+			(target_y < node_center_y ?
+				detail::ChildPosition::kTopRight : detail::ChildPosition::kBottomRight);
+		switch (position) {
+		case detail::ChildPosition::kTopLeft:
+			node = node->top_left;
+			break;
+		case detail::ChildPosition::kTopRight:
+			node = node->top_right;
+			break;
+		case detail::ChildPosition::kBottomRight:
+			node = node->bottom_right;
+			break;
+		case detail::ChildPosition::kBottomLeft:
+			node = node->bottom_left;
+			break;
+		case detail::ChildPosition::kNone:
+			assert(false);
+		}
+		node_bounds = detail::GetChildBounds(node_bounds, position);
 	}
-	allocator_.ReleaseFreeBlocks();
+	assert(node_bounds.Contains(target_x, target_y));
 }
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
-int
-	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT>::Impl::
-GetSize() const {
-	return number_of_objects_;
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+std::uint32_t
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+AcquireRecord() {
+	std::uint32_t record_index;
+	if (!free_records_.empty()) {
+		record_index = free_records_.back();
+		free_records_.pop_back();
+	}
+	else {
+		assert(records_.size() < std::numeric_limits<std::uint32_t>::max());
+		record_index = (std::uint32_t)records_.size();
+		records_.push_back(ObjectRecord{typename TreeNode::ObjectContainer::Slot(),
+			BoundingBox<Number>(0, 0, 0, 0), 0, 1});
+	}
+	records_[record_index].slot.object = nullptr;
+	return record_index;
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+void
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+ReleaseRecord(std::uint32_t record_index) {
+	ObjectRecord& record = records_[record_index];
+	record.generation = record.generation + 1 == 0 ? 1 : record.generation + 1;
+	free_records_.push_back(record_index);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+void
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+CreateRoot(const std::vector<PendingObject>& pending) {
+	assert(root_ == nullptr);
+	assert(!pending.empty());
+
+	// the root is sized once to fit every object like InsertIntoTree() would grow it
+	Number min_x = pending[0].object_center_x;
+	Number min_y = pending[0].object_center_y;
+	Number max_x = min_x;
+	Number max_y = min_y;
+	Number maximal_object_extent = pending[0].maximal_object_extent;
+	for (const PendingObject& entry : pending) {
+		min_x = entry.object_center_x < min_x ? entry.object_center_x : min_x;
+		min_y = entry.object_center_y < min_y ? entry.object_center_y : min_y;
+		max_x = entry.object_center_x > max_x ? entry.object_center_x : max_x;
+		max_y = entry.object_center_y > max_y ? entry.object_center_y : max_y;
+		maximal_object_extent = entry.maximal_object_extent > maximal_object_extent ?
+			entry.maximal_object_extent : maximal_object_extent;
+	}
+	Number extent = (Number)(max_x - min_x) >= (Number)(max_y - min_y) ?
+		(Number)(max_x - min_x) : (Number)(max_y - min_y);
+	bounding_box_.left = min_x;
+	bounding_box_.top = min_y;
+	bounding_box_.width = extent >= maximal_object_extent ? extent : maximal_object_extent;
+	bounding_box_.height = bounding_box_.width;
+	while (!bounding_box_.Contains(max_x, max_y)) {
+		bounding_box_.width = (Number)(bounding_box_.width * 2);
+		bounding_box_.height = bounding_box_.width;
+	}
+	assert(bounding_box_.left < bounding_box_.left + bounding_box_.width);
+	assert(bounding_box_.top < bounding_box_.top + bounding_box_.height);
+	assert(!std::is_integral<Number>::value ||
+		bounding_box_.width < std::numeric_limits<Number>::max() / 8 * 7);
+	root_ = allocator_.New<TreeNode>();
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+void
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+PlaceObjects(std::vector<PendingObject>& pending) {
+	if (root_ == nullptr) {
+		CreateRoot(pending);
+	}
+	else {
+		for (const PendingObject& entry : pending) {
+			GrowRoot(entry.object_center_x, entry.object_center_y, entry.maximal_object_extent);
+		}
+	}
+	// objects are placed according to the depth limit they end up with
+	RecalculateMaximalDepth();
+	PlaceObjects(root_, bounding_box_, 0, pending.data(), pending.data() + pending.size());
 }
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
+// Partitions the objects like InsertIntoTree() would descend with them,
+// which sorts them by the Morton codes of their nodes on the way
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
 void
-	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT>::Impl::
-Clear() {
-	DeleteTree();
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+SubtractObjectCounts(TreeNode* node, const BoundingBox<Number>& node_bounds, int depth,
+		RemovedObject* first, RemovedObject* last) {
+	assert(node != nullptr);
+	node->object_count -= (int)(last - first);
+	node->changed = true;
+	assert(node->object_count >= 0);
+	RemovedObject* stay_end = std::partition(first, last, [depth](const RemovedObject& entry) {
+		return entry.node_depth == depth;
+	});
+	if (stay_end == last) {
+		return;
+	}
+	// the same way AdjustObjectCounts() goes, the center of the node leads it
+	Number node_center_x = (Number)(node_bounds.left +
+		(Number)((typename detail::MakeDistance<Number>::Type)node_bounds.width / 2));
+	Number node_center_y = (Number)(node_bounds.top +
+		(Number)((typename detail::MakeDistance<Number>::Type)node_bounds.height / 2));
+	RemovedObject* left_end = std::partition(stay_end, last,
+		[node_center_x](const RemovedObject& entry) {
+			return entry.node_center_x < node_center_x;
+		});
+	auto is_top = [node_center_y](const RemovedObject& entry) {
+		return entry.node_center_y < node_center_y;
+	};
+	RemovedObject* top_left_end = std::partition(stay_end, left_end, is_top);
+	RemovedObject* top_right_end = std::partition(left_end, last, is_top);
+	if (stay_end != top_left_end) {
+		SubtractObjectCounts(node->top_left,
+			detail::GetChildBounds(node_bounds, detail::ChildPosition::kTopLeft),
+			depth + 1, stay_end, top_left_end);
+	}
+	if (left_end != top_right_end) {
+		SubtractObjectCounts(node->top_right,
+			detail::GetChildBounds(node_bounds, detail::ChildPosition::kTopRight),
+			depth + 1, left_end, top_right_end);
+	}
+	if (top_right_end != last) {
+		SubtractObjectCounts(node->bottom_right,
+			detail::GetChildBounds(node_bounds, detail::ChildPosition::kBottomRight),
+			depth + 1, top_right_end, last);
+	}
+	if (top_left_end != left_end) {
+		SubtractObjectCounts(node->bottom_left,
+			detail::GetChildBounds(node_bounds, detail::ChildPosition::kBottomLeft),
+			depth + 1, top_left_end, left_end);
+	}
 }
 
-
-
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
 void
-	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT>::Impl::
-RecalculateMaximalDepth() {
-	do {
-		if (maximal_depth_ < kInternalMaxDepth &&
-				number_of_objects_ > 1ll << (maximal_depth_ << 1)) {
-			maximal_depth_++;
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+PlaceObjects(TreeNode* node, const BoundingBox<Number>& node_bounds, int depth,
+		PendingObject* first, PendingObject* last) {
+	Number maximal_bb_extent =
+			node_bounds.width >= node_bounds.height ? node_bounds.width : node_bounds.height;
+	Number half_bb_extent =
+		(Number)((typename detail::MakeDistance<Number>::Type)maximal_bb_extent / 2);
+	Number node_center_x = (Number)(node_bounds.left +
+		(Number)((typename detail::MakeDistance<Number>::Type)node_bounds.width / 2));
+	Number node_center_y = (Number)(node_bounds.top +
+		(Number)((typename detail::MakeDistance<Number>::Type)node_bounds.height / 2));
+	bool is_leaf = depth >= maximal_depth_;
+	node->object_count += (int)(last - first);
+	node->changed = true;
+
+	PendingObject* stay_end = std::partition(first, last,
+		[half_bb_extent, is_leaf](const PendingObject& entry) {
+			return is_leaf || entry.maximal_object_extent > half_bb_extent;
+		});
+	for (PendingObject* entry = first; entry != stay_end; entry++) {
+		assert(node_bounds.Contains(entry->object_center_x, entry->object_center_y));
+		assert(entry->maximal_object_extent <= maximal_bb_extent);
+		assert(GetLooseBounds(node_bounds).Contains(entry->object_bounds));
+		ObjectRecord& record = records_[entry->record];
+		record.slot = node->objects.Add(entry->object, entry->record, entry->object_bounds,
+			allocator_);
+		record.node_bounds = node_bounds;
+		record.node_level = depth - root_regrowths_;
+	}
+
+	PendingObject* left_end = std::partition(stay_end, last,
+		[node_center_x](const PendingObject& entry) {
+			return entry.object_center_x < node_center_x;
+		});
+	auto is_top = [node_center_y](const PendingObject& entry) {
+		return entry.object_center_y < node_center_y;
+	};
+	PendingObject* top_left_end = std::partition(stay_end, left_end, is_top);
+	PendingObject* top_right_end = std::partition(left_end, last, is_top);
+	if (stay_end != top_left_end) {
+		if (node->top_left == nullptr) {
+			node->top_left = allocator_.New<TreeNode>();
 		}
-		else if (maximal_depth_ > kInternalMinDepth &&
-				number_of_objects_ <= 1ll << ((maximal_depth_ - 1) << 1)) {
-			maximal_depth_--;
+		PlaceObjects(node->top_left,
+			detail::GetChildBounds(node_bounds, detail::ChildPosition::kTopLeft),
+			depth + 1, stay_end, top_left_end);
+	}
+	if (left_end != top_right_end) {
+		if (node->top_right == nullptr) {
+			node->top_right = allocator_.New<TreeNode>();
 		}
-		else {
-			break;
+		PlaceObjects(node->top_right,
+			detail::GetChildBounds(node_bounds, detail::ChildPosition::kTopRight),
+			depth + 1, left_end, top_right_end);
+	}
+	if (top_right_end != last) {
+		if (node->bottom_right == nullptr) {
+			node->bottom_right = allocator_.New<TreeNode>();
 		}
-	} while (true);
+		PlaceObjects(node->bottom_right,
+			detail::GetChildBounds(node_bounds, detail::ChildPosition::kBottomRight),
+			depth + 1, top_right_end, last);
+	}
+	if (top_left_end != left_end) {
+		if (node->bottom_left == nullptr) {
+			node->bottom_left = allocator_.New<TreeNode>();
+		}
+		PlaceObjects(node->bottom_left,
+			detail::GetChildBounds(node_bounds, detail::ChildPosition::kBottomLeft),
+			depth + 1, top_left_end, left_end);
+	}
 }
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
 void
-	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT>::Impl::
-DeleteTree() {
-	object_pointers_.clear();
-	detail::FullTreeTraversal<Number, Object>& trav = internal_traversal_;
-	trav.StartAt(root_, bounding_box_);
-	while (root_ != nullptr) {
-		assert(trav.GetDepth() >= 0 && trav.GetDepth() <= kInternalMaxDepth);
-		detail::TreeNode<Object>* node = trav.GetNode();
-		if (node->top_left != nullptr) {
-			trav.GoTopLeft();
-		}
-		else if (node->top_right != nullptr) {
-			trav.GoTopRight();
-		}
-		else if (node->bottom_right != nullptr) {
-			trav.GoBottomRight();
-		}
-		else if (node->bottom_left != nullptr) {
-			trav.GoBottomLeft();
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+GrowRoot(Number object_center_x, Number object_center_y, Number maximal_object_extent) {
+	assert(root_ != nullptr);
+	assert(bounding_box_.width > 0);
+	assert(bounding_box_.width == bounding_box_.height);
+
+	int depth_increase = 0;
+	while (!bounding_box_.Contains(object_center_x, object_center_y) ||
+			maximal_object_extent > bounding_box_.width) {
+		Number previous_size = bounding_box_.width;
+		bounding_box_.width = (Number)(bounding_box_.width * 2);
+		bounding_box_.height = bounding_box_.width;
+		Number previous_half =
+			(Number)((typename detail::MakeDistance<Number>::Type)previous_size / 2);
+		Number bb_center_x = (Number)(bounding_box_.left + previous_half);
+		Number bb_center_y = (Number)(bounding_box_.top + previous_half);
+		TreeNode* old_root = root_;
+		root_ = allocator_.New<TreeNode>();
+		root_->object_count = old_root->object_count;
+		if (object_center_x <= bb_center_x) {
+			bounding_box_.left = (Number)(bounding_box_.left - previous_size);
+			if (object_center_y <= bb_center_y) {
+				bounding_box_.top = (Number)(bounding_box_.top - previous_size);
+				root_->bottom_right = old_root;
+			}
+			else {
+				root_->top_right = old_root;
+			}
 		}
 		else {
-			if (trav.GetDepth() > 0) {
-				trav.GoUp();
-				switch (trav.GetNodeCurrentChild()) {
-				case detail::ChildPosition::kNone:
-					assert(false);
-					break;
-				case detail::ChildPosition::kTopLeft:
-					assert(node == trav.GetNode()->top_left);
-					trav.GetNode()->top_left = nullptr;
-					break;
-				case detail::ChildPosition::kTopRight:
-					assert(node == trav.GetNode()->top_right);
-					trav.GetNode()->top_right = nullptr;
-					break;
-				case detail::ChildPosition::kBottomRight:
-					assert(node == trav.GetNode()->bottom_right);
-					trav.GetNode()->bottom_right = nullptr;
-					break;
-				case detail::ChildPosition::kBottomLeft:
-					assert(node == trav.GetNode()->bottom_left);
-					trav.GetNode()->bottom_left = nullptr;
-					break;
-				}
-				allocator_.Delete(node);
+			if (object_center_y <= bb_center_y) {
+				bounding_box_.top = (Number)(bounding_box_.top - previous_size);
+				root_->bottom_left = old_root;
 			}
 			else {
-				assert(node == root_);
-				allocator_.Delete(root_);
-				root_ = nullptr;
+				root_->top_left = old_root;
 			}
 		}
+		depth_increase++;
+		root_regrowths_++;
+		assert(depth_increase < kInternalMaxDepth);
+		(void)depth_increase;
+		assert(bounding_box_.left < bounding_box_.left + bounding_box_.width);
+		assert(bounding_box_.top < bounding_box_.top + bounding_box_.height);
+		// If this happens with integral types you are close to get out of bounds
+		// The bounding box of things should be at least 1/8 of the total interval spanned
+		assert(!std::is_integral<Number>::value ||
+			bounding_box_.width < std::numeric_limits<Number>::max() / 8 * 7);
+		assert(!std::is_integral<Number>::value ||
+			bounding_box_.height < std::numeric_limits<Number>::max() / 8 * 7);
 	}
-
-	bounding_box_ = BoundingBox<Number>(0, 0, 0, 0);
-	number_of_objects_ = 0;
-	maximal_depth_ = kInternalMinDepth;
 }
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
-ObjectT**
-	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT>::Impl::
-InsertIntoTree(Object* object) {
-	BoundingBox<Number> object_bounds(0,0,0,0);
-	BoundingBoxExtractor::ExtractBoundingBox(object, &object_bounds);
-	assert(object_bounds.width >= 0);
-	assert(object_bounds.height >= 0);
-	assert(object_bounds.left <= object_bounds.left + object_bounds.width);
-	assert(object_bounds.top <= object_bounds.top + object_bounds.height);
-	Number maximal_object_extent = object_bounds.width >= object_bounds.height ?
-		object_bounds.width : object_bounds.height;
-	if (maximal_object_extent < kMinimalObjectExtent) {
-		maximal_object_extent = kMinimalObjectExtent;
-	}
-	Number object_center_x = (Number)(object_bounds.left +
-		(Number)((typename detail::MakeDistance<Number>::Type)object_bounds.width / 2));
-	Number object_center_y = (Number)(object_bounds.top +
-		(Number)((typename detail::MakeDistance<Number>::Type)object_bounds.height / 2));
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+void
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+InsertIntoTree(Object* object, std::uint32_t record_index,
+		const BoundingBox<Number>& object_bounds) {
+	Number maximal_object_extent;
+	Number object_center_x;
+	Number object_center_y;
+	GetPlacement(object_bounds, &maximal_object_extent, &object_center_x, &object_center_y);
 
 	if (root_ != nullptr) {
 		assert(number_of_objects_ >= 0);
 		assert(bounding_box_.width > 0);
 		assert(bounding_box_.width == bounding_box_.height);
 
-		int depth_increase = 0;
-		while (!bounding_box_.Contains(object_center_x, object_center_y) ||
-				maximal_object_extent > bounding_box_.width) {
-			Number previous_size = bounding_box_.width;
-			bounding_box_.width = (Number)(bounding_box_.width * 2);
-			bounding_box_.height = bounding_box_.width;
-			Number previous_half =
-				(Number)((typename detail::MakeDistance<Number>::Type)previous_size / 2);
-			Number bb_center_x = (Number)(bounding_box_.left + previous_half);
-			Number bb_center_y = (Number)(bounding_box_.top + previous_half);
-			detail::TreeNode<Object>* old_root = root_;
-			root_ = allocator_.New<detail::TreeNode<Object>>(allocator_);
-			if (object_center_x <= bb_center_x) {
-				bounding_box_.left = (Number)(bounding_box_.left - previous_size);
-				if (object_center_y <= bb_center_y) {
-					bounding_box_.top = (Number)(bounding_box_.top - previous_size);
-					root_->bottom_right = old_root;
-				}
-				else {
-					root_->top_right = old_root;
-				}
-			}
-			else {
-				if (object_center_y <= bb_center_y) {
-					bounding_box_.top = (Number)(bounding_box_.top - previous_size);
-					root_->bottom_left = old_root;
-				}
-				else {
-					root_->top_left = old_root;
-				}
-			}
-			depth_increase++;
-			assert(depth_increase < kInternalMaxDepth);
-			(void)depth_increase;
-			assert(bounding_box_.left < bounding_box_.left + bounding_box_.width);
-			assert(bounding_box_.top < bounding_box_.top + bounding_box_.height);
-			// If this happens with integral types you are close to get out of bounds
-			// The bounding box of things should be at least 1/8 of the total interval spanned
-			assert(!std::is_integral<Number>::value ||
-				bounding_box_.width < std::numeric_limits<Number>::max() / 8 * 7);
-			assert(!std::is_integral<Number>::value ||
-				bounding_box_.height < std::numeric_limits<Number>::max() / 8 * 7);
-		}
+		GrowRoot(object_center_x, object_center_y, maximal_object_extent);
 
-		detail::ForwardTreeTraversal<Number, Object> trav;
+		ForwardTreeTraversal trav;
 		trav.StartAt(root_, bounding_box_);
 		do {
+			trav.GetNode()->object_count++;
+			trav.GetNode()->changed = true;
 			const BoundingBox<Number>& node_bounds = trav.GetNodeBoundingBox();
 			assert(node_bounds.Contains(object_center_x, object_center_y));
 			Number maximal_bb_extent =
@@ -1280,7 +4882,7 @@ InsertIntoTree(Object* object) {
 			Number node_center_y = (Number)(node_bounds.top +
 				(Number)((typename detail::MakeDistance<Number>::Type)node_bounds.height / 2));
 
-			detail::TreeNode<Object>** direction;
+			TreeNode** direction;
 			if (object_center_x < node_center_x) {
 				if (object_center_y < node_center_y) {
 					direction = &trav.GetNode()->top_left;
@@ -1299,7 +4901,7 @@ InsertIntoTree(Object* object) {
 			}
 
 			if (*direction == nullptr) {
-				*direction = allocator_.New<detail::TreeNode<Object>>(allocator_);
+				*direction = allocator_.New<TreeNode>();
 			}
 
 			if (*direction == trav.GetNode()->top_left) {
@@ -1317,159 +4919,580 @@ InsertIntoTree(Object* object) {
 			}
 		} while (true);
 
-#ifndef NDEBUG
-		BoundingBox<Number> effective_bounds = trav.GetNodeBoundingBox();
-		Number half_width =
-			(Number)((typename detail::MakeDistance<Number>::Type)effective_bounds.width / 2);
-		Number half_height =
-			(Number)((typename detail::MakeDistance<Number>::Type)effective_bounds.height / 2);
-		effective_bounds.width = (Number)(effective_bounds.width * 2);
-		effective_bounds.height = (Number)(effective_bounds.height * 2);
-		effective_bounds.left = (Number)(effective_bounds.left - half_width);
-		effective_bounds.top = (Number)(effective_bounds.top - half_height);
-		assert(effective_bounds.Contains(object_bounds));
-#endif
+		assert(GetLooseBounds(trav.GetNodeBoundingBox()).Contains(object_bounds));
+		ObjectRecord& record = records_[record_index];
+		record.slot = trav.GetNode()->objects.Add(object, record_index, object_bounds, allocator_);
+		record.node_bounds = trav.GetNodeBoundingBox();
+		record.node_level = trav.GetDepth() - root_regrowths_;
+	}
+	else {
+		assert(number_of_objects_ == 0);
+		{
+			bounding_box_.width =
+				(Number)((typename detail::MakeDistance<Number>::Type)maximal_object_extent * 2 * 7 / 8);
+			bounding_box_.height = bounding_box_.width;
+			Number extent_half =
+				(Number)((typename detail::MakeDistance<Number>::Type)bounding_box_.width / 2);
+			bounding_box_.left = (Number)(object_center_x - extent_half);
+			bounding_box_.top = (Number)(object_center_y - extent_half);
+			assert(bounding_box_.left < bounding_box_.left + bounding_box_.width);
+			assert(bounding_box_.top < bounding_box_.top + bounding_box_.height);
+		}
+		root_ = allocator_.New<TreeNode>();
+		root_->object_count = 1;
+		ObjectRecord& record = records_[record_index];
+		record.slot = root_->objects.Add(object, record_index, object_bounds, allocator_);
+		record.node_bounds = bounding_box_;
+		record.node_level = -root_regrowths_;
+	}
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+auto
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+GetAvailableQueryFromPool() -> typename Query::Impl* {
+	typename Query::Impl* query_impl = available_queries_;
+	if (query_impl != nullptr) {
+		available_queries_ = query_impl->next_available_;
+		query_impl->next_available_ = nullptr;
+		assert(query_impl->IsAvailable());
+		return query_impl;
+	}
+	query_pool_.emplace_back(true);
+	assert(query_pool_.back().IsAvailable());
+	return &query_pool_.back();
+}
+
+// Walks only the changed paths when the previous snapshot is at the same place, its other
+// nodes get shared, after root regrowths it is looked for further down where it fits
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+auto
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Impl::
+SnapshotSubtree(TreeNode* node, const BoundingBox<Number>& node_bounds,
+		const std::shared_ptr<const detail::SnapshotNode<Number, Object>>& previous,
+		const BoundingBox<Number>& previous_bounds)
+		-> std::shared_ptr<const detail::SnapshotNode<Number, Object>> {
+	using SnapshotNode = detail::SnapshotNode<Number, Object>;
+	const bool same_place = previous != nullptr &&
+		previous_bounds.left == node_bounds.left && previous_bounds.top == node_bounds.top &&
+		previous_bounds.width == node_bounds.width && previous_bounds.height == node_bounds.height;
+	if (same_place && !node->changed) {
+		return previous;
+	}
+	node->changed = false;
+	if (node->object_count == 0) {
+		return nullptr;
+	}
+	std::shared_ptr<SnapshotNode> copy = std::make_shared<SnapshotNode>();
+	auto end = node->objects.end();
+	for (auto it = node->objects.begin(); it != end; ++it) {
+		Object* object = *it;
+		if (object == nullptr) {
+			continue;
+		}
+		typename SnapshotNode::Entry entry = {object, BoundingBox<Number>(0,0,0,0)};
+		if (Traits::kCacheBoundingBoxes) {
+			entry.bounds = it.GetBoundingBox();
+		}
+		else {
+			BoundingBoxExtractor::ExtractBoundingBox(object, &entry.bounds);
+		}
+		copy->objects.push_back(entry);
+	}
+	TreeNode* children[4] = {node->top_left, node->top_right,
+		node->bottom_right, node->bottom_left};
+	const detail::ChildPosition positions[4] = {detail::ChildPosition::kTopLeft,
+		detail::ChildPosition::kTopRight, detail::ChildPosition::kBottomRight,
+		detail::ChildPosition::kBottomLeft};
+	for (int i = 0; i < 4; i++) {
+		if (children[i] == nullptr) {
+			continue;
+		}
+		BoundingBox<Number> child_bounds = detail::GetChildBounds(node_bounds, positions[i]);
+		if (same_place) {
+			copy->children[i] = SnapshotSubtree(children[i], child_bounds,
+				previous->children[i], child_bounds);
+		}
+		else if (previous != nullptr && child_bounds.Contains(previous_bounds)) {
+			copy->children[i] = SnapshotSubtree(children[i], child_bounds,
+				previous, previous_bounds);
+		}
+		else {
+			copy->children[i] = SnapshotSubtree(children[i], child_bounds,
+				nullptr, child_bounds);
+		}
+	}
+	return copy;
+}
+
+
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+bool
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::
+Insert(Object* object) {
+	return impl_.Insert(object);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+bool
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::
+Update(Object* object) {
+	return impl_.Update(object);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+bool
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::
+Remove(Object* object) {
+	return impl_.Remove(object);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+bool
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::
+Contains(Object* object) const {
+	return impl_.Contains(object);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+auto
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::
+InsertWithHandle(Object* object) -> Handle {
+	return impl_.InsertWithHandle(object);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+void
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::
+Update(Handle handle) {
+	impl_.Update(handle);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+bool
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::
+Remove(Handle handle) {
+	return impl_.Remove(handle);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+bool
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::
+Contains(Handle handle) const {
+	return impl_.Contains(handle);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+template <typename ObjectIteratorT>
+void
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::
+BulkLoad(ObjectIteratorT first, ObjectIteratorT last) {
+	impl_.BulkLoad(first, last);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+template <typename ObjectIteratorT>
+void
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::
+UpdateMany(ObjectIteratorT first, ObjectIteratorT last) {
+	impl_.UpdateMany(first, last);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+template <typename ObjectIteratorT>
+int
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::
+RemoveMany(ObjectIteratorT first, ObjectIteratorT last) {
+	return impl_.RemoveMany(first, last);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+auto
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::
+QueryIntersectsRegion(const BoundingBox<Number>& region) -> Query {
+	return impl_.QueryIntersectsRegion(region);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+auto
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::
+QueryInsideRegion(const BoundingBox<Number>& region) -> Query {
+	return impl_.QueryInsideRegion(region);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+auto
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::
+QueryContainsRegion(const BoundingBox<Number>& region) -> Query {
+	return impl_.QueryContainsRegion(region);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+void
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::
+QueryIntersectsRegion(const BoundingBox<Number>& region, std::vector<Object*>& out) const {
+	impl_.QueryIntersectsRegion(region, out);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+void
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::
+QueryInsideRegion(const BoundingBox<Number>& region, std::vector<Object*>& out) const {
+	impl_.QueryInsideRegion(region, out);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+void
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::
+QueryContainsRegion(const BoundingBox<Number>& region, std::vector<Object*>& out) const {
+	impl_.QueryContainsRegion(region, out);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+void
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::
+QueryIntersectsRegions(const std::vector<BoundingBox<Number>>& regions,
+		std::vector<std::vector<Object*>>& out) const {
+	impl_.QueryIntersectsRegions(regions, out);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+void
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::
+QueryNearest(Number x, Number y, int k, std::vector<Object*>& out, double max_distance) const {
+	detail::BoundingBoxSquaredDistance<Number, Object, BoundingBoxExtractor> squared_distance =
+		{(double)x, (double)y};
+	impl_.QueryNearest(x, y, k, max_distance, squared_distance, out);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+template <typename DistanceT>
+void
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::
+QueryNearest(Number x, Number y, int k, std::vector<Object*>& out, double max_distance,
+		DistanceT&& distance) const {
+	detail::SquaredUserDistance<typename std::remove_reference<DistanceT>::type>
+		squared_distance = {&distance};
+	impl_.QueryNearest(x, y, k, max_distance, squared_distance, out);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+template <typename VisitorT>
+bool
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::
+ForEachIntersectingPair(VisitorT&& visitor) {
+	return impl_.ForEachIntersectingPair(visitor);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+template <typename OtherObjectT, typename OtherBoundingBoxExtractorT, typename OtherTraitsT,
+	typename VisitorT>
+bool
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::
+ForEachIntersectingPair(
+		LooseQuadtree<Number, OtherObjectT, OtherBoundingBoxExtractorT, OtherTraitsT>& other,
+		VisitorT&& visitor) {
+	using OtherTree = LooseQuadtree<Number, OtherObjectT, OtherBoundingBoxExtractorT, OtherTraitsT>;
+	return impl_.template ForEachIntersectingPair<OtherTree>(other.impl_, visitor);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+int
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::
+CountIntersectsRegion(const BoundingBox<Number>& region) const {
+	return impl_.CountIntersectsRegion(region);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+int
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::
+CountInsideRegion(const BoundingBox<Number>& region) const {
+	return impl_.CountInsideRegion(region);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+void
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::
+QueryIntersectsRegionParallel(const BoundingBox<Number>& region,
+		std::vector<Object*>& out, ThreadPool& pool) const {
+	impl_.QueryIntersectsRegionParallel(region, out, pool.GetThreadCount(), pool);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+template <typename ExecutorT>
+void
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::
+QueryIntersectsRegionParallel(const BoundingBox<Number>& region,
+		std::vector<Object*>& out, int helpers, ExecutorT&& executor) const {
+	impl_.QueryIntersectsRegionParallel(region, out, helpers, executor);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+template <typename VisitorT>
+bool
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::
+ForEachIntersectingParallel(const BoundingBox<Number>& region, ThreadPool& pool,
+		VisitorT&& visitor) const {
+	return impl_.ForEachIntersectingParallel(region, pool.GetThreadCount(), pool, visitor);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+template <typename ExecutorT, typename VisitorT>
+bool
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::
+ForEachIntersectingParallel(const BoundingBox<Number>& region, int helpers,
+		ExecutorT&& executor, VisitorT&& visitor) const {
+	return impl_.ForEachIntersectingParallel(region, helpers, executor, visitor);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+void
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::
+QueryIntersectsCircle(Number center_x, Number center_y, double radius,
+		std::vector<Object*>& out) const {
+	detail::ObjectAppender<Object> appender = {&out};
+	ForEachIntersectingCircle(center_x, center_y, radius, appender);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+void
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::
+QueryIntersectsConvexPolygon(const std::vector<std::pair<Number, Number>>& vertices,
+		std::vector<Object*>& out) const {
+	detail::ObjectAppender<Object> appender = {&out};
+	ForEachIntersectingConvexPolygon(vertices, appender);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+template <typename VisitorT>
+bool
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::
+ForEachIntersectingCircle(Number center_x, Number center_y, double radius,
+		VisitorT&& visitor) {
+	assert(radius >= 0);
+	const detail::Circle<Number> circle = {(double)center_x, (double)center_y, radius};
+	return impl_.ForEachIntersectingShape(circle, visitor);
+}
 
-		typename detail::TreeNode<Object>::ObjectContainer& objects =
-				trav.GetNode()->objects;
-		if (!objects.empty() && objects.front() == nullptr) {
-			objects.front() = object;
-		}
-		else {
-			objects.emplace_front(object);
-		}
-		return &objects.front();
-	}
-	else {
-		assert(number_of_objects_ == 0);
-		{
-			bounding_box_.width =
-				(Number)((typename detail::MakeDistance<Number>::Type)maximal_object_extent * 2 * 7 / 8);
-			bounding_box_.height = bounding_box_.width;
-			Number extent_half =
-				(Number)((typename detail::MakeDistance<Number>::Type)bounding_box_.width / 2);
-			bounding_box_.left = (Number)(object_center_x - extent_half);
-			bounding_box_.top = (Number)(object_center_y - extent_half);
-			assert(bounding_box_.left < bounding_box_.left + bounding_box_.width);
-			assert(bounding_box_.top < bounding_box_.top + bounding_box_.height);
-		}
-		root_ = allocator_.New<detail::TreeNode<Object>>(allocator_);
-		root_->objects.emplace_front(object);
-		return &root_->objects.front();
-	}
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+template <typename VisitorT>
+bool
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::
+ForEachIntersectingCircle(Number center_x, Number center_y, double radius,
+		VisitorT&& visitor) const {
+	assert(radius >= 0);
+	const detail::Circle<Number> circle = {(double)center_x, (double)center_y, radius};
+	return impl_.ForEachIntersectingShape(circle, visitor);
 }
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
-auto
-	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT>::Impl::
-GetAvailableQueryFromPool() -> typename Query::Impl* {
-	for (auto it = query_pool_.begin(); it != query_pool_.end(); it++) {
-		if (it->IsAvailable()) {
-			return &*it;
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+template <typename VisitorT>
+bool
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::
+ForEachIntersectingConvexPolygon(const std::vector<std::pair<Number, Number>>& vertices,
+		VisitorT&& visitor) {
+	const detail::ConvexPolygon<Number> polygon(vertices);
+	return impl_.ForEachIntersectingShape(polygon, visitor);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+template <typename VisitorT>
+bool
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::
+ForEachIntersectingConvexPolygon(const std::vector<std::pair<Number, Number>>& vertices,
+		VisitorT&& visitor) const {
+	const detail::ConvexPolygon<Number> polygon(vertices);
+	return impl_.ForEachIntersectingShape(polygon, visitor);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+void
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::
+QueryRay(Number origin_x, Number origin_y, double direction_x, double direction_y,
+		std::vector<Object*>& out, double max_t) const {
+	auto append = [&out](Object* object, double) {
+		out.push_back(object);
+	};
+	impl_.ForEachOnRay(origin_x, origin_y, direction_x, direction_y, max_t, append);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+ObjectT*
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::
+QueryFirstHit(Number origin_x, Number origin_y, double direction_x, double direction_y,
+		double max_t, double* entry_t) const {
+	Object* first_hit = nullptr;
+	auto stop_at_first = [&first_hit, entry_t](Object* object, double object_entry_t) {
+		first_hit = object;
+		if (entry_t != nullptr) {
+			*entry_t = object_entry_t;
 		}
-	}
-	query_pool_.emplace_back();
-	assert(query_pool_.back().IsAvailable());
-	return &query_pool_.back();
+		return false;
+	};
+	impl_.ForEachOnRay(origin_x, origin_y, direction_x, direction_y, max_t, stop_at_first);
+	return first_hit;
 }
 
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+template <typename VisitorT>
+bool
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::
+ForEachOnRay(Number origin_x, Number origin_y, double direction_x, double direction_y,
+		double max_t, VisitorT&& visitor) {
+	return impl_.ForEachOnRay(origin_x, origin_y, direction_x, direction_y, max_t, visitor);
+}
 
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+template <typename VisitorT>
+bool
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::
+ForEachOnRay(Number origin_x, Number origin_y, double direction_x, double direction_y,
+		double max_t, VisitorT&& visitor) const {
+	return impl_.ForEachOnRay(origin_x, origin_y, direction_x, direction_y, max_t, visitor);
+}
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+template <typename VisitorT>
 bool
-	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT>::
-Insert(Object* object) {
-	return impl_.Insert(object);
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::
+ForEachIntersectingRegions(const std::vector<BoundingBox<Number>>& regions,
+		VisitorT&& visitor) {
+	return impl_.ForEachIntersectingRegions(regions, visitor);
 }
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+template <typename VisitorT>
 bool
-	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT>::
-Update(Object* object) {
-	return impl_.Update(object);
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::
+ForEachIntersectingRegions(const std::vector<BoundingBox<Number>>& regions,
+		VisitorT&& visitor) const {
+	return impl_.ForEachIntersectingRegions(regions, visitor);
 }
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+template <typename VisitorT>
 bool
-	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT>::
-Remove(Object* object) {
-	return impl_.Remove(object);
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::
+ForEachIntersecting(const BoundingBox<Number>& region, VisitorT&& visitor) {
+	return impl_.ForEachIntersecting(region, visitor);
 }
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+template <typename VisitorT>
 bool
-	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT>::
-Contains(Object* object) const {
-	return impl_.Contains(object);
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::
+ForEachIntersecting(const BoundingBox<Number>& region, VisitorT&& visitor) const {
+	return impl_.ForEachIntersecting(region, visitor);
 }
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
-auto
-	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT>::
-QueryIntersectsRegion(const BoundingBox<Number>& region) -> Query {
-	return impl_.QueryIntersectsRegion(region);
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+template <typename VisitorT>
+bool
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::
+ForEachInside(const BoundingBox<Number>& region, VisitorT&& visitor) {
+	return impl_.ForEachInside(region, visitor);
 }
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
-auto
-	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT>::
-QueryInsideRegion(const BoundingBox<Number>& region) -> Query {
-	return impl_.QueryInsideRegion(region);
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+template <typename VisitorT>
+bool
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::
+ForEachInside(const BoundingBox<Number>& region, VisitorT&& visitor) const {
+	return impl_.ForEachInside(region, visitor);
 }
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+template <typename VisitorT>
+bool
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::
+ForEachContaining(const BoundingBox<Number>& region, VisitorT&& visitor) {
+	return impl_.ForEachContaining(region, visitor);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+template <typename VisitorT>
+bool
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::
+ForEachContaining(const BoundingBox<Number>& region, VisitorT&& visitor) const {
+	return impl_.ForEachContaining(region, visitor);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
 auto
-	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT>::
-QueryContainsRegion(const BoundingBox<Number>& region) -> Query {
-	return impl_.QueryContainsRegion(region);
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::
+TakeSnapshot() -> std::shared_ptr<const Snapshot> {
+	return impl_.TakeSnapshot();
 }
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
 const BoundingBox<NumberT>&
-	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT>::
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::
 GetLooseBoundingBox() const {
 	return impl_.GetBoundingBox();
 }
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
 void
-	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT>::
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::
 ForceCleanup() {
 	impl_.ForceCleanup();
 }
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+bool
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::
+Maintain(int max_node_visits, std::chrono::microseconds max_time,
+		bool release_free_blocks) {
+	return impl_.Maintain(max_node_visits, max_time, release_free_blocks);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
 int
-	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT>::
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::
 GetSize() const {
 	return impl_.GetSize();
 }
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
 bool
-	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT>::
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::
 IsEmpty() const {
 	return impl_.GetSize() == 0;
 }
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+void
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::
+Reserve(std::size_t number_of_objects) {
+	impl_.Reserve(number_of_objects);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+std::size_t
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::
+GetCapacity() const {
+	return impl_.GetCapacity();
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
 void
-	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT>::
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::
 Clear() {
 	impl_.Clear();
 }
 
 
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
-	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT>::Query::
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Query::
 Query(Impl* pimpl) : pimpl_(pimpl) {
 	assert(pimpl_ != nullptr);
 	assert(!pimpl_->IsAvailable());
 }
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
-	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT>::Query::
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Query::
 ~Query() {
 	if (pimpl_ != nullptr) {
 		pimpl_->Release();
@@ -1478,15 +5501,15 @@ template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
 	}
 }
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
-	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT>::Query::
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Query::
 Query(Query&& other) : pimpl_(other.pimpl_) {
 	other.pimpl_ = nullptr;
 }
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
 auto
-	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT>::Query::
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Query::
 operator=(Query&& other) -> Query& {
 	this->~Query();
 	pimpl_ = other.pimpl_;
@@ -1494,30 +5517,411 @@ operator=(Query&& other) -> Query& {
 	return *this;
 }
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
 bool
-	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT>::Query::
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Query::
 EndOfQuery() const {
 	return pimpl_->EndOfQuery();
 }
 
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
 ObjectT*
-	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT>::Query::
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Query::
 GetCurrent() const {
 	return pimpl_->GetCurrent();
 }
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
 void
-	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT>::Query::
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Query::
 Next() {
 	pimpl_->Next();
 }
 
 
 
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::LocalQuery::
+LocalQuery(LooseQuadtree& quadtree) : quadtree_(quadtree), impl_(false) {
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::LocalQuery::
+~LocalQuery() {
+	if (!impl_.IsAvailable()) {
+		impl_.Release();
+	}
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+void
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::LocalQuery::
+StartIntersectsRegion(const BoundingBox<Number>& region) {
+	if (!impl_.IsAvailable()) {
+		impl_.Release();
+	}
+	impl_.Acquire(&quadtree_.impl_, &region, Query::Impl::QueryType::kIntersects);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+void
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::LocalQuery::
+StartInsideRegion(const BoundingBox<Number>& region) {
+	if (!impl_.IsAvailable()) {
+		impl_.Release();
+	}
+	impl_.Acquire(&quadtree_.impl_, &region, Query::Impl::QueryType::kInside);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+void
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::LocalQuery::
+StartContainsRegion(const BoundingBox<Number>& region) {
+	if (!impl_.IsAvailable()) {
+		impl_.Release();
+	}
+	impl_.Acquire(&quadtree_.impl_, &region, Query::Impl::QueryType::kContains);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+bool
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::LocalQuery::
+EndOfQuery() const {
+	return impl_.IsAvailable() || impl_.EndOfQuery();
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+ObjectT*
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::LocalQuery::
+GetCurrent() const {
+	return impl_.GetCurrent();
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+void
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::LocalQuery::
+Next() {
+	impl_.Next();
+}
+
+
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Snapshot::
+Snapshot(std::shared_ptr<const Node> root, const BoundingBox<Number>& bounding_box, int size) :
+	root_(std::move(root)), bounding_box_(bounding_box), size_(size) {
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+void
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Snapshot::
+QueryIntersectsRegion(const BoundingBox<Number>& region, std::vector<Object*>& out) const {
+	if (root_ != nullptr) {
+		detail::ObjectAppender<Object> appender = {&out};
+		Impl::VisitSnapshotNode(root_.get(), bounding_box_, false,
+			Query::Impl::QueryType::kIntersects, region, appender);
+	}
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+void
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Snapshot::
+QueryInsideRegion(const BoundingBox<Number>& region, std::vector<Object*>& out) const {
+	if (root_ != nullptr) {
+		detail::ObjectAppender<Object> appender = {&out};
+		Impl::VisitSnapshotNode(root_.get(), bounding_box_, false,
+			Query::Impl::QueryType::kInside, region, appender);
+	}
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+void
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Snapshot::
+QueryContainsRegion(const BoundingBox<Number>& region, std::vector<Object*>& out) const {
+	if (root_ != nullptr) {
+		detail::ObjectAppender<Object> appender = {&out};
+		Impl::VisitSnapshotNode(root_.get(), bounding_box_, false,
+			Query::Impl::QueryType::kContains, region, appender);
+	}
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+template <typename VisitorT>
+bool
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Snapshot::
+ForEachIntersecting(const BoundingBox<Number>& region, VisitorT&& visitor) const {
+	return root_ == nullptr || Impl::VisitSnapshotNode(root_.get(), bounding_box_, false,
+		Query::Impl::QueryType::kIntersects, region, visitor);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+template <typename VisitorT>
+bool
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Snapshot::
+ForEachInside(const BoundingBox<Number>& region, VisitorT&& visitor) const {
+	return root_ == nullptr || Impl::VisitSnapshotNode(root_.get(), bounding_box_, false,
+		Query::Impl::QueryType::kInside, region, visitor);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+template <typename VisitorT>
+bool
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Snapshot::
+ForEachContaining(const BoundingBox<Number>& region, VisitorT&& visitor) const {
+	return root_ == nullptr || Impl::VisitSnapshotNode(root_.get(), bounding_box_, false,
+		Query::Impl::QueryType::kContains, region, visitor);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+const BoundingBox<NumberT>&
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Snapshot::
+GetLooseBoundingBox() const {
+	return bounding_box_;
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+int
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Snapshot::
+GetSize() const {
+	return size_;
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+bool
+	LooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::Snapshot::
+IsEmpty() const {
+	return size_ == 0;
+}
+
+
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+	ConcurrentLooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::
+ConcurrentLooseQuadtree(int shards) : size_(0), maintenance_shard_(0) {
+	assert(shards > 0);
+	shards_.reserve((std::size_t)shards);
+	for (int i = 0; i < shards; i++) {
+		shards_.emplace_back(new Shard());
+	}
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+bool
+	ConcurrentLooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::
+Insert(Object* object) {
+	Shard& shard = *shards_[GetShardIndex(object)];
+	std::lock_guard<std::mutex> lock(shard.mutex);
+	if (shard.quadtree.Insert(object)) {
+		size_.fetch_add(1, std::memory_order_relaxed);
+		return true;
+	}
+	return false;
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+bool
+	ConcurrentLooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::
+Update(Object* object) {
+	return !Insert(object);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+bool
+	ConcurrentLooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::
+Remove(Object* object) {
+	Shard& shard = *shards_[GetShardIndex(object)];
+	std::lock_guard<std::mutex> lock(shard.mutex);
+	if (shard.quadtree.Remove(object)) {
+		size_.fetch_sub(1, std::memory_order_relaxed);
+		return true;
+	}
+	return false;
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+bool
+	ConcurrentLooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::
+Contains(Object* object) const {
+	const Shard& shard = *shards_[GetShardIndex(object)];
+	std::lock_guard<std::mutex> lock(shard.mutex);
+	return shard.quadtree.Contains(object);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+template <typename ObjectIteratorT>
+void
+	ConcurrentLooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::
+UpdateMany(ObjectIteratorT first, ObjectIteratorT last) {
+	std::vector<std::vector<Object*>> groups(shards_.size());
+	for (; first != last; ++first) {
+		Object* object = *first;
+		groups[GetShardIndex(object)].push_back(object);
+	}
+	for (std::size_t i = 0; i < shards_.size(); i++) {
+		if (groups[i].empty()) {
+			continue;
+		}
+		Shard& shard = *shards_[i];
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		int size_before = shard.quadtree.GetSize();
+		shard.quadtree.UpdateMany(groups[i].begin(), groups[i].end());
+		size_.fetch_add(shard.quadtree.GetSize() - size_before, std::memory_order_relaxed);
+	}
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+template <typename ObjectIteratorT>
+int
+	ConcurrentLooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::
+RemoveMany(ObjectIteratorT first, ObjectIteratorT last) {
+	std::vector<std::vector<Object*>> groups(shards_.size());
+	for (; first != last; ++first) {
+		Object* object = *first;
+		groups[GetShardIndex(object)].push_back(object);
+	}
+	int removed = 0;
+	for (std::size_t i = 0; i < shards_.size(); i++) {
+		if (groups[i].empty()) {
+			continue;
+		}
+		Shard& shard = *shards_[i];
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		int removed_here = shard.quadtree.RemoveMany(groups[i].begin(), groups[i].end());
+		size_.fetch_sub(removed_here, std::memory_order_relaxed);
+		removed += removed_here;
+	}
+	return removed;
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+void
+	ConcurrentLooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::
+QueryIntersectsRegion(const BoundingBox<Number>& region, std::vector<Object*>& out) const {
+	for (auto& shard : shards_) {
+		std::lock_guard<std::mutex> lock(shard->mutex);
+		static_cast<const Quadtree&>(shard->quadtree).QueryIntersectsRegion(region, out);
+	}
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+void
+	ConcurrentLooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::
+QueryInsideRegion(const BoundingBox<Number>& region, std::vector<Object*>& out) const {
+	for (auto& shard : shards_) {
+		std::lock_guard<std::mutex> lock(shard->mutex);
+		static_cast<const Quadtree&>(shard->quadtree).QueryInsideRegion(region, out);
+	}
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+void
+	ConcurrentLooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::
+QueryContainsRegion(const BoundingBox<Number>& region, std::vector<Object*>& out) const {
+	for (auto& shard : shards_) {
+		std::lock_guard<std::mutex> lock(shard->mutex);
+		static_cast<const Quadtree&>(shard->quadtree).QueryContainsRegion(region, out);
+	}
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+template <typename VisitorT>
+bool
+	ConcurrentLooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::
+ForEachIntersecting(const BoundingBox<Number>& region, VisitorT&& visitor) const {
+	for (auto& shard : shards_) {
+		std::lock_guard<std::mutex> lock(shard->mutex);
+		if (!static_cast<const Quadtree&>(shard->quadtree).ForEachIntersecting(region, visitor)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+int
+	ConcurrentLooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::
+CountIntersectsRegion(const BoundingBox<Number>& region) const {
+	int count = 0;
+	for (auto& shard : shards_) {
+		std::lock_guard<std::mutex> lock(shard->mutex);
+		count += shard->quadtree.CountIntersectsRegion(region);
+	}
+	return count;
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+int
+	ConcurrentLooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::
+GetSize() const {
+	return size_.load(std::memory_order_relaxed);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+bool
+	ConcurrentLooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::
+IsEmpty() const {
+	return GetSize() == 0;
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+int
+	ConcurrentLooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::
+GetShardCount() const {
+	return (int)shards_.size();
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+void
+	ConcurrentLooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::
+Clear() {
+	for (auto& shard : shards_) {
+		std::lock_guard<std::mutex> lock(shard->mutex);
+		size_.fetch_sub(shard->quadtree.GetSize(), std::memory_order_relaxed);
+		shard->quadtree.Clear();
+	}
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+void
+	ConcurrentLooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::
+ForceCleanup() {
+	for (auto& shard : shards_) {
+		std::lock_guard<std::mutex> lock(shard->mutex);
+		shard->quadtree.ForceCleanup();
+	}
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+bool
+	ConcurrentLooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::
+Maintain(int max_node_visits, std::chrono::microseconds max_time) {
+	std::lock_guard<std::mutex> maintenance_lock(maintenance_mutex_);
+	Shard& shard = *shards_[maintenance_shard_];
+	{
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		if (!shard.quadtree.Maintain(max_node_visits, max_time)) {
+			return false;
+		}
+	}
+	maintenance_shard_ = (maintenance_shard_ + 1) % shards_.size();
+	return maintenance_shard_ == 0;
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename TraitsT>
+std::size_t
+	ConcurrentLooseQuadtree<NumberT, ObjectT, BoundingBoxExtractorT, TraitsT>::
+GetShardIndex(const Object* object) const {
+	// Mixed differently from PointerMap, a shard must not get keys with the same hash prefix
+	std::uint64_t hash = (std::uint64_t)(std::uintptr_t)object;
+	hash ^= hash >> 31;
+	hash *= 0xBF58476D1CE4E5B9ull;
+	hash ^= hash >> 29;
+	return (std::size_t)(hash % shards_.size());
+}
+
+
+
 } //loose_quadtree
 
 #endif //LOOSEQUADTREE_LOOSEQUADTREE_IMPL_H
@@ -16,26 +16,55 @@
  * - Uses tree structure instead of hashed (smaller memory footprint, cache friendly)
  * - Uses as much data in-place as it can (by using its own allocator)
  * - Allocates memory in big chunks
+ * - Trees can share a memory arena, its blocks can be backed by huge pages
  * - Uses axis-aligned bounding boxes for calculations
  * - Uses left-top-width-height bounds for better precision (no right-bottom)
  * - Uses left-top closed right-bottom open interval logic (for integral types)
  * - Uses X-towards-right Y-towards-bottom screen-like coordinate system
  * - It is suitable for both floating- and fixed-point logic
  * - This library is not thread-safe but multiple queries can be run at once
+ * - Const queries do not modify the tree, many threads can run them while nothing else does
+ * - ConcurrentLooseQuadtree spreads objects over locked shards, many threads can modify it at once
+ * - Snapshots are immutable copies sharing the unchanged nodes, readers never block the writer
  *
  * Generic parameters are:
  * - NumberT generic number type allows its floating- and fixed-point usage
  * - ObjectT* only pointer is stored, no object copying is done, not an inclusive container
  * - BoundingBoxExtractorT allows using your own bounding box type/source, needs
  *     BoundingBoxExtractor::ExtractBoundingBox(ObjectT* in, BoundingBox<Number>* out) implemented
+ * - TraitsT switches optional behavior on, derive from LooseQuadtreeTraits and override
  */
 
 
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+
+
 namespace loose_quadtree {
 
 
 
+namespace detail {
+class BlocksAllocator;
+template <typename NumberT, typename ObjectT>
+struct SnapshotNode;
+} //detail
+
+
+
 template <typename NumberT>
 struct BoundingBox {
 	using Number = NumberT;
@@ -54,17 +83,106 @@ struct BoundingBox {
 
 
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
+class BlockResource {
+public:
+	virtual ~BlockResource() {}
+	virtual void* AllocateBlock(std::size_t block_size) = 0;
+	///< has to return block_size bytes aligned to block_size
+	virtual void DeallocateBlock(void* block, std::size_t block_size) = 0;
+};
+
+
+
+class HugePageBlockResource : public BlockResource {
+public:
+	const static std::size_t kPageSize = 2 * 1024 * 1024;
+
+	HugePageBlockResource();
+	~HugePageBlockResource() override;
+	HugePageBlockResource(const HugePageBlockResource&) = delete;
+	HugePageBlockResource& operator=(const HugePageBlockResource&) = delete;
+
+	void* AllocateBlock(std::size_t block_size) override;
+	void DeallocateBlock(void* block, std::size_t block_size) override;
+	///< pages are only given back to the system on destruction
+
+private:
+	std::vector<void*> pages_;
+	void* first_free_block_;
+	char* unused_begin_;
+	char* unused_end_;
+};
+
+
+
+class MemoryArena {
+public:
+	MemoryArena();
+	explicit MemoryArena(BlockResource& block_resource);
+	///< block_resource has to outlive the arena
+	~MemoryArena();
+	MemoryArena(const MemoryArena&) = delete;
+	MemoryArena& operator=(const MemoryArena&) = delete;
+
+	void ReleaseFreeBlocks(); ///< gives completely free blocks back to the block resource
+
+private:
+	template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT,
+		typename TraitsT>
+	friend class LooseQuadtree;
+	detail::BlocksAllocator* allocator_;
+};
+
+
+
+// Threads kept waiting for the tasks of parallel queries, so a query does not start any
+class ThreadPool {
+public:
+	explicit ThreadPool(int threads); ///< with zero threads the tasks run on the queuing thread
+	~ThreadPool(); ///< runs the tasks still queued, then joins the threads
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	int GetThreadCount() const;
+	void operator()(std::function<void()> task); ///< queues a task, so the pool is an executor
+
+private:
+	void Work();
+
+	std::vector<std::thread> threads_;
+	std::deque<std::function<void()>> tasks_; ///< guarded by mutex_
+	std::mutex mutex_;
+	std::condition_variable task_queued_;
+	bool stopping_; ///< guarded by mutex_
+};
+
+
+
+struct LooseQuadtreeTraits {
+	static const bool kCacheBoundingBoxes = false;
+	///< store a copy of the bounding boxes captured on Insert/Update,
+	///< queries then do not need to touch the objects
+	static const bool kMapObjectPointers = true;
+	///< lets Insert/Update/Remove/Contains find objects by pointer, handles work without it
+};
+
+
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT,
+	typename TraitsT = LooseQuadtreeTraits>
 class LooseQuadtree {
 public:
 	using Number = NumberT;
 	using Object = ObjectT;
 	using BoundingBoxExtractor = BoundingBoxExtractorT;
+	using Traits = TraitsT;
 
 private:
 	class Impl;
 
 public:
+	class LocalQuery;
+	class Snapshot;
 	class Query {
 	public:
 		~Query();
@@ -79,13 +197,84 @@ public:
 		void Next();
 
 	private:
-		friend class LooseQuadtree<Number, Object, BoundingBoxExtractor>::Impl;
+		friend class LooseQuadtree<Number, Object, BoundingBoxExtractor, Traits>::Impl;
+		friend class LocalQuery;
+		friend class Snapshot;
 		class Impl;
 		Query(Impl* pimpl);
 		Impl* pimpl_;
 	};
 
+	// Same as Query but its state is stored in place (e.g. on the stack) instead of in the pool
+	class LocalQuery {
+	public:
+		explicit LocalQuery(LooseQuadtree& quadtree); ///< it is at its end until started
+		~LocalQuery();
+		LocalQuery(const LocalQuery&) = delete;
+		LocalQuery& operator=(const LocalQuery&) = delete;
+
+		void StartIntersectsRegion(const BoundingBox<Number>& region);
+		void StartInsideRegion(const BoundingBox<Number>& region);
+		void StartContainsRegion(const BoundingBox<Number>& region);
+		///< a query which is still running gets abandoned, the same object can be reused
+		bool EndOfQuery() const;
+		Object* GetCurrent() const;
+		void Next();
+
+	private:
+		LooseQuadtree& quadtree_;
+		typename Query::Impl impl_;
+	};
+
+	// Immutable copy of the tree taken by TakeSnapshot(), any thread can query it at any time
+	// The bounding boxes are the ones of the time it was taken, the objects are not copied
+	class Snapshot {
+	public:
+		Snapshot(const Snapshot&) = delete;
+		Snapshot& operator=(const Snapshot&) = delete;
+
+		void QueryIntersectsRegion(const BoundingBox<Number>& region,
+			std::vector<Object*>& out) const; ///< appends the results
+		void QueryInsideRegion(const BoundingBox<Number>& region, std::vector<Object*>& out) const;
+		void QueryContainsRegion(const BoundingBox<Number>& region,
+			std::vector<Object*>& out) const;
+		template <typename VisitorT>
+		bool ForEachIntersecting(const BoundingBox<Number>& region, VisitorT&& visitor) const;
+		///< calls visitor(Object*), it can return false to stop
+		template <typename VisitorT>
+		bool ForEachInside(const BoundingBox<Number>& region, VisitorT&& visitor) const;
+		template <typename VisitorT>
+		bool ForEachContaining(const BoundingBox<Number>& region, VisitorT&& visitor) const;
+		const BoundingBox<Number>& GetLooseBoundingBox() const;
+		int GetSize() const;
+		bool IsEmpty() const;
+
+	private:
+		friend class LooseQuadtree<Number, Object, BoundingBoxExtractor, Traits>::Impl;
+		using Node = detail::SnapshotNode<Number, Object>;
+		Snapshot(std::shared_ptr<const Node> root, const BoundingBox<Number>& bounding_box,
+			int size);
+		std::shared_ptr<const Node> root_; ///< nullptr if the tree was empty
+		BoundingBox<Number> bounding_box_;
+		int size_;
+	};
+
+	// Refers to an inserted object, goes stale when the object is removed or the tree cleared
+	class Handle {
+	public:
+		Handle() : index_(0), generation_(0) {} ///< refers to nothing
+
+	private:
+		friend class LooseQuadtree<Number, Object, BoundingBoxExtractor, Traits>::Impl;
+		Handle(std::uint32_t index, std::uint32_t generation) :
+			index_(index), generation_(generation) {}
+		std::uint32_t index_;
+		std::uint32_t generation_;
+	};
+
 	LooseQuadtree() {}
+	explicit LooseQuadtree(MemoryArena& arena) : impl_(arena.allocator_) {}
+	///< trees sharing the arena have to be used from the same thread and destroyed before it
 	~LooseQuadtree() {}
 	LooseQuadtree(const LooseQuadtree&) = delete;
 	LooseQuadtree& operator=(const LooseQuadtree&) = delete;
@@ -94,23 +283,211 @@ public:
 	bool Update(Object* object); ///< true if it was updated (else inserted)
 	bool Remove(Object* object); ///< true if it was removed
 	bool Contains(Object* object) const; ///< true if object is in tree
+	Handle InsertWithHandle(Object* object); ///< updates it if it is in the tree already
+	///< without mapped object pointers it must not be in the tree yet
+	void Update(Handle handle); ///< the handle has to refer to an object in the tree
+	bool Remove(Handle handle); ///< true if it was removed (false for stale handles)
+	bool Contains(Handle handle) const; ///< true if the handle is not stale
+	template <typename ObjectIteratorT>
+	void BulkLoad(ObjectIteratorT first, ObjectIteratorT last); ///< inserts a range of Object*
+	///< an empty tree gets its storage sized up front and its nodes built at once
+	///< a tree which has objects already gets the range added like UpdateMany() does
+	template <typename ObjectIteratorT>
+	void UpdateMany(ObjectIteratorT first, ObjectIteratorT last); ///< inserts or updates Object*s
+	///< objects which moved out of their nodes are placed together, grouped by region
+	///< ranges of forward iterators get the bookkeeping sized for them at once
+	///< batch operations need mapped object pointers
+	template <typename ObjectIteratorT>
+	int RemoveMany(ObjectIteratorT first, ObjectIteratorT last); ///< returns the number removed
+	///< the subtree counts are taken off in one descent shared by all the objects
 	Query QueryIntersectsRegion(const BoundingBox<Number>& region);
 	Query QueryInsideRegion(const BoundingBox<Number>& region);
 	Query QueryContainsRegion(const BoundingBox<Number>& region);
+	// The const queries below never modify the tree (no lazy cleanup, no bookkeeping),
+	// any number of threads can run them at once while the tree is not being modified
+	// The const ForEach... overloads are picked for const trees, their visitors must not
+	// modify the tree or advance its queries
+	void QueryIntersectsRegion(const BoundingBox<Number>& region, std::vector<Object*>& out) const;
+	///< appends the results, nodes fully inside the region are copied without tests
+	void QueryInsideRegion(const BoundingBox<Number>& region, std::vector<Object*>& out) const;
+	void QueryContainsRegion(const BoundingBox<Number>& region, std::vector<Object*>& out) const;
+	template <typename VisitorT>
+	bool ForEachIntersecting(const BoundingBox<Number>& region, VisitorT&& visitor);
+	///< calls visitor(Object*) for the same objects as the query, it can return false to stop
+	///< gives back false if the visitor stopped it, the tree can be modified from the visitor
+	template <typename VisitorT>
+	bool ForEachIntersecting(const BoundingBox<Number>& region, VisitorT&& visitor) const;
+	template <typename VisitorT>
+	bool ForEachInside(const BoundingBox<Number>& region, VisitorT&& visitor);
+	template <typename VisitorT>
+	bool ForEachInside(const BoundingBox<Number>& region, VisitorT&& visitor) const;
+	template <typename VisitorT>
+	bool ForEachContaining(const BoundingBox<Number>& region, VisitorT&& visitor);
+	template <typename VisitorT>
+	bool ForEachContaining(const BoundingBox<Number>& region, VisitorT&& visitor) const;
+	void QueryIntersectsRegions(const std::vector<BoundingBox<Number>>& regions,
+		std::vector<std::vector<Object*>>& out) const; ///< appends the results of regions[i] to out[i]
+	///< the tree is traversed once for all the regions
+	template <typename VisitorT>
+	bool ForEachIntersectingRegions(const std::vector<BoundingBox<Number>>& regions,
+		VisitorT&& visitor); ///< calls visitor(std::size_t region_index, Object*)
+	template <typename VisitorT>
+	bool ForEachIntersectingRegions(const std::vector<BoundingBox<Number>>& regions,
+		VisitorT&& visitor) const;
+	void QueryNearest(Number x, Number y, int k, std::vector<Object*>& out,
+		double max_distance = std::numeric_limits<double>::infinity()) const;
+	///< appends the k objects with the closest bounding boxes in ascending order of distance
+	template <typename DistanceT>
+	void QueryNearest(Number x, Number y, int k, std::vector<Object*>& out, double max_distance,
+		DistanceT&& distance) const;
+	///< double distance(Object*) must not be less than the distance from the bounding box
+	void QueryRay(Number origin_x, Number origin_y, double direction_x, double direction_y,
+		std::vector<Object*>& out, double max_t = std::numeric_limits<double>::infinity()) const;
+	///< appends the objects whose bounding boxes are hit in the order the ray enters them
+	Object* QueryFirstHit(Number origin_x, Number origin_y, double direction_x,
+		double direction_y, double max_t = std::numeric_limits<double>::infinity(),
+		double* entry_t = nullptr) const; ///< nullptr if nothing is hit
+	template <typename VisitorT>
+	bool ForEachOnRay(Number origin_x, Number origin_y, double direction_x, double direction_y,
+		double max_t, VisitorT&& visitor);
+	///< calls visitor(Object*, double entry_t) front to back, the tree must not be modified
+	template <typename VisitorT>
+	bool ForEachOnRay(Number origin_x, Number origin_y, double direction_x, double direction_y,
+		double max_t, VisitorT&& visitor) const;
+	void QueryIntersectsCircle(Number center_x, Number center_y, double radius,
+		std::vector<Object*>& out) const;
+	void QueryIntersectsConvexPolygon(const std::vector<std::pair<Number, Number>>& vertices,
+		std::vector<Object*>& out) const; ///< the vertices go around the polygon in either direction
+	template <typename VisitorT>
+	bool ForEachIntersectingCircle(Number center_x, Number center_y, double radius,
+		VisitorT&& visitor);
+	template <typename VisitorT>
+	bool ForEachIntersectingCircle(Number center_x, Number center_y, double radius,
+		VisitorT&& visitor) const;
+	template <typename VisitorT>
+	bool ForEachIntersectingConvexPolygon(const std::vector<std::pair<Number, Number>>& vertices,
+		VisitorT&& visitor);
+	template <typename VisitorT>
+	bool ForEachIntersectingConvexPolygon(const std::vector<std::pair<Number, Number>>& vertices,
+		VisitorT&& visitor) const;
+	int CountIntersectsRegion(const BoundingBox<Number>& region) const;
+	int CountInsideRegion(const BoundingBox<Number>& region) const;
+	///< nodes fully inside the region add the count of their whole subtree at once
+	void QueryIntersectsRegionParallel(const BoundingBox<Number>& region,
+		std::vector<Object*>& out, ThreadPool& pool) const;
+	///< appends the same objects in the same order, subtrees near the root become tasks
+	///< which the threads of the pool take one by one, the calling thread helps them
+	template <typename ExecutorT>
+	void QueryIntersectsRegionParallel(const BoundingBox<Number>& region,
+		std::vector<Object*>& out, int helpers, ExecutorT&& executor) const;
+	///< executor(std::function<void()>) runs a helper on a thread of its own, e.g. from a pool
+	///< helpers started late find nothing left to do and return at once
+	template <typename VisitorT>
+	bool ForEachIntersectingParallel(const BoundingBox<Number>& region, ThreadPool& pool,
+		VisitorT&& visitor) const;
+	///< visitor(Object*) gets called from the threads at once, false stops all of them
+	template <typename ExecutorT, typename VisitorT>
+	bool ForEachIntersectingParallel(const BoundingBox<Number>& region, int helpers,
+		ExecutorT&& executor, VisitorT&& visitor) const;
+	template <typename VisitorT>
+	bool ForEachIntersectingPair(VisitorT&& visitor);
+	///< calls visitor(Object*, Object*) once for every two objects with intersecting bounding boxes
+	///< it can return false to stop, the tree must not be modified from the visitor
+	template <typename OtherObjectT, typename OtherBoundingBoxExtractorT, typename OtherTraitsT,
+		typename VisitorT>
+	bool ForEachIntersectingPair(
+		LooseQuadtree<Number, OtherObjectT, OtherBoundingBoxExtractorT, OtherTraitsT>& other,
+		VisitorT&& visitor); ///< the same with one object from each tree, visitor(Object*, OtherObject*)
+	///< both trees are walked at once, their roots and depths do not need to match
+	std::shared_ptr<const Snapshot> TakeSnapshot();
+	///< copies the paths to the nodes changed since the previous snapshot, shares everything else
+	///< nodes are freed with the last snapshot using them, the tree keeps the latest one
 	const BoundingBox<Number>& GetLooseBoundingBox() const;
 	///< double its size to get a bounding box including everything contained for sure
 	int GetSize() const;
 	bool IsEmpty() const;
+	void Reserve(std::size_t number_of_objects); ///< avoids rehashing and regrowing bookkeeping
+	std::size_t GetCapacity() const; ///< objects the bookkeeping has room for without growing
 	void Clear();
 	void ForceCleanup(); ///< does a full data structure and memory cleanup
 	///< cleanup is semi-automatic during queries so you needn't call this normally
+	bool Maintain(int max_node_visits,
+		std::chrono::microseconds max_time = std::chrono::microseconds::max(),
+		bool release_free_blocks = false); ///< true when a full pass over the tree got finished
+	///< does the same cleanup in steps, each call goes on where the previous one stopped
+	///< nothing is done while queries or visitors are running, free blocks go after a full pass
 
 private:
+	template <typename, typename, typename, typename>
+	friend class LooseQuadtree;
+
 	Impl impl_;
 };
 
 
 
+// Objects are spread over independent shard trees by their pointers, every shard has a lock
+// of its own, so threads modifying or querying the tree at once rarely wait for each other
+// Queries visit the shards one by one, holding only the lock of the shard being visited
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT,
+	typename TraitsT = LooseQuadtreeTraits>
+class ConcurrentLooseQuadtree {
+public:
+	using Number = NumberT;
+	using Object = ObjectT;
+	using BoundingBoxExtractor = BoundingBoxExtractorT;
+	using Traits = TraitsT;
+	using Quadtree = LooseQuadtree<Number, Object, BoundingBoxExtractor, Traits>;
+
+	explicit ConcurrentLooseQuadtree(int shards = 32);
+	///< a few times the number of writing threads, every query has to visit all the shards
+	~ConcurrentLooseQuadtree() {}
+	ConcurrentLooseQuadtree(const ConcurrentLooseQuadtree&) = delete;
+	ConcurrentLooseQuadtree& operator=(const ConcurrentLooseQuadtree&) = delete;
+
+	bool Insert(Object* object); ///< true if it was inserted (else updated)
+	bool Update(Object* object); ///< true if it was updated (else inserted)
+	bool Remove(Object* object); ///< true if it was removed
+	bool Contains(Object* object) const; ///< true if object is in tree
+	template <typename ObjectIteratorT>
+	void UpdateMany(ObjectIteratorT first, ObjectIteratorT last); ///< inserts or updates Object*s
+	///< the objects are grouped by shard, every shard lock is taken once for its group
+	template <typename ObjectIteratorT>
+	int RemoveMany(ObjectIteratorT first, ObjectIteratorT last); ///< returns the number removed
+	void QueryIntersectsRegion(const BoundingBox<Number>& region, std::vector<Object*>& out) const;
+	///< appends the results shard by shard
+	void QueryInsideRegion(const BoundingBox<Number>& region, std::vector<Object*>& out) const;
+	void QueryContainsRegion(const BoundingBox<Number>& region, std::vector<Object*>& out) const;
+	template <typename VisitorT>
+	bool ForEachIntersecting(const BoundingBox<Number>& region, VisitorT&& visitor) const;
+	///< calls visitor(Object*) under the lock of a shard, it must not use this tree
+	///< it can return false to stop, gives back false if the visitor stopped it
+	int CountIntersectsRegion(const BoundingBox<Number>& region) const;
+	int GetSize() const; ///< objects whose Insert or Remove has returned are counted exactly
+	bool IsEmpty() const;
+	int GetShardCount() const;
+	void Clear();
+	void ForceCleanup(); ///< cleans up the shards one by one, the others stay usable meanwhile
+	bool Maintain(int max_node_visits,
+		std::chrono::microseconds max_time = std::chrono::microseconds::max());
+	///< steps Maintain() of the shards in turn, true when the last one finished its full pass
+
+private:
+	struct Shard {
+		mutable std::mutex mutex;
+		Quadtree quadtree;
+	};
+
+	std::size_t GetShardIndex(const Object* object) const;
+
+	std::vector<std::unique_ptr<Shard>> shards_; ///< allocated one by one to keep the locks apart
+	std::atomic<int> size_;
+	std::mutex maintenance_mutex_;
+	std::size_t maintenance_shard_; ///< the shard Maintain() goes on with
+};
+
+
+
 } //loose_quadtree
 
 #include "LooseQuadtree-impl.h"
@@ -1,9 +1,18 @@
 #include "LooseQuadtree.h"
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <cmath>
+#include <cstdint>
 #include <cstdlib>
 #include <cstdio>
+#include <functional>
+#include <limits>
+#include <memory>
 #include <random>
+#include <thread>
+#include <utility>
 #include <vector>
 
 using namespace loose_quadtree;
@@ -27,6 +36,200 @@ public:
 	}
 };
 
+// Mostly small objects with a few long ones, scattered over 10000..12000 to suit every type
+template <typename NumberT>
+std::vector<BoundingBox<NumberT>> GenerateObjects(int count, std::minstd_rand& rand) {
+	std::uniform_int_distribution<int> coordinate(10000, 12000);
+	std::uniform_int_distribution<int> extent(1, 200);
+	std::vector<BoundingBox<NumberT>> objects;
+	objects.reserve((std::size_t)count);
+	for (int i = 0; i < count; i++) {
+		objects.emplace_back((NumberT)coordinate(rand), (NumberT)coordinate(rand),
+				(NumberT)(extent(rand) * extent(rand) / 200 + 1), (NumberT)(extent(rand) / 20 + 1));
+	}
+	return objects;
+}
+
+
+
+void TestBlocksAllocator() {
+	detail::BlocksAllocator allocator;
+	std::vector<void*> small_slots;
+	std::vector<void*> big_slots;
+	for (int i = 0; i < 5000; i++) {
+		small_slots.push_back(allocator.Allocate(sizeof(void*)));
+		big_slots.push_back(allocator.Allocate(detail::BlocksAllocator::kMaxAllowedAlloc));
+	}
+	for (std::size_t i = 0; i < small_slots.size(); i++) {
+		ASSERT((reinterpret_cast<std::uintptr_t>(small_slots[i]) % sizeof(void*)) == 0);
+		ASSERT((reinterpret_cast<std::uintptr_t>(big_slots[i]) %
+					detail::BlocksAllocator::kBlockAlign) == 0);
+		for (std::size_t j = 0; j < sizeof(void*); j++) {
+			reinterpret_cast<char*>(small_slots[i])[j] = (char)i;
+		}
+	}
+	for (std::size_t i = 0; i < small_slots.size(); i += 2) {
+		allocator.Deallocate(small_slots[i], sizeof(void*));
+		allocator.Deallocate(big_slots[i], detail::BlocksAllocator::kMaxAllowedAlloc);
+	}
+	allocator.ReleaseFreeBlocks();
+	for (std::size_t i = 1; i < small_slots.size(); i += 2) {
+		ASSERT(reinterpret_cast<char*>(small_slots[i])[0] == (char)i);
+		allocator.Deallocate(small_slots[i], sizeof(void*));
+		allocator.Deallocate(big_slots[i], detail::BlocksAllocator::kMaxAllowedAlloc);
+	}
+	allocator.ReleaseFreeBlocks();
+	void* slot = allocator.Allocate(1);
+	allocator.Deallocate(slot, 1);
+}
+
+void TestChunkedObjectList() {
+	detail::BlocksAllocator allocator;
+	detail::ChunkedObjectList<int, int> list;
+	using Slot = detail::ChunkedObjectList<int, int>::Slot;
+	std::vector<int> values(100);
+	std::vector<int**> slots;
+	ASSERT(list.empty());
+	ASSERT(list.begin() == list.end());
+	for (std::size_t i = 0; i < values.size(); i++) {
+		values[i] = (int)i;
+		slots.push_back(list.Add(&values[i], (std::uint32_t)i, BoundingBox<int>(0, 0, 0, 0),
+				allocator).object);
+	}
+	ASSERT(list.size() == values.size());
+	int count = 0;
+	for (auto it = list.begin(); it != list.end(); it++) {
+		ASSERT(*it == &values[(std::size_t)count]);
+		ASSERT(&*it == slots[(std::size_t)count]);
+		count++;
+	}
+	ASSERT(count == 100);
+	for (std::size_t i = 0; i < values.size(); i += 3) {
+		*slots[i] = nullptr;
+	}
+	*slots[98] = nullptr;
+	*slots[99] = nullptr;
+	ASSERT(list.Add(&values[99], 99, BoundingBox<int>(0, 0, 0, 0), allocator).object == slots[99]);
+	*slots[99] = nullptr;
+	list.Compact(allocator, [&slots](int* value, Slot slot) {
+		ASSERT(*slot.object == value);
+		ASSERT(*slot.tag == (std::uint32_t)*value);
+		slots[(std::size_t)*value] = slot.object;
+	});
+	ASSERT(list.size() == 65);
+	count = 0;
+	for (auto it = list.begin(); it != list.end(); it++) {
+		ASSERT(*it != nullptr);
+		ASSERT(**it % 3 != 0 && **it < 98);
+		ASSERT(slots[(std::size_t)**it] == &*it);
+		count++;
+	}
+	ASSERT(count == 65);
+	for (auto it = list.begin(); it != list.end(); it++) {
+		*it = nullptr;
+	}
+	list.Compact(allocator, [](int*, Slot) {ASSERT(false);});
+	ASSERT(list.empty());
+	list.Add(&values[0], 0, BoundingBox<int>(0, 0, 0, 0), allocator);
+	list.Clear(allocator);
+	ASSERT(list.empty());
+}
+
+void TestPointerMap() {
+	detail::PointerMap<int> map;
+	std::vector<int> values(5000);
+	std::vector<std::uint32_t> expected(values.size(), 0); ///< 0 if not in the map
+	ASSERT(map.Find(&values[0]) == nullptr);
+	std::uint32_t value;
+	ASSERT(!map.Extract(&values[0], &value));
+	std::minstd_rand rand;
+	std::uniform_int_distribution<std::size_t> index(0, values.size() - 1);
+	std::size_t size = 0;
+	for (int round = 0; round < 100000; round++) {
+		std::size_t id = index(rand);
+		if (round % 3 == 0) {
+			bool found = map.Extract(&values[id], &value);
+			ASSERT(found == (expected[id] != 0));
+			ASSERT(!found || value == expected[id]);
+			size -= found ? 1 : 0;
+			expected[id] = 0;
+		}
+		else {
+			auto result = map.Emplace(&values[id], (std::uint32_t)round);
+			ASSERT(result.second == (expected[id] == 0));
+			if (result.second) {
+				expected[id] = (std::uint32_t)round;
+				size++;
+			}
+			ASSERT(*result.first == expected[id]);
+		}
+		ASSERT(map.size() == size);
+		if (round == 50000) {
+			map.Reserve(20000);
+		}
+	}
+	for (std::size_t i = 0; i < values.size(); i++) {
+		const std::uint32_t* found = map.Find(&values[i]);
+		ASSERT((found != nullptr) == (expected[i] != 0));
+		ASSERT(found == nullptr || *found == expected[i]);
+	}
+	map.Clear();
+	ASSERT(map.size() == 0);
+	ASSERT(map.Find(&values[index(rand)]) == nullptr);
+}
+
+template <typename NumberT>
+void TestBoundsKernel(std::uint64_t (*test_bounds)(detail::BoundsTest, const NumberT*,
+		std::size_t, std::size_t, const BoundingBox<NumberT>&)) {
+	const std::size_t stride = 21;
+	std::minstd_rand rand;
+	std::uniform_int_distribution<int> coordinate(0, 15);
+	std::uniform_int_distribution<int> distance(0, 8);
+	std::vector<NumberT> bounds(stride * 4);
+	const detail::BoundsTest tests[] = {detail::BoundsTest::kIntersects,
+		detail::BoundsTest::kInside, detail::BoundsTest::kContains};
+	for (int round = 0; round < 100; round++) {
+		for (std::size_t i = 0; i < stride; i++) {
+			bounds[i] = (NumberT)coordinate(rand);
+			bounds[stride + i] = (NumberT)coordinate(rand);
+			bounds[stride * 2 + i] = (NumberT)distance(rand);
+			bounds[stride * 3 + i] = (NumberT)distance(rand);
+		}
+		BoundingBox<NumberT> region((NumberT)coordinate(rand), (NumberT)coordinate(rand),
+				(NumberT)distance(rand), (NumberT)distance(rand));
+		for (detail::BoundsTest test : tests) {
+			for (std::size_t first = 0; first < 3; first++) {
+				for (std::size_t count = 0; count + first <= stride; count++) {
+					std::uint64_t expected = 0;
+					for (std::size_t i = 0; i < count; i++) {
+						BoundingBox<NumberT> bbox(bounds[first + i], bounds[stride + first + i],
+								bounds[stride * 2 + first + i], bounds[stride * 3 + first + i]);
+						bool passed = test == detail::BoundsTest::kIntersects ?
+							region.Intersects(bbox) :
+							test == detail::BoundsTest::kInside ?
+							region.Contains(bbox) : bbox.Contains(region);
+						expected |= (std::uint64_t)passed << i;
+					}
+					ASSERT(test_bounds(test, &bounds[first], stride, count, region) == expected);
+				}
+			}
+		}
+	}
+}
+
+void TestVectorizedBoundsKernels() {
+#ifdef LQT_USE_SIMD
+	TestBoundsKernel<float>(&detail::TestBoundsSse2<detail::Sse2FloatOps>);
+	TestBoundsKernel<double>(&detail::TestBoundsSse2<detail::Sse2DoubleOps>);
+	TestBoundsKernel<int>(&detail::TestBoundsSse2<detail::Sse2IntOps>);
+	if (detail::CpuSupportsAvx2()) {
+		TestBoundsKernel<float>(&detail::TestBoundsAvx2<detail::Avx2FloatOps>);
+		TestBoundsKernel<double>(&detail::TestBoundsAvx2<detail::Avx2DoubleOps>);
+		TestBoundsKernel<int>(&detail::TestBoundsAvx2<detail::Avx2IntOps>);
+	}
+#endif
+}
+
 
 
 template <typename NumberT>
@@ -77,13 +280,12 @@ void TestBoundingBox() {
 
 template <typename NumberT>
 void TestForwardTreeTraversal() {
-	detail::BlocksAllocator allocator;
 	detail::ForwardTreeTraversal<NumberT, BoundingBox<NumberT>> fortt;
-	detail::TreeNode<BoundingBox<NumberT>> root(allocator);
-	detail::TreeNode<BoundingBox<NumberT>> tl(allocator);
-	detail::TreeNode<BoundingBox<NumberT>> tr(allocator);
-	detail::TreeNode<BoundingBox<NumberT>> br(allocator);
-	detail::TreeNode<BoundingBox<NumberT>> bl(allocator);
+	detail::TreeNode<NumberT, BoundingBox<NumberT>> root;
+	detail::TreeNode<NumberT, BoundingBox<NumberT>> tl;
+	detail::TreeNode<NumberT, BoundingBox<NumberT>> tr;
+	detail::TreeNode<NumberT, BoundingBox<NumberT>> br;
+	detail::TreeNode<NumberT, BoundingBox<NumberT>> bl;
 	root.top_left = &tl;
 	tl.top_right = &tr;
 	tr.bottom_right = &br;
@@ -134,13 +336,12 @@ void TestForwardTreeTraversal() {
 
 template <typename NumberT>
 void TestFullTreeTraversal() {
-	detail::BlocksAllocator allocator;
 	detail::FullTreeTraversal<NumberT, BoundingBox<NumberT>> fultt;
-	detail::TreeNode<BoundingBox<NumberT>> root(allocator);
-	detail::TreeNode<BoundingBox<NumberT>> tl(allocator);
-	detail::TreeNode<BoundingBox<NumberT>> tr(allocator);
-	detail::TreeNode<BoundingBox<NumberT>> br(allocator);
-	detail::TreeNode<BoundingBox<NumberT>> bl(allocator);
+	detail::TreeNode<NumberT, BoundingBox<NumberT>> root;
+	detail::TreeNode<NumberT, BoundingBox<NumberT>> tl;
+	detail::TreeNode<NumberT, BoundingBox<NumberT>> tr;
+	detail::TreeNode<NumberT, BoundingBox<NumberT>> br;
+	detail::TreeNode<NumberT, BoundingBox<NumberT>> bl;
 	root.top_left = &tl;
 	tl.top_right = &tr;
 	tr.bottom_right = &br;
@@ -185,12 +386,11 @@ void TestFullTreeTraversal() {
 
 template <typename NumberT>
 void TestBoundingBoxDiscrepancy() {
-	detail::BlocksAllocator allocator;
 	detail::FullTreeTraversal<NumberT, BoundingBox<NumberT>> ftt;
-	detail::TreeNode<BoundingBox<NumberT>> root(allocator);
-	detail::TreeNode<BoundingBox<NumberT>> tl(allocator);
-	detail::TreeNode<BoundingBox<NumberT>> tr(allocator);
-	detail::TreeNode<BoundingBox<NumberT>> br(allocator);
+	detail::TreeNode<NumberT, BoundingBox<NumberT>> root;
+	detail::TreeNode<NumberT, BoundingBox<NumberT>> tl;
+	detail::TreeNode<NumberT, BoundingBox<NumberT>> tr;
+	detail::TreeNode<NumberT, BoundingBox<NumberT>> br;
 	root.top_left = &tl;
 	root.top_right = &tr;
 	root.bottom_right = &br;
@@ -437,6 +637,58 @@ void TestMoreTrees(bool reclaim_losses) {
 	if (reclaim_losses) lqt.ForceCleanup();
 }
 
+template <typename NumberT>
+void TestMemoryArena(MemoryArena& arena) {
+	std::vector<BoundingBox<NumberT>> objects;
+	for (int i = 0; i < 100; i++) {
+		objects.emplace_back((NumberT)(1000 + i * 10), (NumberT)(1000 + i * 5), 8, 4);
+	}
+	{
+		LooseQuadtree<NumberT, BoundingBox<NumberT>, TrivialBBExtractor<NumberT>> lqt(arena);
+		LooseQuadtree<NumberT, BoundingBox<NumberT>, TrivialBBExtractor<NumberT>> lqt2(arena);
+		for (std::size_t i = 0; i < objects.size(); i++) {
+			if (i % 2 == 0) lqt.Insert(&objects[i]);
+			else lqt2.Insert(&objects[i]);
+		}
+		ASSERT(lqt.GetSize() == 50);
+		ASSERT(lqt2.GetSize() == 50);
+		int count = 0;
+		auto query = lqt2.QueryIntersectsRegion(BoundingBox<NumberT>(1000, 1000, 1000, 1000));
+		while (!query.EndOfQuery()) {
+			ASSERT(!lqt.Contains(query.GetCurrent()));
+			count++;
+			query.Next();
+		}
+		ASSERT(count == 50);
+		for (std::size_t i = 0; i < objects.size(); i += 2) {
+			lqt.Remove(&objects[i]);
+		}
+		lqt.ForceCleanup();
+		ASSERT(lqt.IsEmpty());
+		ASSERT(lqt2.GetSize() == 50);
+		lqt2.ForceCleanup();
+		ASSERT(lqt2.Contains(&objects[1]));
+	}
+	arena.ReleaseFreeBlocks();
+}
+
+template <typename NumberT>
+void TestMemoryArenas() {
+	// trees sharing an arena do not carry an allocator of their own
+	ASSERT(sizeof(LooseQuadtree<NumberT, BoundingBox<NumberT>, TrivialBBExtractor<NumberT>>) <
+		sizeof(detail::BlocksAllocator));
+	{
+		MemoryArena arena;
+		TestMemoryArena<NumberT>(arena);
+	}
+	{
+		HugePageBlockResource huge_pages;
+		MemoryArena arena(huge_pages);
+		TestMemoryArena<NumberT>(arena);
+		TestMemoryArena<NumberT>(arena);
+	}
+}
+
 template <typename NumberT>
 void TestContainer() {
 	TestInsertRemove<NumberT>(false);
@@ -445,6 +697,7 @@ void TestContainer() {
 	TestUpdate<NumberT>(true);
 	TestMoreTrees<NumberT>(false);
 	TestMoreTrees<NumberT>(true);
+	TestMemoryArenas<NumberT>();
 }
 
 
@@ -587,9 +840,1675 @@ void TestQueries() {
 	TestQueryContains<NumberT>(objects, lqt);
 }
 
+template <typename NumberT>
+void TestLooseBoundsBelowZero() {
+	// the wide object grows the root so far that its loose bounds would reach below 0,
+	// unsigned types used to wrap around there and the query missed everything
+	BoundingBox<NumberT> wide(11775, 11875, 2780, 28);
+	BoundingBox<NumberT> small(10617, 11290, 214, 111);
+	LooseQuadtree<NumberT, BoundingBox<NumberT>, TrivialBBExtractor<NumberT>> lqt;
+	lqt.Insert(&wide);
+	lqt.Insert(&small);
+	std::vector<BoundingBox<NumberT>*> out;
+	lqt.QueryIntersectsRegion(BoundingBox<NumberT>(11961, 11780, 100, 100), out);
+	ASSERT(out.size() == 1 && out[0] == &wide);
+}
+
+struct CachedBoundingBoxesTraits : LooseQuadtreeTraits {
+	static const bool kCacheBoundingBoxes = true;
+};
+
+template <typename NumberT>
+void TestCachedBoundingBoxes() {
+	std::vector<BoundingBox<NumberT>> objects;
+	for (int i = 0; i < 100; i++) {
+		objects.emplace_back((NumberT)(i * 10 + 1000), (NumberT)(i * 10 + 1000), 5, 5);
+	}
+	LooseQuadtree<NumberT, BoundingBox<NumberT>, TrivialBBExtractor<NumberT>,
+		CachedBoundingBoxesTraits> lqt;
+	for (auto& obj : objects) {
+		lqt.Insert(&obj);
+	}
+	// queries see the boxes captured by Insert until Update is called
+	BoundingBox<NumberT> moved_to(1900, 1100, 5, 5);
+	BoundingBox<NumberT> old_place = objects[10];
+	objects[10] = moved_to;
+	int count = 0;
+	auto query = lqt.QueryIntersectsRegion(old_place);
+	while (!query.EndOfQuery()) {
+		ASSERT(query.GetCurrent() == &objects[10]);
+		count++;
+		query.Next();
+	}
+	ASSERT(count == 1);
+	lqt.Update(&objects[10]);
+	query = lqt.QueryIntersectsRegion(old_place);
+	ASSERT(query.EndOfQuery());
+	query = lqt.QueryInsideRegion(BoundingBox<NumberT>(1899, 1099, 7, 7));
+	ASSERT(!query.EndOfQuery());
+	ASSERT(query.GetCurrent() == &objects[10]);
+	query.Next();
+	ASSERT(query.EndOfQuery());
+	// compaction has to keep boxes next to their objects
+	for (int i = 0; i < 100; i += 2) {
+		lqt.Remove(&objects[i]);
+	}
+	lqt.ForceCleanup();
+	for (int i = 1; i < 100; i += 2) {
+		count = 0;
+		query = lqt.QueryContainsRegion(BoundingBox<NumberT>(
+				(NumberT)(i * 10 + 1001), (NumberT)(i * 10 + 1001), 3, 3));
+		while (!query.EndOfQuery()) {
+			ASSERT(query.GetCurrent() == &objects[i]);
+			count++;
+			query.Next();
+		}
+		ASSERT(count == 1);
+	}
+	lqt.Clear();
+}
+
+template <typename NumberT, typename TraitsT>
+void TestSmallMoves() {
+	std::minstd_rand rand;
+	std::uniform_int_distribution<int> coordinate(10000, 12000);
+	std::uniform_int_distribution<int> extent(1, 40);
+	std::uniform_int_distribution<int> jitter(-3, 3);
+	std::uniform_int_distribution<std::size_t> index(0, 499);
+	std::vector<BoundingBox<NumberT>> objects;
+	for (int i = 0; i < 500; i++) {
+		objects.emplace_back((NumberT)coordinate(rand), (NumberT)coordinate(rand),
+				(NumberT)extent(rand), (NumberT)extent(rand));
+	}
+	LooseQuadtree<NumberT, BoundingBox<NumberT>, TrivialBBExtractor<NumberT>, TraitsT> lqt;
+	for (auto& obj : objects) {
+		lqt.Insert(&obj);
+	}
+	std::vector<bool> flags(objects.size());
+	for (int round = 0; round < 20; round++) {
+		for (auto& obj : objects) {
+			obj.left = (NumberT)(obj.left + (NumberT)jitter(rand));
+			obj.top = (NumberT)(obj.top + (NumberT)jitter(rand));
+			obj.width = (NumberT)(obj.width + (NumberT)(4 + jitter(rand)));
+			obj.height = (NumberT)(obj.height + (NumberT)(4 + jitter(rand)));
+			ASSERT(lqt.Update(&obj));
+		}
+		// every few rounds some objects also shrink or jump far away
+		if (round % 4 == 3) {
+			for (int i = 0; i < 50; i++) {
+				BoundingBox<NumberT>& obj = objects[index(rand)];
+				obj = BoundingBox<NumberT>((NumberT)coordinate(rand), (NumberT)coordinate(rand),
+						(NumberT)extent(rand), (NumberT)extent(rand));
+				lqt.Update(&obj);
+			}
+		}
+		ASSERT(lqt.GetSize() == (int)objects.size());
+		BoundingBox<NumberT> query_region((NumberT)coordinate(rand), (NumberT)coordinate(rand),
+				(NumberT)(extent(rand) * 10), (NumberT)(extent(rand) * 10));
+		for (std::size_t i = 0; i < flags.size(); i++) {
+			flags[i] = false;
+		}
+		auto query = lqt.QueryIntersectsRegion(query_region);
+		while (!query.EndOfQuery()) {
+			std::size_t id = (std::size_t)(query.GetCurrent() - &objects[0]);
+			ASSERT(id < objects.size());
+			ASSERT(!flags[id]);
+			flags[id] = true;
+			query.Next();
+		}
+		for (std::size_t i = 0; i < flags.size(); i++) {
+			ASSERT(flags[i] == query_region.Intersects(objects[i]));
+		}
+	}
+	lqt.ForceCleanup();
+	ASSERT(lqt.GetSize() == (int)objects.size());
+}
+
+template <typename NumberT, typename TraitsT>
+void TestBulkLoad() {
+	std::minstd_rand rand;
+	std::uniform_int_distribution<int> coordinate(10000, 12000);
+	std::uniform_int_distribution<int> extent(0, 300);
+	std::vector<BoundingBox<NumberT>> objects;
+	for (int i = 0; i < 2000; i++) {
+		objects.emplace_back((NumberT)coordinate(rand), (NumberT)coordinate(rand),
+				(NumberT)(extent(rand) * extent(rand) / 300), (NumberT)(extent(rand) / 10));
+	}
+	std::vector<BoundingBox<NumberT>*> pointers;
+	for (auto& obj : objects) {
+		pointers.push_back(&obj);
+	}
+	pointers.push_back(&objects[7]);
+	LooseQuadtree<NumberT, BoundingBox<NumberT>, TrivialBBExtractor<NumberT>, TraitsT> lqt;
+	lqt.Reserve(pointers.size());
+	lqt.BulkLoad(pointers.begin(), pointers.begin());
+	ASSERT(lqt.IsEmpty());
+	lqt.BulkLoad(pointers.begin(), pointers.begin() + 1000);
+	ASSERT(lqt.GetSize() == 1000);
+	// a tree which is not empty anymore keeps its objects and gets the rest added
+	lqt.BulkLoad(pointers.begin() + 500, pointers.end());
+	ASSERT(lqt.GetSize() == 2000);
+	ASSERT(lqt.Contains(&objects[0]) && lqt.Contains(&objects[1999]));
+	std::vector<bool> flags(objects.size());
+	for (int round = 0; round < 20; round++) {
+		if (round == 10) {
+			lqt.Clear();
+			lqt.BulkLoad(pointers.begin(), pointers.end());
+			ASSERT(lqt.GetSize() == 2000);
+		}
+		BoundingBox<NumberT> query_region((NumberT)coordinate(rand), (NumberT)coordinate(rand),
+				(NumberT)extent(rand), (NumberT)extent(rand));
+		for (std::size_t i = 0; i < flags.size(); i++) {
+			flags[i] = false;
+		}
+		auto query = lqt.QueryIntersectsRegion(query_region);
+		while (!query.EndOfQuery()) {
+			std::size_t id = (std::size_t)(query.GetCurrent() - &objects[0]);
+			ASSERT(id < objects.size());
+			ASSERT(!flags[id]);
+			flags[id] = true;
+			query.Next();
+		}
+		for (std::size_t i = 0; i < flags.size(); i++) {
+			ASSERT(flags[i] == query_region.Intersects(objects[i]));
+		}
+		BoundingBox<NumberT>& obj = objects[(std::size_t)round * 50];
+		obj.left = (NumberT)coordinate(rand);
+		ASSERT(lqt.Update(&obj));
+	}
+	for (auto& obj : objects) {
+		ASSERT(lqt.Remove(&obj));
+	}
+	// the nodes left empty get replaced
+	lqt.BulkLoad(pointers.begin(), pointers.begin() + 100);
+	ASSERT(lqt.GetSize() == 100);
+	for (int i = 0; i < 100; i++) {
+		ASSERT(lqt.Remove(&objects[(std::size_t)i]));
+	}
+	lqt.ForceCleanup();
+	ASSERT(lqt.IsEmpty());
+	// forward ranges get the bookkeeping sized once instead of growing it object by object
+	LooseQuadtree<NumberT, BoundingBox<NumberT>, TrivialBBExtractor<NumberT>, TraitsT> reserved;
+	reserved.Reserve(1500);
+	LooseQuadtree<NumberT, BoundingBox<NumberT>, TrivialBBExtractor<NumberT>, TraitsT> grown;
+	grown.UpdateMany(pointers.begin(), pointers.begin() + 1500);
+	ASSERT(grown.GetSize() == 1500);
+	ASSERT(grown.GetCapacity() == reserved.GetCapacity());
+	reserved.Reserve(pointers.size());
+	grown.UpdateMany(pointers.begin() + 1500, pointers.end());
+	ASSERT(grown.GetSize() == 2000);
+	ASSERT(grown.GetCapacity() == reserved.GetCapacity());
+}
+
+template <typename NumberT, typename TraitsT>
+void TestBatchUpdates() {
+	std::minstd_rand rand;
+	std::uniform_int_distribution<int> coordinate(10000, 12000);
+	std::uniform_int_distribution<int> extent(1, 60);
+	std::uniform_int_distribution<int> jitter(-20, 20);
+	std::uniform_int_distribution<std::size_t> index(0, 999);
+	std::vector<BoundingBox<NumberT>> objects;
+	for (int i = 0; i < 1000; i++) {
+		objects.emplace_back((NumberT)coordinate(rand), (NumberT)coordinate(rand),
+				(NumberT)extent(rand), (NumberT)extent(rand));
+	}
+	std::vector<BoundingBox<NumberT>*> pointers;
+	for (auto& obj : objects) {
+		pointers.push_back(&obj);
+	}
+	LooseQuadtree<NumberT, BoundingBox<NumberT>, TrivialBBExtractor<NumberT>, TraitsT> lqt;
+	// the first half is inserted by the batch, the rest later on
+	lqt.UpdateMany(pointers.begin(), pointers.begin() + 500);
+	ASSERT(lqt.GetSize() == 500);
+	std::vector<bool> flags(objects.size());
+	std::vector<bool> contained(objects.size(), false);
+	for (std::size_t i = 0; i < 500; i++) {
+		contained[i] = true;
+	}
+	for (int round = 0; round < 20; round++) {
+		if (round % 5 == 4) {
+			// removing what was not contained or is in the range twice has no effect
+			std::vector<BoundingBox<NumberT>*> removed;
+			int expected = 0;
+			for (int i = 0; i < 100; i++) {
+				std::size_t id = index(rand);
+				removed.push_back(pointers[id]);
+				removed.push_back(pointers[id]);
+				if (contained[id]) {
+					expected++;
+				}
+				contained[id] = false;
+			}
+			int size = lqt.GetSize();
+			ASSERT(lqt.RemoveMany(removed.begin(), removed.end()) == expected);
+			ASSERT(lqt.GetSize() == size - expected);
+		}
+		else {
+			for (auto& obj : objects) {
+				obj.left = (NumberT)(obj.left + (NumberT)jitter(rand));
+				obj.top = (NumberT)(obj.top + (NumberT)jitter(rand));
+			}
+			std::vector<BoundingBox<NumberT>*> batch(pointers.begin(), pointers.end());
+			for (int i = 0; i < 20; i++) {
+				BoundingBox<NumberT>* obj = pointers[index(rand)];
+				*obj = BoundingBox<NumberT>((NumberT)(coordinate(rand) + round % 3 * 1500),
+						(NumberT)coordinate(rand), (NumberT)(extent(rand) * 8), (NumberT)extent(rand));
+				batch.push_back(obj); // duplicates are fine
+			}
+			lqt.UpdateMany(batch.begin(), batch.end());
+			for (std::size_t i = 0; i < contained.size(); i++) {
+				contained[i] = true;
+			}
+			ASSERT(lqt.GetSize() == (int)objects.size());
+		}
+		for (std::size_t i = 0; i < objects.size(); i++) {
+			ASSERT(lqt.Contains(&objects[i]) == contained[i]);
+		}
+		BoundingBox<NumberT> query_region((NumberT)coordinate(rand), (NumberT)coordinate(rand),
+				(NumberT)(extent(rand) * 10), (NumberT)(extent(rand) * 10));
+		for (std::size_t i = 0; i < flags.size(); i++) {
+			flags[i] = false;
+		}
+		auto query = lqt.QueryIntersectsRegion(query_region);
+		while (!query.EndOfQuery()) {
+			std::size_t id = (std::size_t)(query.GetCurrent() - &objects[0]);
+			ASSERT(id < objects.size());
+			ASSERT(!flags[id]);
+			flags[id] = true;
+			query.Next();
+		}
+		for (std::size_t i = 0; i < flags.size(); i++) {
+			ASSERT(flags[i] == (contained[i] && query_region.Intersects(objects[i])));
+		}
+	}
+	int size = lqt.GetSize();
+	ASSERT(lqt.RemoveMany(pointers.begin(), pointers.end()) == size);
+	lqt.ForceCleanup();
+	ASSERT(lqt.IsEmpty());
+}
+
+
+template <typename NumberT, typename TraitsT>
+void TestForEach() {
+	using Tree = LooseQuadtree<NumberT, BoundingBox<NumberT>, TrivialBBExtractor<NumberT>, TraitsT>;
+	std::minstd_rand rand;
+	std::uniform_int_distribution<int> coordinate(10000, 12000);
+	std::uniform_int_distribution<int> extent(1, 200);
+	std::vector<BoundingBox<NumberT>> objects = GenerateObjects<NumberT>(2000, rand);
+	Tree lqt;
+	int visited = 0;
+	ASSERT(lqt.ForEachIntersecting(BoundingBox<NumberT>(10000, 10000, 10, 10),
+			[&visited](BoundingBox<NumberT>*) {visited++;}));
+	ASSERT(visited == 0);
+	for (auto& obj : objects) {
+		lqt.Insert(&obj);
+	}
+	std::vector<int> counts(objects.size());
+	for (int round = 0; round < 30; round++) {
+		BoundingBox<NumberT> region((NumberT)coordinate(rand), (NumberT)coordinate(rand),
+				(NumberT)(extent(rand) * 4), (NumberT)(extent(rand) * 4));
+		if (round % 3 == 2) {
+			region.width = (NumberT)2;
+			region.height = (NumberT)2;
+		}
+		for (int type = 0; type < 3; type++) {
+			for (std::size_t i = 0; i < counts.size(); i++) {
+				counts[i] = 0;
+			}
+			auto count = [&objects, &counts](BoundingBox<NumberT>* obj) {
+				counts[(std::size_t)(obj - &objects[0])]++;
+			};
+			bool finished = type == 0 ? lqt.ForEachIntersecting(region, count) :
+				type == 1 ? lqt.ForEachInside(region, count) : lqt.ForEachContaining(region, count);
+			ASSERT(finished);
+			int hits = 0;
+			for (std::size_t i = 0; i < objects.size(); i++) {
+				bool fits = type == 0 ? region.Intersects(objects[i]) :
+					type == 1 ? region.Contains(objects[i]) : objects[i].Contains(region);
+				ASSERT(counts[i] == (fits ? 1 : 0));
+				hits += counts[i];
+			}
+			// stopping early visits exactly as many as asked for
+			int limit = hits / 2;
+			visited = 0;
+			auto stop = [&visited, limit](BoundingBox<NumberT>*) {
+				visited++;
+				return visited < limit;
+			};
+			finished = type == 0 ? lqt.ForEachIntersecting(region, stop) :
+				type == 1 ? lqt.ForEachInside(region, stop) : lqt.ForEachContaining(region, stop);
+			ASSERT(finished == (limit == 0 && hits == 0) || (limit > 0 && !finished));
+			ASSERT(visited == (limit > 0 ? limit : hits));
+		}
+	}
+	// the visitor can move objects away and run queries, those must not compact the nodes
+	BoundingBox<NumberT> region(10000, 10000, 1000, 1000);
+	lqt.ForEachIntersecting(region, [&lqt, &region](BoundingBox<NumberT>* obj) {
+		obj->left = (NumberT)(obj->left + 1000);
+		obj->top = (NumberT)(obj->top + 1000);
+		lqt.Update(obj);
+		auto query = lqt.QueryIntersectsRegion(region);
+		while (!query.EndOfQuery()) {
+			ASSERT(region.Intersects(*query.GetCurrent()));
+			query.Next();
+		}
+	});
+	int hits = 0;
+	lqt.ForEachIntersecting(region, [&hits](BoundingBox<NumberT>*) {hits++;});
+	for (auto& obj : objects) {
+		hits -= region.Intersects(obj) ? 1 : 0;
+	}
+	ASSERT(hits == 0);
+	lqt.ForceCleanup();
+	ASSERT(lqt.GetSize() == (int)objects.size());
+}
+
+template <typename NumberT, typename TraitsT>
+void TestQueryIntoVector() {
+	using Tree = LooseQuadtree<NumberT, BoundingBox<NumberT>, TrivialBBExtractor<NumberT>, TraitsT>;
+	std::minstd_rand rand;
+	std::uniform_int_distribution<int> coordinate(10000, 12000);
+	std::uniform_int_distribution<int> extent(1, 200);
+	std::vector<BoundingBox<NumberT>> objects = GenerateObjects<NumberT>(2000, rand);
+	Tree lqt;
+	std::vector<BoundingBox<NumberT>*> out;
+	lqt.QueryIntersectsRegion(BoundingBox<NumberT>(10000, 10000, 100, 100), out);
+	ASSERT(out.empty());
+	for (auto& obj : objects) {
+		lqt.Insert(&obj);
+	}
+	for (std::size_t i = 0; i < objects.size(); i += 5) {
+		lqt.Remove(&objects[i]);
+	}
+	std::vector<BoundingBox<NumberT>*> expected;
+	for (int round = 0; round < 30; round++) {
+		BoundingBox<NumberT> region((NumberT)coordinate(rand), (NumberT)coordinate(rand),
+				(NumberT)(extent(rand) * 4), (NumberT)(extent(rand) * 4));
+		if (round % 3 == 2) {
+			region.width = (NumberT)2;
+			region.height = (NumberT)2;
+		}
+		if (round == 0) {
+			region = BoundingBox<NumberT>(9000, 9000, 4000, 4000);
+		}
+		for (int type = 0; type < 3; type++) {
+			expected.clear();
+			auto query = type == 0 ? lqt.QueryIntersectsRegion(region) :
+				type == 1 ? lqt.QueryInsideRegion(region) : lqt.QueryContainsRegion(region);
+			while (!query.EndOfQuery()) {
+				expected.push_back(query.GetCurrent());
+				query.Next();
+			}
+			// results are appended after what is in the vector already
+			out.assign(1, &objects[0]);
+			if (type == 0) {
+				lqt.QueryIntersectsRegion(region, out);
+			}
+			else if (type == 1) {
+				lqt.QueryInsideRegion(region, out);
+			}
+			else {
+				lqt.QueryContainsRegion(region, out);
+			}
+			ASSERT(out.size() == expected.size() + 1);
+			ASSERT(out[0] == &objects[0]);
+			std::sort(out.begin() + 1, out.end());
+			std::sort(expected.begin(), expected.end());
+			ASSERT(std::equal(expected.begin(), expected.end(), out.begin() + 1));
+			if (round == 0 && type < 2) {
+				ASSERT((int)expected.size() == lqt.GetSize());
+			}
+		}
+	}
+}
+
+template <typename NumberT, typename TraitsT>
+void TestQueryPoolAndLocalQueries() {
+	using Tree = LooseQuadtree<NumberT, BoundingBox<NumberT>, TrivialBBExtractor<NumberT>, TraitsT>;
+	std::minstd_rand rand;
+	std::uniform_int_distribution<int> coordinate(10000, 12000);
+	std::uniform_int_distribution<int> extent(1, 200);
+	std::vector<BoundingBox<NumberT>> objects = GenerateObjects<NumberT>(2000, rand);
+	const BoundingBox<NumberT> everything(9000, 9000, 4000, 4000);
+	{
+		Tree lqt;
+		typename Tree::LocalQuery local_query(lqt);
+		ASSERT(local_query.EndOfQuery());
+		local_query.StartIntersectsRegion(everything);
+		ASSERT(local_query.EndOfQuery());
+		for (auto& obj : objects) {
+			lqt.Insert(&obj);
+		}
+		std::vector<BoundingBox<NumberT>*> expected;
+		std::vector<BoundingBox<NumberT>*> found;
+		for (int round = 0; round < 30; round++) {
+			BoundingBox<NumberT> region((NumberT)coordinate(rand), (NumberT)coordinate(rand),
+					(NumberT)(extent(rand) * 4), (NumberT)(extent(rand) * 4));
+			for (int type = 0; type < 3; type++) {
+				expected.clear();
+				found.clear();
+				// the same local query is restarted, sometimes before reaching its end
+				if (type == 0) {
+					lqt.QueryIntersectsRegion(region, expected);
+					local_query.StartIntersectsRegion(region);
+				}
+				else if (type == 1) {
+					lqt.QueryInsideRegion(region, expected);
+					local_query.StartInsideRegion(region);
+				}
+				else {
+					lqt.QueryContainsRegion(region, expected);
+					local_query.StartContainsRegion(region);
+				}
+				while (!local_query.EndOfQuery() && (round % 4 != 3 || found.size() < 2)) {
+					found.push_back(local_query.GetCurrent());
+					local_query.Next();
+				}
+				if (round % 4 == 3) {
+					continue;
+				}
+				std::sort(found.begin(), found.end());
+				std::sort(expected.begin(), expected.end());
+				ASSERT(found == expected);
+			}
+		}
+	}
+	{
+		Tree lqt;
+		for (auto& obj : objects) {
+			lqt.Insert(&obj);
+		}
+		// pooled queries get reused in any order while others are still open
+		std::vector<typename Tree::Query> queries;
+		std::vector<int> counts;
+		for (int round = 0; round < 4; round++) {
+			while (queries.size() < 24) {
+				queries.push_back(lqt.QueryIntersectsRegion(everything));
+				counts.push_back(0);
+			}
+			for (std::size_t i = 0; i < queries.size(); i++) {
+				for (std::size_t step = 0; step < 50 * i && !queries[i].EndOfQuery(); step++) {
+					counts[i]++;
+					queries[i].Next();
+				}
+			}
+			for (std::size_t i = queries.size(); i-- > 0;) {
+				if ((i + (std::size_t)round) % 3 == 0) {
+					queries.erase(queries.begin() + (std::ptrdiff_t)i);
+					counts.erase(counts.begin() + (std::ptrdiff_t)i);
+				}
+			}
+		}
+		for (std::size_t i = 0; i < queries.size(); i++) {
+			while (!queries[i].EndOfQuery()) {
+				counts[i]++;
+				queries[i].Next();
+			}
+			ASSERT(counts[i] == lqt.GetSize());
+		}
+	}
+	{
+		Tree lqt;
+		for (auto& obj : objects) {
+			lqt.Insert(&obj);
+		}
+		{
+			// abandoned queries do not keep the tree from cleaning up
+			auto query = lqt.QueryIntersectsRegion(everything);
+			query.Next();
+			typename Tree::LocalQuery local_query(lqt);
+			local_query.StartInsideRegion(everything);
+			local_query.Next();
+		}
+		for (auto& obj : objects) {
+			lqt.Remove(&obj);
+		}
+		auto query = lqt.QueryIntersectsRegion(everything);
+		ASSERT(query.EndOfQuery());
+		ASSERT(lqt.GetLooseBoundingBox().width == 0);
+	}
+}
+
+template <typename NumberT, typename TraitsT>
+void TestConstQueries() {
+	using Tree = LooseQuadtree<NumberT, BoundingBox<NumberT>, TrivialBBExtractor<NumberT>, TraitsT>;
+	std::minstd_rand rand;
+	std::uniform_int_distribution<int> coordinate(10000, 12000);
+	std::uniform_int_distribution<int> extent(1, 200);
+	std::vector<BoundingBox<NumberT>> objects = GenerateObjects<NumberT>(2000, rand);
+	Tree lqt;
+	for (auto& obj : objects) {
+		lqt.Insert(&obj);
+	}
+	for (std::size_t i = 0; i < objects.size(); i += 5) {
+		lqt.Remove(&objects[i]);
+	}
+	std::vector<BoundingBox<NumberT>> regions;
+	std::vector<std::vector<BoundingBox<NumberT>*>> expected(40);
+	std::vector<int> expected_counts;
+	for (std::size_t i = 0; i < expected.size(); i++) {
+		regions.emplace_back((NumberT)coordinate(rand), (NumberT)coordinate(rand),
+				(NumberT)(extent(rand) * 4), (NumberT)(extent(rand) * 4));
+		auto query = lqt.QueryIntersectsRegion(regions[i]);
+		while (!query.EndOfQuery()) {
+			expected[i].push_back(query.GetCurrent());
+			query.Next();
+		}
+		std::sort(expected[i].begin(), expected[i].end());
+		expected_counts.push_back(lqt.CountInsideRegion(regions[i]));
+	}
+	// several readers go through a const reference at once, nothing in the tree is touched
+	const Tree& reader = lqt;
+	const BoundingBox<NumberT> loose_bounds = reader.GetLooseBoundingBox();
+	const int kThreads = 4;
+	std::vector<int> mismatches(kThreads, 0);
+	std::vector<std::thread> threads;
+	for (int t = 0; t < kThreads; t++) {
+		threads.emplace_back([&, t]() {
+			std::vector<BoundingBox<NumberT>*> found;
+			std::vector<BoundingBox<NumberT>*> visited;
+			std::vector<BoundingBox<NumberT>*> nearest;
+			for (int round = 0; round < 5; round++) {
+				for (std::size_t i = 0; i < regions.size(); i++) {
+					found.clear();
+					reader.QueryIntersectsRegion(regions[i], found);
+					std::sort(found.begin(), found.end());
+					visited.clear();
+					reader.ForEachIntersecting(regions[i], [&visited](BoundingBox<NumberT>* obj) {
+						visited.push_back(obj);
+					});
+					std::sort(visited.begin(), visited.end());
+					nearest.clear();
+					reader.QueryNearest(regions[i].left, regions[i].top, 3, nearest);
+					if (found != expected[i] || visited != expected[i] || nearest.size() != 3 ||
+							reader.CountInsideRegion(regions[i]) != expected_counts[i]) {
+						mismatches[(std::size_t)t]++;
+					}
+				}
+			}
+		});
+	}
+	for (auto& thread : threads) {
+		thread.join();
+	}
+	for (int t = 0; t < kThreads; t++) {
+		ASSERT(mismatches[(std::size_t)t] == 0);
+	}
+	ASSERT(reader.GetSize() == lqt.GetSize());
+	ASSERT(reader.GetLooseBoundingBox().left == loose_bounds.left);
+	ASSERT(reader.GetLooseBoundingBox().width == loose_bounds.width);
+	// only the non-const queries clean up the emptied tree
+	for (auto& obj : objects) {
+		lqt.Remove(&obj);
+	}
+	std::vector<BoundingBox<NumberT>*> out;
+	const BoundingBox<NumberT> everything(9000, 9000, 4000, 4000);
+	reader.QueryIntersectsRegion(everything, out);
+	ASSERT(out.empty());
+	ASSERT(reader.ForEachIntersecting(everything, [](BoundingBox<NumberT>*) {
+		return false;
+	}));
+	ASSERT(reader.GetLooseBoundingBox().width == loose_bounds.width);
+	auto query = lqt.QueryIntersectsRegion(everything);
+	ASSERT(query.EndOfQuery());
+	ASSERT(reader.GetLooseBoundingBox().width == 0);
+}
+
+template <typename NumberT, typename TraitsT>
+void TestSnapshots() {
+	using Tree = LooseQuadtree<NumberT, BoundingBox<NumberT>, TrivialBBExtractor<NumberT>, TraitsT>;
+	using Snapshot = typename Tree::Snapshot;
+	std::minstd_rand rand;
+	std::uniform_int_distribution<int> coordinate(10000, 12000);
+	std::uniform_int_distribution<int> extent(1, 200);
+	std::uniform_int_distribution<int> step(-20, 20);
+	std::vector<BoundingBox<NumberT>> objects;
+	for (int i = 0; i < 1000; i++) {
+		// the first ones are close together, so the root has to grow later
+		int spread = i < 100 ? 10100 : 12000;
+		std::uniform_int_distribution<int> place(10000, spread);
+		objects.emplace_back((NumberT)place(rand), (NumberT)place(rand),
+				(NumberT)(extent(rand) * extent(rand) / 400 + 1), (NumberT)(extent(rand) / 20 + 1));
+	}
+	std::vector<BoundingBox<NumberT>> regions;
+	for (int i = 0; i < 15; i++) {
+		regions.emplace_back((NumberT)coordinate(rand), (NumberT)coordinate(rand),
+				(NumberT)(extent(rand) * 4), (NumberT)(extent(rand) * 4));
+	}
+	regions.emplace_back((NumberT)9000, (NumberT)9000, (NumberT)4000, (NumberT)4000);
+	// what a snapshot has to give back is worked out from copies of the objects
+	struct State {
+		std::vector<BoundingBox<NumberT>> bounds;
+		std::vector<bool> contained;
+	};
+	auto expect = [&objects](const State& state, const BoundingBox<NumberT>& region,
+			int query_type) {
+		std::vector<BoundingBox<NumberT>*> expected;
+		for (std::size_t i = 0; i < objects.size(); i++) {
+			const BoundingBox<NumberT>& bounds = state.bounds[i];
+			if (state.contained[i] && (query_type == 0 ? region.Intersects(bounds) :
+					query_type == 1 ? region.Contains(bounds) : bounds.Contains(region))) {
+				expected.push_back(&objects[i]);
+			}
+		}
+		return expected;
+	};
+	auto matches = [&regions, &expect](const Snapshot& snapshot, const State& state) {
+		std::vector<BoundingBox<NumberT>*> found;
+		for (auto& region : regions) {
+			for (int query_type = 0; query_type < 3; query_type++) {
+				found.clear();
+				if (query_type == 0) {
+					snapshot.QueryIntersectsRegion(region, found);
+				}
+				else if (query_type == 1) {
+					snapshot.QueryInsideRegion(region, found);
+				}
+				else {
+					snapshot.QueryContainsRegion(region, found);
+				}
+				std::sort(found.begin(), found.end());
+				if (found != expect(state, region, query_type)) {
+					return false;
+				}
+			}
+			found.clear();
+			snapshot.ForEachIntersecting(region, [&found](BoundingBox<NumberT>* obj) {
+				found.push_back(obj);
+			});
+			std::sort(found.begin(), found.end());
+			if (found != expect(state, region, 0)) {
+				return false;
+			}
+		}
+		int count = 0;
+		for (bool contained : state.contained) {
+			count += contained ? 1 : 0;
+		}
+		return snapshot.GetSize() == count;
+	};
+	State state = {objects, std::vector<bool>(objects.size(), false)};
+
+	Tree lqt;
+	std::shared_ptr<const Snapshot> empty = lqt.TakeSnapshot();
+	ASSERT(empty->IsEmpty());
+	ASSERT(matches(*empty, state));
+	for (std::size_t i = 0; i < 100; i++) {
+		lqt.Insert(&objects[i]);
+		state.contained[i] = true;
+	}
+	std::shared_ptr<const Snapshot> small = lqt.TakeSnapshot();
+	State small_state = state;
+	ASSERT(matches(*small, small_state));
+	ASSERT(lqt.TakeSnapshot() == small); // nothing changed
+	// the root grows, the old root is found again further down
+	for (std::size_t i = 100; i < objects.size(); i++) {
+		lqt.Insert(&objects[i]);
+		state.contained[i] = true;
+	}
+	std::shared_ptr<const Snapshot> full = lqt.TakeSnapshot();
+	State full_state = state;
+	ASSERT(matches(*full, full_state));
+	ASSERT(matches(*small, small_state));
+	ASSERT(empty->IsEmpty());
+	// a reader keeps checking a snapshot while the tree and its next snapshots change
+	std::atomic<bool> writing(true);
+	std::atomic<int> mismatches(0);
+	std::thread reader([&]() {
+		do {
+			if (!matches(*full, full_state)) {
+				mismatches++;
+			}
+			std::this_thread::yield();
+		} while (writing);
+	});
+	std::vector<std::shared_ptr<const Snapshot>> snapshots;
+	std::vector<State> snapshot_states;
+	for (int round = 0; round < 10; round++) {
+		for (int change = 0; change < 50; change++) {
+			std::size_t i = (std::size_t)rand() % objects.size();
+			if (!state.contained[i]) {
+				lqt.Insert(&objects[i]);
+				state.contained[i] = true;
+			}
+			else if (change % 5 == 0) {
+				lqt.Remove(&objects[i]);
+				state.contained[i] = false;
+			}
+			else {
+				// mostly small moves, which leave the objects in their nodes
+				objects[i].left = (NumberT)(objects[i].left + (NumberT)(step(rand) + 20) - (NumberT)20);
+				objects[i].top = (NumberT)(objects[i].top + (NumberT)(step(rand) + 20) - (NumberT)20);
+				lqt.Update(&objects[i]);
+			}
+			state.bounds[i] = objects[i];
+		}
+		if (round == 5) {
+			lqt.ForceCleanup();
+		}
+		snapshots.push_back(lqt.TakeSnapshot());
+		snapshot_states.push_back(state);
+		ASSERT(matches(*snapshots.back(), state));
+	}
+	writing = false;
+	reader.join();
+	ASSERT(mismatches == 0);
+	for (std::size_t i = 0; i < snapshots.size(); i++) {
+		ASSERT(matches(*snapshots[i], snapshot_states[i]));
+	}
+	ASSERT(matches(*full, full_state));
+	// the snapshots outlive the nodes they were taken from
+	lqt.Clear();
+	ASSERT(matches(*full, full_state));
+	ASSERT(lqt.TakeSnapshot()->IsEmpty());
+	ASSERT(lqt.TakeSnapshot() == lqt.TakeSnapshot());
+	for (std::size_t i = 0; i < objects.size(); i++) {
+		lqt.Insert(&objects[i]);
+		state.contained[i] = true;
+	}
+	while (!lqt.Maintain(50)) {}
+	ASSERT(matches(*lqt.TakeSnapshot(), state));
+}
+
+template <typename NumberT, typename TraitsT>
+void TestConcurrentQuadtree() {
+	using Tree = LooseQuadtree<NumberT, BoundingBox<NumberT>, TrivialBBExtractor<NumberT>, TraitsT>;
+	using ConcurrentTree = ConcurrentLooseQuadtree<NumberT, BoundingBox<NumberT>,
+		TrivialBBExtractor<NumberT>, TraitsT>;
+	std::minstd_rand rand;
+	std::uniform_int_distribution<int> coordinate(10000, 12000);
+	std::uniform_int_distribution<int> extent(1, 200);
+	std::vector<BoundingBox<NumberT>> objects = GenerateObjects<NumberT>(4000, rand);
+	ConcurrentTree clqt(16);
+	ASSERT(clqt.GetShardCount() == 16);
+	ASSERT(clqt.IsEmpty());
+	// writers insert and remove their own objects while a reader keeps querying
+	const int kThreads = 4;
+	std::atomic<bool> writing(true);
+	std::thread reader([&]() {
+		std::vector<BoundingBox<NumberT>*> found;
+		const BoundingBox<NumberT> everything(9000, 9000, 4000, 4000);
+		while (writing) {
+			found.clear();
+			clqt.QueryIntersectsRegion(everything, found);
+			ASSERT(found.size() <= objects.size());
+			ASSERT(clqt.CountIntersectsRegion(everything) <= (int)objects.size());
+		}
+	});
+	std::vector<std::thread> writers;
+	for (int t = 0; t < kThreads; t++) {
+		writers.emplace_back([&, t]() {
+			for (std::size_t i = (std::size_t)t; i < objects.size(); i += kThreads) {
+				ASSERT(clqt.Insert(&objects[i]));
+			}
+			for (std::size_t i = (std::size_t)t; i < objects.size(); i += kThreads) {
+				if (i % 3 == 0) {
+					ASSERT(clqt.Remove(&objects[i]));
+				}
+				else {
+					ASSERT(clqt.Update(&objects[i]));
+				}
+			}
+		});
+	}
+	for (auto& writer : writers) {
+		writer.join();
+	}
+	writing = false;
+	reader.join();
+	Tree lqt;
+	for (std::size_t i = 0; i < objects.size(); i++) {
+		if (i % 3 != 0) {
+			lqt.Insert(&objects[i]);
+		}
+	}
+	ASSERT(clqt.GetSize() == lqt.GetSize());
+	for (std::size_t i = 0; i < objects.size(); i++) {
+		ASSERT(clqt.Contains(&objects[i]) == (i % 3 != 0));
+	}
+	std::vector<BoundingBox<NumberT>*> expected;
+	std::vector<BoundingBox<NumberT>*> found;
+	for (int round = 0; round < 20; round++) {
+		BoundingBox<NumberT> region((NumberT)coordinate(rand), (NumberT)coordinate(rand),
+				(NumberT)(extent(rand) * 4), (NumberT)(extent(rand) * 4));
+		expected.clear();
+		lqt.QueryIntersectsRegion(region, expected);
+		std::sort(expected.begin(), expected.end());
+		found.clear();
+		clqt.QueryIntersectsRegion(region, found);
+		std::sort(found.begin(), found.end());
+		ASSERT(found == expected);
+		ASSERT(clqt.CountIntersectsRegion(region) == (int)expected.size());
+		found.clear();
+		ASSERT(clqt.ForEachIntersecting(region, [&found](BoundingBox<NumberT>* obj) {
+			found.push_back(obj);
+		}));
+		std::sort(found.begin(), found.end());
+		ASSERT(found == expected);
+		expected.clear();
+		lqt.QueryInsideRegion(region, expected);
+		std::sort(expected.begin(), expected.end());
+		found.clear();
+		clqt.QueryInsideRegion(region, found);
+		std::sort(found.begin(), found.end());
+		ASSERT(found == expected);
+		expected.clear();
+		lqt.QueryContainsRegion(region, expected);
+		std::sort(expected.begin(), expected.end());
+		found.clear();
+		clqt.QueryContainsRegion(region, found);
+		std::sort(found.begin(), found.end());
+		ASSERT(found == expected);
+	}
+	int visited = 0;
+	ASSERT(!clqt.ForEachIntersecting(BoundingBox<NumberT>(9000, 9000, 4000, 4000),
+			[&visited](BoundingBox<NumberT>*) {
+		return ++visited < 5;
+	}));
+	ASSERT(visited == 5);
+	// batches are split by shard
+	std::vector<BoundingBox<NumberT>*> all;
+	for (auto& obj : objects) {
+		all.push_back(&obj);
+	}
+	clqt.UpdateMany(all.begin(), all.end());
+	ASSERT(clqt.GetSize() == (int)objects.size());
+	ASSERT(clqt.RemoveMany(all.begin(), all.begin() + 1000) == 1000);
+	ASSERT(clqt.RemoveMany(all.begin(), all.begin() + 1000) == 0);
+	ASSERT(clqt.GetSize() == (int)objects.size() - 1000);
+	while (!clqt.Maintain(10)) {}
+	clqt.ForceCleanup();
+	ASSERT(clqt.GetSize() == (int)objects.size() - 1000);
+	ASSERT(clqt.CountIntersectsRegion(BoundingBox<NumberT>(9000, 9000, 4000, 4000)) ==
+			(int)objects.size() - 1000);
+	clqt.Clear();
+	ASSERT(clqt.IsEmpty());
+	ASSERT(!clqt.Contains(&objects.back()));
+}
+
+template <typename NumberT, typename TraitsT>
+void TestParallelQueries() {
+	using Tree = LooseQuadtree<NumberT, BoundingBox<NumberT>, TrivialBBExtractor<NumberT>, TraitsT>;
+	std::minstd_rand rand;
+	std::uniform_int_distribution<int> coordinate(10000, 12000);
+	std::uniform_int_distribution<int> extent(1, 200);
+	std::vector<BoundingBox<NumberT>> objects = GenerateObjects<NumberT>(3000, rand);
+	const BoundingBox<NumberT> everything(9000, 9000, 4000, 4000);
+	// the pools live across all the queries, the calling thread works alongside them
+	ThreadPool no_helpers(0);
+	ThreadPool pool(3);
+	ASSERT(pool.GetThreadCount() == 3);
+	// every task given to a pool gets run, without threads right away
+	std::atomic<int> pool_tasks(0);
+	no_helpers([&pool_tasks]() {
+		pool_tasks++;
+	});
+	ASSERT(pool_tasks == 1);
+	{
+		ThreadPool short_lived(2);
+		for (int i = 0; i < 10; i++) {
+			short_lived([&pool_tasks]() {
+				pool_tasks++;
+			});
+		}
+	}
+	ASSERT(pool_tasks == 11);
+	Tree lqt;
+	std::vector<BoundingBox<NumberT>*> out;
+	lqt.QueryIntersectsRegionParallel(everything, out, pool);
+	ASSERT(out.empty());
+	for (auto& obj : objects) {
+		lqt.Insert(&obj);
+	}
+	for (std::size_t i = 0; i < objects.size(); i += 7) {
+		lqt.Remove(&objects[i]);
+	}
+	// runs the helpers right away on the calling thread
+	auto inline_executor = [](std::function<void()> task) {
+		task();
+	};
+	// starts the helpers only after the query returned, they must find nothing to do
+	std::vector<std::function<void()>> late_tasks;
+	auto late_executor = [&late_tasks](std::function<void()> task) {
+		late_tasks.push_back(task);
+	};
+	std::vector<BoundingBox<NumberT>*> expected;
+	for (int round = 0; round < 20; round++) {
+		BoundingBox<NumberT> region((NumberT)coordinate(rand), (NumberT)coordinate(rand),
+				(NumberT)(extent(rand) * 5), (NumberT)(extent(rand) * 5));
+		if (round == 0) {
+			region = everything;
+		}
+		expected.assign(1, &objects[0]);
+		lqt.QueryIntersectsRegion(region, expected);
+		out.assign(1, &objects[0]);
+		lqt.QueryIntersectsRegionParallel(region, out, no_helpers);
+		ASSERT(out == expected);
+		out.assign(1, &objects[0]);
+		lqt.QueryIntersectsRegionParallel(region, out, pool);
+		ASSERT(out == expected);
+		out.assign(1, &objects[0]);
+		lqt.QueryIntersectsRegionParallel(region, out, 3, inline_executor);
+		ASSERT(out == expected);
+		out.assign(1, &objects[0]);
+		lqt.QueryIntersectsRegionParallel(region, out, 3, late_executor);
+		ASSERT(out == expected);
+		for (auto& task : late_tasks) {
+			task();
+		}
+		late_tasks.clear();
+		std::atomic<int> visited(0);
+		ASSERT(lqt.ForEachIntersectingParallel(region, pool, [&visited](BoundingBox<NumberT>*) {
+			visited++;
+		}));
+		ASSERT(visited == (int)expected.size() - 1);
+	}
+	// stopping in one thread stops the others
+	std::atomic<int> visited(0);
+	ASSERT(!lqt.ForEachIntersectingParallel(everything, pool, [&visited](BoundingBox<NumberT>*) {
+		return ++visited < 10;
+	}));
+	ASSERT(visited >= 10);
+	ASSERT(visited < lqt.GetSize());
+}
+
+template <typename NumberT, typename TraitsT>
+void TestBatchedQueries() {
+	using Tree = LooseQuadtree<NumberT, BoundingBox<NumberT>, TrivialBBExtractor<NumberT>, TraitsT>;
+	std::minstd_rand rand;
+	std::uniform_int_distribution<int> coordinate(10000, 12000);
+	std::uniform_int_distribution<int> extent(1, 200);
+	std::vector<BoundingBox<NumberT>> objects = GenerateObjects<NumberT>(2000, rand);
+	Tree lqt;
+	std::vector<BoundingBox<NumberT>> regions;
+	std::vector<std::vector<BoundingBox<NumberT>*>> out;
+	lqt.QueryIntersectsRegions(regions, out);
+	ASSERT(out.empty());
+	regions.emplace_back(10000, 10000, 100, 100);
+	lqt.QueryIntersectsRegions(regions, out);
+	ASSERT(out.size() == 1 && out[0].empty());
+	for (auto& obj : objects) {
+		lqt.Insert(&obj);
+	}
+	for (std::size_t i = 0; i < objects.size(); i += 5) {
+		lqt.Remove(&objects[i]);
+	}
+	regions.clear();
+	regions.emplace_back(9000, 9000, 4000, 4000);
+	for (int i = 0; i < 200; i++) {
+		regions.emplace_back((NumberT)coordinate(rand), (NumberT)coordinate(rand),
+				(NumberT)(extent(rand) * (i % 3 == 2 ? 1 : 4)),
+				(NumberT)(extent(rand) * (i % 3 == 2 ? 1 : 4)));
+	}
+	// results are appended after what is in the vectors already
+	out.assign(1, std::vector<BoundingBox<NumberT>*>(1, &objects[0]));
+	lqt.QueryIntersectsRegions(regions, out);
+	ASSERT(out.size() == regions.size());
+	ASSERT(out[0].size() == (std::size_t)lqt.GetSize() + 1);
+	std::vector<BoundingBox<NumberT>*> expected;
+	std::size_t total = 0;
+	for (std::size_t i = 0; i < regions.size(); i++) {
+		expected.clear();
+		if (i == 0) {
+			expected.push_back(&objects[0]);
+		}
+		lqt.QueryIntersectsRegion(regions[i], expected);
+		ASSERT(out[i].size() == expected.size());
+		std::sort(out[i].begin(), out[i].end());
+		std::sort(expected.begin(), expected.end());
+		ASSERT(std::equal(expected.begin(), expected.end(), out[i].begin()));
+		total += expected.size();
+	}
+
+	// the visitor gets the index of the region and can stop early
+	std::size_t visited = 0;
+	bool finished = lqt.ForEachIntersectingRegions(regions,
+		[&](std::size_t region_index, BoundingBox<NumberT>* object) {
+			ASSERT(region_index < regions.size());
+			ASSERT(regions[region_index].Intersects(*object));
+			visited++;
+		});
+	ASSERT(finished);
+	ASSERT(visited + 1 == total);
+	visited = 0;
+	finished = lqt.ForEachIntersectingRegions(regions,
+		[&](std::size_t, BoundingBox<NumberT>*) {
+			return ++visited < 100;
+		});
+	ASSERT(!finished);
+	ASSERT(visited == 100);
+}
+
+template <typename NumberT>
+double TestSquaredDistance(double x, double y, const BoundingBox<NumberT>& box) {
+	double dx = std::max(std::max((double)box.left - x, x - (double)box.left - (double)box.width), 0.0);
+	double dy = std::max(std::max((double)box.top - y, y - (double)box.top - (double)box.height), 0.0);
+	return dx * dx + dy * dy;
+}
+
+template <typename NumberT, typename TraitsT>
+void TestNearest() {
+	using Tree = LooseQuadtree<NumberT, BoundingBox<NumberT>, TrivialBBExtractor<NumberT>, TraitsT>;
+	std::minstd_rand rand;
+	std::uniform_int_distribution<int> coordinate(10000, 12000);
+	std::vector<BoundingBox<NumberT>> objects = GenerateObjects<NumberT>(2000, rand);
+	Tree lqt;
+	std::vector<BoundingBox<NumberT>*> out;
+	lqt.QueryNearest((NumberT)11000, (NumberT)11000, 5, out);
+	ASSERT(out.empty());
+	for (auto& obj : objects) {
+		lqt.Insert(&obj);
+	}
+	for (std::size_t i = 0; i < objects.size(); i += 5) {
+		lqt.Remove(&objects[i]);
+	}
+	std::vector<double> expected;
+	for (int round = 0; round < 40; round++) {
+		// points are inside and outside of the area of the objects
+		NumberT x = (NumberT)(coordinate(rand) + (round % 4 == 3 ? 1500 : 0));
+		NumberT y = (NumberT)coordinate(rand);
+		int k = round % 5 == 0 ? 1 : round % 5 == 1 ? 50 : 10;
+		double max_distance = round % 3 == 0 ? 100.0 : std::numeric_limits<double>::infinity();
+		for (int user_distance = 0; user_distance < 2; user_distance++) {
+			// the distance from the center is never less than the one from the bounding box
+			auto center_distance = [x, y](BoundingBox<NumberT>* object) {
+				return std::sqrt(TestSquaredDistance((double)x, (double)y,
+					BoundingBox<NumberT>((NumberT)(object->left + object->width / 2),
+						(NumberT)(object->top + object->height / 2), 0, 0)));
+			};
+			auto distance = [&](BoundingBox<NumberT>* object) {
+				return user_distance == 0 ?
+					std::sqrt(TestSquaredDistance((double)x, (double)y, *object)) :
+					center_distance(object);
+			};
+			expected.clear();
+			for (std::size_t i = 0; i < objects.size(); i++) {
+				if (i % 5 != 0 && distance(&objects[i]) <= max_distance) {
+					expected.push_back(distance(&objects[i]));
+				}
+			}
+			std::sort(expected.begin(), expected.end());
+			expected.resize(std::min(expected.size(), (std::size_t)k));
+			// results are appended after what is in the vector already
+			out.assign(1, &objects[0]);
+			if (user_distance == 0) {
+				lqt.QueryNearest(x, y, k, out, max_distance);
+			}
+			else {
+				lqt.QueryNearest(x, y, k, out, max_distance, center_distance);
+			}
+			ASSERT(out.size() == expected.size() + 1);
+			ASSERT(out[0] == &objects[0]);
+			for (std::size_t i = 0; i < expected.size(); i++) {
+				ASSERT(distance(out[i + 1]) == expected[i]);
+			}
+		}
+	}
+	out.clear();
+	lqt.QueryNearest((NumberT)11000, (NumberT)11000, 10000, out);
+	ASSERT((int)out.size() == lqt.GetSize());
+	out.clear();
+	lqt.QueryNearest((NumberT)11000, (NumberT)11000, 0, out);
+	ASSERT(out.empty());
+}
+
+template <typename NumberT>
+bool TestRayEntry(double x, double y, double dx, double dy, double max_t,
+		const BoundingBox<NumberT>& box, double* entry_t) {
+	double right = (double)box.left + (double)box.width;
+	double bottom = (double)box.top + (double)box.height;
+	if ((dx == 0 && (x < (double)box.left || x > right)) ||
+			(dy == 0 && (y < (double)box.top || y > bottom))) {
+		return false;
+	}
+	double tx0 = dx == 0 ? 0 : std::min(((double)box.left - x) / dx, (right - x) / dx);
+	double tx1 = dx == 0 ? max_t : std::max(((double)box.left - x) / dx, (right - x) / dx);
+	double ty0 = dy == 0 ? 0 : std::min(((double)box.top - y) / dy, (bottom - y) / dy);
+	double ty1 = dy == 0 ? max_t : std::max(((double)box.top - y) / dy, (bottom - y) / dy);
+	*entry_t = std::max(std::max(tx0, ty0), 0.0);
+	return *entry_t <= std::min(std::min(tx1, ty1), max_t);
+}
+
+template <typename NumberT, typename TraitsT>
+void TestRays() {
+	using Tree = LooseQuadtree<NumberT, BoundingBox<NumberT>, TrivialBBExtractor<NumberT>, TraitsT>;
+	std::minstd_rand rand;
+	std::uniform_int_distribution<int> coordinate(10000, 12000);
+	std::uniform_int_distribution<int> direction(-10, 10);
+	std::vector<BoundingBox<NumberT>> objects = GenerateObjects<NumberT>(2000, rand);
+	Tree lqt;
+	std::vector<BoundingBox<NumberT>*> out;
+	lqt.QueryRay((NumberT)11000, (NumberT)11000, 1.0, 0.0, out);
+	ASSERT(out.empty());
+	ASSERT(lqt.QueryFirstHit((NumberT)11000, (NumberT)11000, 1.0, 0.0) == nullptr);
+	for (auto& obj : objects) {
+		lqt.Insert(&obj);
+	}
+	for (std::size_t i = 0; i < objects.size(); i += 5) {
+		lqt.Remove(&objects[i]);
+	}
+	std::vector<double> expected;
+	for (int round = 0; round < 60; round++) {
+		// rays start inside and outside of the area of the objects, some are axis aligned
+		NumberT x = (NumberT)(coordinate(rand) + (round % 4 == 3 ? 1500 : 0));
+		NumberT y = (NumberT)coordinate(rand);
+		double dx = (double)direction(rand) / 4;
+		double dy = round % 5 == 1 ? 0.0 : (double)direction(rand) / 4;
+		if (dx == 0 && dy == 0) {
+			dx = -1;
+		}
+		double max_t = round % 3 == 0 ? 500.0 : std::numeric_limits<double>::infinity();
+		double entry_t;
+		expected.clear();
+		for (std::size_t i = 0; i < objects.size(); i++) {
+			if (i % 5 != 0 && TestRayEntry((double)x, (double)y, dx, dy, max_t, objects[i],
+					&entry_t)) {
+				expected.push_back(entry_t);
+			}
+		}
+		std::sort(expected.begin(), expected.end());
+		// results are appended after what is in the vector already
+		out.assign(1, &objects[0]);
+		lqt.QueryRay(x, y, dx, dy, out, max_t);
+		ASSERT(out.size() == expected.size() + 1);
+		ASSERT(out[0] == &objects[0]);
+		for (std::size_t i = 0; i < expected.size(); i++) {
+			ASSERT(TestRayEntry((double)x, (double)y, dx, dy, max_t, *out[i + 1], &entry_t));
+			ASSERT(entry_t == expected[i]);
+		}
+		BoundingBox<NumberT>* first_hit = lqt.QueryFirstHit(x, y, dx, dy, max_t, &entry_t);
+		ASSERT((first_hit == nullptr) == expected.empty());
+		ASSERT(first_hit == nullptr || entry_t == expected[0]);
+		std::size_t visited = 0;
+		bool finished = lqt.ForEachOnRay(x, y, dx, dy, max_t,
+			[&](BoundingBox<NumberT>* object, double object_entry_t) {
+				ASSERT(object_entry_t == expected[visited]);
+				(void)object;
+				return ++visited < 3;
+			});
+		ASSERT(finished == (expected.size() < 3));
+		ASSERT(visited == std::min(expected.size(), (std::size_t)3));
+	}
+}
+
+template <typename NumberT, typename TraitsT>
+void TestShapeQueries() {
+	using Tree = LooseQuadtree<NumberT, BoundingBox<NumberT>, TrivialBBExtractor<NumberT>, TraitsT>;
+	using Point = std::pair<NumberT, NumberT>;
+	// the shapes themselves, touching does not count as intersecting
+	detail::Circle<NumberT> circle = {100.0, 100.0, 10.0};
+	ASSERT(circle.Intersects(BoundingBox<NumberT>(105, 105, 2, 2)));
+	ASSERT(!circle.Intersects(BoundingBox<NumberT>(108, 108, 2, 2)));
+	ASSERT(!circle.Intersects(BoundingBox<NumberT>(110, 95, 2, 2)));
+	ASSERT(circle.Contains(BoundingBox<NumberT>(95, 95, 10, 10)));
+	ASSERT(!circle.Contains(BoundingBox<NumberT>(92, 92, 16, 16)));
+	std::vector<Point> triangle = {Point(100, 100), Point(120, 100), Point(100, 120)};
+	for (int reversed = 0; reversed < 2; reversed++) {
+		detail::ConvexPolygon<NumberT> polygon(triangle);
+		ASSERT(polygon.Intersects(BoundingBox<NumberT>(105, 105, 2, 2)));
+		ASSERT(polygon.Intersects(BoundingBox<NumberT>(90, 90, 40, 40)));
+		ASSERT(!polygon.Intersects(BoundingBox<NumberT>(111, 111, 5, 5)));
+		ASSERT(!polygon.Intersects(BoundingBox<NumberT>(120, 100, 5, 5)));
+		ASSERT(polygon.Contains(BoundingBox<NumberT>(101, 101, 5, 5)));
+		ASSERT(!polygon.Contains(BoundingBox<NumberT>(101, 101, 15, 5)));
+		std::reverse(triangle.begin(), triangle.end());
+	}
+
+	std::minstd_rand rand;
+	std::uniform_int_distribution<int> coordinate(10000, 12000);
+	std::uniform_int_distribution<int> extent(1, 200);
+	std::vector<BoundingBox<NumberT>> objects = GenerateObjects<NumberT>(2000, rand);
+	Tree lqt;
+	std::vector<BoundingBox<NumberT>*> out;
+	lqt.QueryIntersectsCircle((NumberT)11000, (NumberT)11000, 100.0, out);
+	ASSERT(out.empty());
+	for (auto& obj : objects) {
+		lqt.Insert(&obj);
+	}
+	for (std::size_t i = 0; i < objects.size(); i += 5) {
+		lqt.Remove(&objects[i]);
+	}
+	std::vector<BoundingBox<NumberT>*> expected;
+	for (int round = 0; round < 40; round++) {
+		NumberT x = (NumberT)coordinate(rand);
+		NumberT y = (NumberT)coordinate(rand);
+		int size = extent(rand) * (round % 4 == 0 ? 10 : 2);
+		circle = {(double)x, (double)y, (double)size};
+		// a rotated quad, and a polygon with more sides
+		std::vector<Point> vertices;
+		int sides = round % 2 == 0 ? 4 : 7;
+		for (int i = 0; i < sides; i++) {
+			double angle = 6.283185307179586 * i / sides + round;
+			vertices.emplace_back((NumberT)((double)x + std::cos(angle) * size),
+				(NumberT)((double)y + std::sin(angle) * size));
+		}
+		detail::ConvexPolygon<NumberT> polygon(vertices);
+		for (int type = 0; type < 2; type++) {
+			expected.clear();
+			for (std::size_t i = 0; i < objects.size(); i++) {
+				if (i % 5 != 0 && (type == 0 ? circle.Intersects(objects[i]) :
+						polygon.Intersects(objects[i]))) {
+					expected.push_back(&objects[i]);
+				}
+			}
+			// results are appended after what is in the vector already
+			out.assign(1, &objects[0]);
+			if (type == 0) {
+				lqt.QueryIntersectsCircle(x, y, (double)size, out);
+			}
+			else {
+				lqt.QueryIntersectsConvexPolygon(vertices, out);
+			}
+			ASSERT(out.size() == expected.size() + 1);
+			ASSERT(out[0] == &objects[0]);
+			std::sort(out.begin() + 1, out.end());
+			std::sort(expected.begin(), expected.end());
+			ASSERT(std::equal(expected.begin(), expected.end(), out.begin() + 1));
+		}
+		std::size_t visited = 0;
+		bool finished = lqt.ForEachIntersectingCircle(x, y, (double)size,
+			[&visited](BoundingBox<NumberT>*) {
+				return ++visited < 5;
+			});
+		ASSERT(finished == (visited < 5));
+	}
+}
+
+template <typename NumberT, typename TraitsT>
+void TestCounting() {
+	using Tree = LooseQuadtree<NumberT, BoundingBox<NumberT>, TrivialBBExtractor<NumberT>, TraitsT>;
+	std::minstd_rand rand;
+	std::uniform_int_distribution<int> coordinate(10000, 12000);
+	std::uniform_int_distribution<int> extent(1, 200);
+	std::uniform_int_distribution<int> jitter(-30, 30);
+	std::uniform_int_distribution<std::size_t> index(0, 1999);
+	std::vector<BoundingBox<NumberT>> objects = GenerateObjects<NumberT>(2000, rand);
+	Tree lqt;
+	const BoundingBox<NumberT> everything(8000, 8000, 6000, 6000);
+	ASSERT(lqt.CountIntersectsRegion(everything) == 0);
+	ASSERT(lqt.CountInsideRegion(everything) == 0);
+	std::vector<BoundingBox<NumberT>*> pointers;
+	for (auto& obj : objects) {
+		pointers.push_back(&obj);
+	}
+	lqt.BulkLoad(pointers.begin(), pointers.begin() + 1000);
+	std::vector<BoundingBox<NumberT>*> out;
+	for (int round = 0; round < 30; round++) {
+		// every kind of change keeps the counts of the subtrees right
+		switch (round % 5) {
+		case 0:
+			for (std::size_t i = 1000; i < objects.size(); i += 7) {
+				lqt.Insert(&objects[i]);
+			}
+			break;
+		case 1:
+			for (int i = 0; i < 300; i++) {
+				BoundingBox<NumberT>& obj = objects[index(rand)];
+				if (lqt.Contains(&obj)) {
+					obj.left = (NumberT)(obj.left + (NumberT)(jitter(rand) * (i % 10 == 0 ? 20 : 1)));
+					obj.top = (NumberT)(obj.top + (NumberT)jitter(rand));
+					lqt.Update(&obj);
+				}
+			}
+			break;
+		case 2:
+			for (int i = 0; i < 200; i++) {
+				lqt.Remove(&objects[index(rand)]);
+			}
+			break;
+		case 3:
+			std::shuffle(pointers.begin(), pointers.end(), rand);
+			for (auto pointer : pointers) {
+				if (lqt.Contains(pointer)) {
+					pointer->left = (NumberT)(pointer->left + (NumberT)jitter(rand));
+				}
+			}
+			lqt.UpdateMany(pointers.begin(), pointers.begin() + 500);
+			for (std::size_t i = 500; i < pointers.size(); i++) {
+				if (lqt.Contains(pointers[i])) {
+					lqt.Update(pointers[i]);
+				}
+			}
+			break;
+		case 4:
+			lqt.RemoveMany(pointers.begin(), pointers.begin() + 300);
+			ASSERT(lqt.CountIntersectsRegion(everything) == lqt.GetSize());
+			lqt.ForceCleanup();
+			break;
+		}
+		ASSERT(lqt.CountIntersectsRegion(everything) == lqt.GetSize());
+		ASSERT(lqt.CountInsideRegion(everything) == lqt.GetSize());
+		for (int i = 0; i < 10; i++) {
+			BoundingBox<NumberT> region((NumberT)coordinate(rand), (NumberT)coordinate(rand),
+					(NumberT)(extent(rand) * (i % 2 == 0 ? 10 : 2)),
+					(NumberT)(extent(rand) * (i % 2 == 0 ? 10 : 2)));
+			out.clear();
+			lqt.QueryIntersectsRegion(region, out);
+			ASSERT(lqt.CountIntersectsRegion(region) == (int)out.size());
+			out.clear();
+			lqt.QueryInsideRegion(region, out);
+			ASSERT(lqt.CountInsideRegion(region) == (int)out.size());
+		}
+	}
+	lqt.Clear();
+	ASSERT(lqt.CountIntersectsRegion(everything) == 0);
+}
 
+template <typename NumberT, typename TraitsT>
+void TestIntersectingPairs() {
+	using Tree = LooseQuadtree<NumberT, BoundingBox<NumberT>, TrivialBBExtractor<NumberT>, TraitsT>;
+	using Pair = std::pair<BoundingBox<NumberT>*, BoundingBox<NumberT>*>;
+	std::minstd_rand rand;
+	std::uniform_int_distribution<int> coordinate(10000, 12000);
+	std::uniform_int_distribution<int> extent(1, 200);
+	std::vector<BoundingBox<NumberT>> objects = GenerateObjects<NumberT>(1500, rand);
+	// some objects sit on the borders between nodes, some of them without extent
+	for (int i = 0; i < 100; i++) {
+		objects.emplace_back((NumberT)(coordinate(rand) / 250 * 250), (NumberT)coordinate(rand),
+				(NumberT)(i % 3), (NumberT)(extent(rand) / 20));
+	}
+	Tree lqt;
+	std::vector<Pair> pairs;
+	auto collect = [&pairs](BoundingBox<NumberT>* a, BoundingBox<NumberT>* b) {
+		pairs.push_back(a < b ? Pair(a, b) : Pair(b, a));
+	};
+	ASSERT(lqt.ForEachIntersectingPair(collect));
+	ASSERT(pairs.empty());
+	for (auto& obj : objects) {
+		lqt.Insert(&obj);
+	}
+	for (std::size_t i = 0; i < objects.size(); i += 5) {
+		lqt.Remove(&objects[i]);
+	}
+	std::vector<Pair> expected;
+	for (std::size_t j = 0; j < objects.size(); j++) {
+		for (std::size_t i = 0; i < j; i++) {
+			if (i % 5 != 0 && j % 5 != 0 && objects[i].Intersects(objects[j])) {
+				expected.emplace_back(&objects[i], &objects[j]);
+			}
+		}
+	}
+	ASSERT(lqt.ForEachIntersectingPair(collect));
+	// every pair is reported exactly once
+	std::sort(pairs.begin(), pairs.end());
+	std::sort(expected.begin(), expected.end());
+	ASSERT(pairs == expected);
+	std::size_t visited = 0;
+	bool finished = lqt.ForEachIntersectingPair([&visited](BoundingBox<NumberT>*, BoundingBox<NumberT>*) {
+		return ++visited < 10;
+	});
+	ASSERT(!finished);
+	ASSERT(visited == 10);
+}
+
+template <typename NumberT>
+struct LabeledPoint {
+	NumberT x;
+	NumberT y;
+	NumberT radius;
+	int label;
+};
 
 template <typename NumberT>
+class LabeledPointExtractor {
+public:
+	static void ExtractBoundingBox(const LabeledPoint<NumberT>* object, BoundingBox<NumberT>* bbox) {
+		bbox->left = (NumberT)(object->x - object->radius);
+		bbox->top = (NumberT)(object->y - object->radius);
+		bbox->width = (NumberT)(object->radius * 2);
+		bbox->height = (NumberT)(object->radius * 2);
+	}
+};
+
+template <typename NumberT, typename TraitsT>
+void TestTreeJoin() {
+	using Tree = LooseQuadtree<NumberT, BoundingBox<NumberT>, TrivialBBExtractor<NumberT>, TraitsT>;
+	using OtherTree = LooseQuadtree<NumberT, LabeledPoint<NumberT>, LabeledPointExtractor<NumberT>>;
+	using Pair = std::pair<BoundingBox<NumberT>*, LabeledPoint<NumberT>*>;
+	std::minstd_rand rand;
+	std::uniform_int_distribution<int> coordinate(10000, 12000);
+	std::uniform_int_distribution<int> radius(1, 30);
+	std::vector<BoundingBox<NumberT>> objects = GenerateObjects<NumberT>(1500, rand);
+	// the other tree only partly overlaps with a root of its own, and is deeper
+	std::vector<LabeledPoint<NumberT>> points;
+	for (int i = 0; i < 3000; i++) {
+		points.push_back(LabeledPoint<NumberT>{(NumberT)((coordinate(rand) - 10000) / 2 + 11000),
+			(NumberT)((coordinate(rand) - 10000) / 2 + 10500), (NumberT)radius(rand), i});
+	}
+	Tree lqt;
+	OtherTree other;
+	std::vector<Pair> pairs;
+	auto collect = [&pairs](BoundingBox<NumberT>* object, LabeledPoint<NumberT>* point) {
+		pairs.emplace_back(object, point);
+	};
+	for (auto& point : points) {
+		other.Insert(&point);
+	}
+	ASSERT(lqt.ForEachIntersectingPair(other, collect));
+	ASSERT(pairs.empty());
+	for (auto& obj : objects) {
+		lqt.Insert(&obj);
+	}
+	for (std::size_t i = 0; i < objects.size(); i += 5) {
+		lqt.Remove(&objects[i]);
+	}
+	for (std::size_t i = 0; i < points.size(); i += 7) {
+		other.Remove(&points[i]);
+	}
+	std::vector<Pair> expected;
+	for (std::size_t i = 0; i < objects.size(); i++) {
+		for (std::size_t j = 0; j < points.size(); j++) {
+			BoundingBox<NumberT> point_bounds(0, 0, 0, 0);
+			LabeledPointExtractor<NumberT>::ExtractBoundingBox(&points[j], &point_bounds);
+			if (i % 5 != 0 && j % 7 != 0 && objects[i].Intersects(point_bounds)) {
+				expected.emplace_back(&objects[i], &points[j]);
+			}
+		}
+	}
+	ASSERT(!expected.empty());
+	ASSERT(lqt.ForEachIntersectingPair(other, collect));
+	// every pair is reported exactly once, in the order of the trees
+	std::sort(pairs.begin(), pairs.end());
+	std::sort(expected.begin(), expected.end());
+	ASSERT(pairs == expected);
+	std::size_t visited = 0;
+	bool finished = lqt.ForEachIntersectingPair(other,
+		[&visited](BoundingBox<NumberT>*, LabeledPoint<NumberT>*) {
+			return ++visited < 10;
+		});
+	ASSERT(!finished);
+	ASSERT(visited == 10);
+}
+
+struct UnmappedObjectPointersTraits : LooseQuadtreeTraits {
+	static const bool kMapObjectPointers = false;
+};
+
+template <typename NumberT, typename TraitsT>
+void TestMaintain() {
+	using Tree = LooseQuadtree<NumberT, BoundingBox<NumberT>, TrivialBBExtractor<NumberT>, TraitsT>;
+	std::minstd_rand rand;
+	std::uniform_int_distribution<int> coordinate(10000, 12000);
+	std::uniform_int_distribution<int> extent(1, 200);
+	std::uniform_int_distribution<int> jitter(-30, 30);
+	std::uniform_int_distribution<std::size_t> index(0, 2999);
+	std::vector<BoundingBox<NumberT>> objects;
+	for (int i = 0; i < 3000; i++) {
+		objects.emplace_back((NumberT)coordinate(rand), (NumberT)coordinate(rand),
+				(NumberT)(extent(rand) * extent(rand) / 400 + 1), (NumberT)(extent(rand) / 40 + 1));
+	}
+	const BoundingBox<NumberT> everything(9000, 9000, 4000, 4000);
+	Tree lqt;
+	ASSERT(lqt.Maintain(0));
+	for (auto& obj : objects) {
+		lqt.Insert(&obj);
+	}
+	// lowers the maximal depth, so the deepest nodes have to be emptied
+	for (std::size_t i = 0; i < objects.size(); i++) {
+		if (i % 8 != 0) {
+			lqt.Remove(&objects[i]);
+		}
+	}
+	std::vector<BoundingBox<NumberT>*> out;
+	std::vector<BoundingBox<NumberT>*> expected;
+	for (int round = 0; round < 6; round++) {
+		{
+			// nothing is done under running queries
+			auto query = lqt.QueryIntersectsRegion(everything);
+			ASSERT(!query.EndOfQuery());
+			ASSERT(!lqt.Maintain(1000));
+		}
+		ASSERT(!lqt.Maintain(1000000, std::chrono::microseconds(0)));
+		int steps = 0;
+		while (!lqt.Maintain(3)) {
+			steps++;
+			// the tree can change between the steps
+			BoundingBox<NumberT>& obj = objects[index(rand)];
+			if (steps % 3 == 0) {
+				lqt.Remove(&obj);
+			}
+			else {
+				obj.left = (NumberT)(obj.left + (NumberT)jitter(rand));
+				obj.top = (NumberT)(obj.top + (NumberT)jitter(rand));
+				lqt.Update(&obj);
+			}
+		}
+		ASSERT(steps > 10);
+		expected.clear();
+		for (auto& obj : objects) {
+			if (lqt.Contains(&obj)) {
+				expected.push_back(&obj);
+			}
+		}
+		out.clear();
+		lqt.QueryIntersectsRegion(everything, out);
+		std::sort(out.begin(), out.end());
+		ASSERT(out == expected);
+		ASSERT((int)expected.size() == lqt.GetSize());
+		ASSERT(lqt.CountIntersectsRegion(everything) == lqt.GetSize());
+	}
+	for (auto& obj : objects) {
+		lqt.Remove(&obj);
+	}
+	ASSERT(lqt.GetLooseBoundingBox().width > 0);
+	while (!lqt.Maintain(10, std::chrono::microseconds::max(), true)) {
+	}
+	ASSERT(lqt.GetLooseBoundingBox().width == 0);
+	ASSERT(lqt.Maintain(10));
+}
+
+template <typename NumberT, typename TraitsT>
+void TestHandles() {
+	using Tree = LooseQuadtree<NumberT, BoundingBox<NumberT>, TrivialBBExtractor<NumberT>, TraitsT>;
+	std::minstd_rand rand;
+	std::uniform_int_distribution<int> coordinate(10000, 12000);
+	std::uniform_int_distribution<int> extent(1, 60);
+	std::uniform_int_distribution<int> jitter(-20, 20);
+	std::uniform_int_distribution<std::size_t> index(0, 499);
+	std::vector<BoundingBox<NumberT>> objects;
+	for (int i = 0; i < 500; i++) {
+		objects.emplace_back((NumberT)coordinate(rand), (NumberT)coordinate(rand),
+				(NumberT)extent(rand), (NumberT)extent(rand));
+	}
+	Tree lqt;
+	typename Tree::Handle nothing;
+	ASSERT(!lqt.Contains(nothing));
+	ASSERT(!lqt.Remove(nothing));
+	std::vector<typename Tree::Handle> handles;
+	for (auto& obj : objects) {
+		handles.push_back(lqt.InsertWithHandle(&obj));
+		ASSERT(lqt.Contains(handles.back()));
+	}
+	ASSERT(lqt.GetSize() == (int)objects.size());
+	std::vector<bool> contained(objects.size(), true);
+	std::vector<bool> flags(objects.size());
+	for (int round = 0; round < 20; round++) {
+		for (std::size_t i = 0; i < objects.size(); i++) {
+			if (contained[i]) {
+				objects[i].left = (NumberT)(objects[i].left + (NumberT)jitter(rand));
+				objects[i].top = (NumberT)(objects[i].top + (NumberT)jitter(rand));
+				lqt.Update(handles[i]);
+			}
+		}
+		for (int i = 0; i < 20; i++) {
+			std::size_t id = index(rand);
+			if (contained[id]) {
+				ASSERT(lqt.Remove(handles[id]));
+				ASSERT(!lqt.Contains(handles[id]));
+				ASSERT(!lqt.Remove(handles[id]));
+				contained[id] = false;
+			}
+			else {
+				// the record of the stale handle might be reused, it still has to stay stale
+				typename Tree::Handle stale = handles[id];
+				objects[id] = BoundingBox<NumberT>((NumberT)coordinate(rand), (NumberT)coordinate(rand),
+						(NumberT)(extent(rand) * 8), (NumberT)extent(rand));
+				handles[id] = lqt.InsertWithHandle(&objects[id]);
+				ASSERT(!lqt.Contains(stale));
+				contained[id] = true;
+			}
+		}
+		// compaction moves the objects around within their nodes
+		if (round % 5 == 4) {
+			lqt.ForceCleanup();
+		}
+		int size = 0;
+		for (std::size_t i = 0; i < objects.size(); i++) {
+			ASSERT(lqt.Contains(handles[i]) == contained[i]);
+			size += contained[i] ? 1 : 0;
+		}
+		ASSERT(lqt.GetSize() == size);
+		BoundingBox<NumberT> query_region((NumberT)coordinate(rand), (NumberT)coordinate(rand),
+				(NumberT)(extent(rand) * 10), (NumberT)(extent(rand) * 10));
+		for (std::size_t i = 0; i < flags.size(); i++) {
+			flags[i] = false;
+		}
+		auto query = lqt.QueryIntersectsRegion(query_region);
+		while (!query.EndOfQuery()) {
+			std::size_t id = (std::size_t)(query.GetCurrent() - &objects[0]);
+			ASSERT(id < objects.size());
+			ASSERT(!flags[id]);
+			flags[id] = true;
+			query.Next();
+		}
+		for (std::size_t i = 0; i < flags.size(); i++) {
+			ASSERT(flags[i] == (contained[i] && query_region.Intersects(objects[i])));
+		}
+	}
+	lqt.Clear();
+	for (std::size_t i = 0; i < handles.size(); i++) {
+		ASSERT(!lqt.Contains(handles[i]));
+	}
+	ASSERT(lqt.Contains(lqt.InsertWithHandle(&objects[0])));
+	lqt.Clear();
+}
+
+template <typename NumberT>
+void TestHandlesWithObjectPointers() {
+	using Tree = LooseQuadtree<NumberT, BoundingBox<NumberT>, TrivialBBExtractor<NumberT>>;
+	std::vector<BoundingBox<NumberT>> objects;
+	for (int i = 0; i < 10; i++) {
+		objects.emplace_back((NumberT)(10000 + i * 10), (NumberT)10000, (NumberT)5, (NumberT)5);
+	}
+	Tree lqt;
+	typename Tree::Handle handle = lqt.InsertWithHandle(&objects[0]);
+	ASSERT(lqt.Contains(&objects[0]));
+	objects[0].left = (NumberT)11000;
+	typename Tree::Handle same = lqt.InsertWithHandle(&objects[0]);
+	ASSERT(lqt.Contains(handle) && lqt.Contains(same));
+	ASSERT(lqt.GetSize() == 1);
+	ASSERT(lqt.Remove(&objects[0]));
+	ASSERT(!lqt.Contains(handle));
+	ASSERT(lqt.Insert(&objects[1]));
+	handle = lqt.InsertWithHandle(&objects[1]);
+	ASSERT(lqt.Remove(handle));
+	ASSERT(!lqt.Contains(&objects[1]));
+	ASSERT(lqt.IsEmpty());
+}
+
+
+
+template <typename NumberT, typename TraitsT = LooseQuadtreeTraits>
 void StressTest() {
 #ifndef NDEBUG
 	const int objects_generated = 10000;
@@ -623,7 +2542,7 @@ void StressTest() {
 	std::vector<BoundingBox<NumberT>> objects;
 	objects.reserve(objects_generated);
 	std::vector<bool> flags(objects_generated, false);
-	LooseQuadtree<NumberT, BoundingBox<NumberT>, TrivialBBExtractor<NumberT>> lqt;
+	LooseQuadtree<NumberT, BoundingBox<NumberT>, TrivialBBExtractor<NumberT>, TraitsT> lqt;
 	for (std::size_t i = 0; i < objects_generated; i++) {
 		objects.emplace_back((NumberT)coordinate(rand), (NumberT)coordinate(rand),
 				(NumberT)distance(rand), (NumberT)distance(rand));
@@ -651,7 +2570,7 @@ void StressTest() {
 				BoundingBox<NumberT>* obj = query.GetCurrent();
 				ASSERT(query_region.Intersects(*obj));
 				std::size_t id = (std::size_t)(obj - &objects[0]);
-				ASSERT(id >= 0 && id < objects_generated);
+				ASSERT(id < objects_generated);
 				flags[id] = true;
 				query.Next();
 			}
@@ -665,7 +2584,7 @@ void StressTest() {
 				BoundingBox<NumberT>* obj = query.GetCurrent();
 				ASSERT(query_region.Contains(*obj));
 				std::size_t id = (std::size_t)(obj - &objects[0]);
-				ASSERT(id >= 0 && id < objects_generated);
+				ASSERT(id < objects_generated);
 				flags[id] = true;
 				query.Next();
 			}
@@ -679,7 +2598,7 @@ void StressTest() {
 				BoundingBox<NumberT>* obj = query.GetCurrent();
 				ASSERT(obj->Contains(query_region));
 				std::size_t id = (std::size_t)(obj - &objects[0]);
-				ASSERT(id >= 0 && id < objects_generated);
+				ASSERT(id < objects_generated);
 				flags[id] = true;
 				query.Next();
 			}
@@ -700,9 +2619,52 @@ void RunTests(const char* type_str) {
 	auto start = std::chrono::high_resolution_clock::now();
 	TestBoundingBox<NumberT>();
 	TestTraversals<NumberT>();
+	TestBoundsKernel<NumberT>(&detail::BoundsTester<NumberT>::Test);
 	TestContainer<NumberT>();
 	TestQueries<NumberT>();
+	TestLooseBoundsBelowZero<NumberT>();
+	TestCachedBoundingBoxes<NumberT>();
+	TestSmallMoves<NumberT, LooseQuadtreeTraits>();
+	TestSmallMoves<NumberT, CachedBoundingBoxesTraits>();
+	TestBulkLoad<NumberT, LooseQuadtreeTraits>();
+	TestBulkLoad<NumberT, CachedBoundingBoxesTraits>();
+	TestBatchUpdates<NumberT, LooseQuadtreeTraits>();
+	TestBatchUpdates<NumberT, CachedBoundingBoxesTraits>();
+	TestForEach<NumberT, LooseQuadtreeTraits>();
+	TestForEach<NumberT, CachedBoundingBoxesTraits>();
+	TestQueryIntoVector<NumberT, LooseQuadtreeTraits>();
+	TestQueryIntoVector<NumberT, CachedBoundingBoxesTraits>();
+	TestQueryPoolAndLocalQueries<NumberT, LooseQuadtreeTraits>();
+	TestQueryPoolAndLocalQueries<NumberT, CachedBoundingBoxesTraits>();
+	TestConstQueries<NumberT, LooseQuadtreeTraits>();
+	TestConstQueries<NumberT, CachedBoundingBoxesTraits>();
+	TestParallelQueries<NumberT, LooseQuadtreeTraits>();
+	TestParallelQueries<NumberT, CachedBoundingBoxesTraits>();
+	TestConcurrentQuadtree<NumberT, LooseQuadtreeTraits>();
+	TestConcurrentQuadtree<NumberT, CachedBoundingBoxesTraits>();
+	TestSnapshots<NumberT, LooseQuadtreeTraits>();
+	TestSnapshots<NumberT, CachedBoundingBoxesTraits>();
+	TestBatchedQueries<NumberT, LooseQuadtreeTraits>();
+	TestBatchedQueries<NumberT, CachedBoundingBoxesTraits>();
+	TestNearest<NumberT, LooseQuadtreeTraits>();
+	TestNearest<NumberT, CachedBoundingBoxesTraits>();
+	TestRays<NumberT, LooseQuadtreeTraits>();
+	TestRays<NumberT, CachedBoundingBoxesTraits>();
+	TestShapeQueries<NumberT, LooseQuadtreeTraits>();
+	TestShapeQueries<NumberT, CachedBoundingBoxesTraits>();
+	TestCounting<NumberT, LooseQuadtreeTraits>();
+	TestCounting<NumberT, CachedBoundingBoxesTraits>();
+	TestIntersectingPairs<NumberT, LooseQuadtreeTraits>();
+	TestIntersectingPairs<NumberT, CachedBoundingBoxesTraits>();
+	TestTreeJoin<NumberT, LooseQuadtreeTraits>();
+	TestTreeJoin<NumberT, CachedBoundingBoxesTraits>();
+	TestMaintain<NumberT, LooseQuadtreeTraits>();
+	TestMaintain<NumberT, CachedBoundingBoxesTraits>();
+	TestHandles<NumberT, LooseQuadtreeTraits>();
+	TestHandles<NumberT, UnmappedObjectPointersTraits>();
+	TestHandlesWithObjectPointers<NumberT>();
 	StressTest<NumberT>();
+	StressTest<NumberT, CachedBoundingBoxesTraits>();
 	auto end = std::chrono::high_resolution_clock::now();
 	std::chrono::duration<double> time = end - start;
 	printf("took %f seconds\n", time.count());
@@ -713,6 +2675,10 @@ void RunTests(const char* type_str) {
 int main(int, char*[]) {
 	puts("***** Testing is about to start *****");
 	printf("***** This system is %lu-bit\n", sizeof(void*) * 8);
+	TestBlocksAllocator();
+	TestChunkedObjectList();
+	TestPointerMap();
+	TestVectorizedBoundsKernels();
 	RunTests<float>("float");
 	RunTests<double>("double");
 	RunTests<long double>("long double");